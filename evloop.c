@@ -0,0 +1,279 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * Edge-triggered event loop: descriptors, timers and signals
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* sigset_t and friends are POSIX, not ANSI */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "evloop.h"
+
+/* wakeups taken from the kernel per epoll_wait() */
+#define EV_BATCH    16
+
+static int epfd = -1;
+
+/* once, before anything is added */
+int ev_init(void)
+{
+    if (epfd >= 0)
+	return 0;
+    if ((epfd = epoll_create(EV_BATCH)) < 0) {
+	perror("pppoe: epoll_create (ev_init)");
+	return -1;
+    }
+    return 0;
+}
+
+int ev_add(struct ev_handler *h, int fd, unsigned int events,
+	   void (*cb)(struct ev_handler *h), void *arg)
+{
+    struct epoll_event ev;
+
+    h->fd = fd;
+    h->events = 0;
+    h->cb = cb;
+    h->arg = arg;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLET;
+    if (events & EV_IN)
+	ev.events |= EPOLLIN;
+    if (events & EV_OUT)
+	ev.events |= EPOLLOUT;
+    ev.data.ptr = h;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	perror("pppoe: epoll_ctl (ev_add)");
+	return -1;
+    }
+    return 0;
+}
+
+/* the descriptor itself is left open */
+void ev_del(struct ev_handler *h)
+{
+    struct epoll_event ev;
+
+    if (h->fd < 0)
+	return;
+    /* kernels before 2.6.9 want an event even though it is ignored */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, &ev);
+    h->fd = -1;
+}
+
+/*
+ * Wait up to timeout ms (-1 for ever) and call the handler of every
+ * descriptor that became ready.  Returns the number of handlers called,
+ * 0 on timeout or an interrupted wait, and -1 on error.
+ */
+int ev_run(int timeout)
+{
+    struct epoll_event ev[EV_BATCH];
+    struct ev_handler *h;
+    int i, n;
+
+    if ((n = epoll_wait(epfd, ev, EV_BATCH, timeout)) < 0) {
+	if (errno == EINTR)
+	    return 0;
+	perror("pppoe: epoll_wait (ev_run)");
+	return -1;
+    }
+    for (i = 0; i < n; i++) {
+	h = ev[i].data.ptr;
+	h->events = 0;
+	if (ev[i].events & EPOLLIN)
+	    h->events |= EV_IN;
+	if (ev[i].events & EPOLLOUT)
+	    h->events |= EV_OUT;
+	if (ev[i].events & (EPOLLHUP | EPOLLERR))
+	    h->events |= EV_HUP | EV_IN;
+	h->cb(h);
+    }
+    return n;
+}
+
+int ev_timer(struct ev_handler *h, void (*cb)(struct ev_handler *h),
+	     void *arg)
+{
+    int fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+	perror("pppoe: timerfd_create (ev_timer)");
+	return -1;
+    }
+    if (ev_add(h, fd, EV_IN, cb, arg) < 0) {
+	close(fd);
+	return -1;
+    }
+    return 0;
+}
+
+/* fire in ms, then every interval ms unless interval is 0 */
+int ev_timer_set(struct ev_handler *h, long ms, long interval)
+{
+    struct itimerspec its;
+
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    its.it_interval.tv_sec = interval / 1000;
+    its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+    /* disarming also drops an expiry not read yet */
+    if (ms == 0)
+	ev_timer_read(h);
+    return timerfd_settime(h->fd, 0, &its, NULL);
+}
+
+/* expiries since the last call */
+unsigned long ev_timer_read(struct ev_handler *h)
+{
+    uint64_t n;
+
+    if (read(h->fd, &n, sizeof(n)) != sizeof(n))
+	return 0;
+    return (unsigned long)n;
+}
+
+/* ms on a clock that only goes forward, to tell how long something took */
+long ev_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* the wheel behind ev_tmo_set(), and the timer turning it */
+static struct ev_tmo *wheel[EV_SLOTS];
+static struct ev_handler wheel_timer;
+static unsigned long wheel_now;     /* ticks turned so far */
+static int wheel_pending;
+
+static void tmo_cancel(struct ev_tmo *t)
+{
+    if (t->pprev == NULL)
+	return;
+    if ((*t->pprev = t->next) != NULL)
+	t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    if (--wheel_pending == 0)
+	ev_timer_set(&wheel_timer, 0, 0);
+}
+
+static void wheel_turn(struct ev_handler *h)
+{
+    struct ev_tmo *t, **slot;
+    unsigned long n = ev_timer_read(h);
+
+    while (n-- > 0 && wheel_pending > 0) {
+	slot = &wheel[++wheel_now % EV_SLOTS];
+	t = *slot;
+	while (t != NULL) {
+	    if ((long)(t->expires - wheel_now) > 0) {
+		t = t->next; /* a later turn */
+		continue;
+	    }
+	    tmo_cancel(t);
+	    t->cb(t);
+	    /* which may have set or cancelled any of them */
+	    t = *slot;
+	}
+    }
+}
+
+void ev_tmo(struct ev_tmo *t, void (*cb)(struct ev_tmo *t), void *arg)
+{
+    memset(t, 0, sizeof(*t));
+    t->cb = cb;
+    t->arg = arg;
+}
+
+/*
+ * Have the callback of t called in ms, once; setting a pending timeout
+ * moves it.  The wheel starts turning with the first one.
+ */
+int ev_tmo_set(struct ev_tmo *t, long ms)
+{
+    struct ev_tmo **slot;
+
+    tmo_cancel(t);
+    if (ms <= 0)
+	return 0;
+    if (wheel_timer.cb == NULL &&
+	ev_timer(&wheel_timer, wheel_turn, NULL) < 0)
+	return -1;
+    /* the tick under way may be nearly over: count from the next one */
+    t->expires = wheel_now + 1 + (ms + EV_TICK - 1) / EV_TICK;
+    slot = &wheel[t->expires % EV_SLOTS];
+    if ((t->next = *slot) != NULL)
+	t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    if (wheel_pending++ == 0)
+	ev_timer_set(&wheel_timer, EV_TICK, EV_TICK);
+    return 0;
+}
+
+/*
+ * Take sigs away from asynchronous delivery and have cb called when one
+ * of them is pending; ev_signal_read() tells which.
+ */
+int ev_signal(struct ev_handler *h, const int *sigs, int n,
+	      void (*cb)(struct ev_handler *h), void *arg)
+{
+    sigset_t set;
+    int i, fd;
+
+    sigemptyset(&set);
+    for (i = 0; i < n; i++)
+	sigaddset(&set, sigs[i]);
+    /* blocked first, or one could slip through in between */
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    if ((fd = signalfd(-1, &set, SFD_NONBLOCK)) < 0) {
+	perror("pppoe: signalfd (ev_signal)");
+	goto fail;
+    }
+    if (ev_add(h, fd, EV_IN, cb, arg) < 0) {
+	close(fd);
+	goto fail;
+    }
+    return 0;
+
+fail:
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    return -1;
+}
+
+/* next pending signal, 0 once there is none left */
+int ev_signal_read(struct ev_handler *h)
+{
+    struct signalfd_siginfo si;
+
+    if (read(h->fd, &si, sizeof(si)) != sizeof(si))
+	return 0;
+    return (int)si.ssi_signo;
+}
@@ -0,0 +1,80 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * Edge-triggered event loop: descriptors, timers and signals
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PPPOE_EVLOOP_H_
+#define _PPPOE_EVLOOP_H_
+
+/* what woke a handler up */
+#define EV_IN       0x01
+#define EV_OUT      0x02
+#define EV_HUP      0x04
+
+/*
+ * One descriptor watched by the loop.  The handler is owned by the
+ * caller and registered once; it is only called when the descriptor
+ * becomes ready, not while it stays ready, so the callback must take
+ * everything there is before it returns.
+ */
+struct ev_handler {
+    int             fd;
+    unsigned int    events;     /* EV_* seen by this wakeup */
+    void            (*cb)(struct ev_handler *h);
+    void            *arg;
+};
+
+int  ev_init(void);
+int  ev_add(struct ev_handler *h, int fd, unsigned int events,
+	    void (*cb)(struct ev_handler *h), void *arg);
+void ev_del(struct ev_handler *h);
+int  ev_run(int timeout);
+
+/* timers are descriptors too: arm with ev_timer_set(), 0 ms disarms */
+int  ev_timer(struct ev_handler *h, void (*cb)(struct ev_handler *h),
+	      void *arg);
+int  ev_timer_set(struct ev_handler *h, long ms, long interval);
+unsigned long ev_timer_read(struct ev_handler *h);
+long ev_now(void);
+
+/*
+ * Timeouts by the hundred on one timer: a wheel of EV_SLOTS slots,
+ * EV_TICK ms apart, turning only while one is pending.  A timeout fires
+ * up to a tick late, never early; one longer than a turn stays in its
+ * slot until its turn comes round.  The caller owns each struct ev_tmo.
+ */
+#define EV_TICK     50
+#define EV_SLOTS    256
+
+struct ev_tmo {
+    struct ev_tmo   *next, **pprev; /* pprev is NULL while not pending */
+    unsigned long   expires;    /* tick it is due at */
+    void            (*cb)(struct ev_tmo *t);
+    void            *arg;
+};
+
+/* as with timers: set up once, then arm with ev_tmo_set(), 0 ms cancels */
+void ev_tmo(struct ev_tmo *t, void (*cb)(struct ev_tmo *t), void *arg);
+int  ev_tmo_set(struct ev_tmo *t, long ms);
+#define ev_tmo_pending(t)   ((t)->pprev != NULL)
+
+/* signals: blocked, and delivered through the loop one at a time */
+int  ev_signal(struct ev_handler *h, const int *sigs, int n,
+	       void (*cb)(struct ev_handler *h), void *arg);
+int  ev_signal_read(struct ev_handler *h);
+
+#endif /* _PPPOE_EVLOOP_H_ */
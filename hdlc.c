@@ -0,0 +1,582 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * RFC 1662 HDLC-like framing used on the pppd side of the relay
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <string.h>
+
+#include "hdlc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(HDLC_NO_SIMD)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+unsigned short fcstab[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+/*
+ * fcstab8[k][b] is what byte b followed by k more bytes contributes to
+ * the FCS, so eight bytes can be folded in with eight independent lookups
+ * ("slice-by-8") instead of eight dependent ones through fcstab.
+ */
+static unsigned short fcstab8[8][256];
+
+static void fcs_init(void)
+{
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+	fcstab8[0][i] = fcstab[i];
+	for (k = 1; k < 8; k++)
+	    fcstab8[k][i] = (fcstab8[k - 1][i] >> 8) ^
+			    fcstab[fcstab8[k - 1][i] & 0xff];
+    }
+}
+
+/*
+ * Run the FCS over len bytes from src and, unless dst is NULL, copy them
+ * to dst in the same pass.  dst may lie below src in the same buffer.
+ */
+static unsigned short fcs_copy(unsigned short fcs, unsigned char *dst,
+			       const unsigned char *src, int len)
+{
+    unsigned char b[8];
+
+    for (; len >= 8; len -= 8) {
+	memcpy(b, src, 8);
+	src += 8;
+	if (dst) {
+	    memcpy(dst, b, 8);
+	    dst += 8;
+	}
+	fcs = fcstab8[7][(b[0] ^ fcs) & 0xff] ^ fcstab8[6][b[1] ^ (fcs >> 8)] ^
+	      fcstab8[5][b[2]] ^ fcstab8[4][b[3]] ^
+	      fcstab8[3][b[4]] ^ fcstab8[2][b[5]] ^
+	      fcstab8[1][b[6]] ^ fcstab8[0][b[7]];
+    }
+    while (len--) {
+	b[0] = *src++;
+	if (dst)
+	    *dst++ = b[0];
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ b[0]) & 0xff];
+    }
+    return fcs;
+}
+
+/*
+ * Calculate a new fcs given the current fcs and the new data.
+ */
+unsigned short pppfcs16(register unsigned short fcs,
+			register unsigned char * cp,
+			register int len)
+{
+/*    assert(sizeof (unsigned short) == 2);
+    assert(((unsigned short) -1) > 0); */
+
+    return fcs_copy(fcs, NULL, cp, len);
+}
+
+/*
+ * Finding the bytes that need work.  scan_esc() returns how many bytes
+ * from p on can be sent to pppd as they are (no flag, escape or control
+ * character), scan_flag() how many can be taken from pppd as they are (no
+ * flag or escape).  Both test a machine word or a vector at a time; the
+ * best version for the CPU is picked by hdlc_init().
+ */
+#define SWAR_ONES       (~0UL / 0xff)           /* 0x0101...01 */
+#define SWAR_HIGH       (SWAR_ONES * 0x80)
+#define SWAR_ZERO(x)    (((x) - SWAR_ONES) & ~(x) & SWAR_HIGH)
+#define SWAR_LESS(x, n) (((x) - SWAR_ONES * (n)) & ~(x) & SWAR_HIGH)
+#define SWAR_EQ(x, c)   SWAR_ZERO((x) ^ (SWAR_ONES * (c)))
+
+#define NEEDS_ESC(c)    ((c) < 0x20 || (c) == FRAME_FLAG || (c) == FRAME_ESC)
+
+static int scan_esc_word(const unsigned char *p, int len)
+{
+    unsigned long w;
+    int i;
+
+    /* the tests only say whether a word holds such a byte, not where */
+    for (i = 0; i + (int)sizeof(w) <= len; i += sizeof(w)) {
+	memcpy(&w, p + i, sizeof(w));
+	if (SWAR_LESS(w, 0x20) | SWAR_EQ(w, FRAME_FLAG) | SWAR_EQ(w, FRAME_ESC))
+	    break;
+    }
+    for (; i < len; i++)
+	if (NEEDS_ESC(p[i]))
+	    break;
+    return i;
+}
+
+static int scan_flag_word(const unsigned char *p, int len)
+{
+    unsigned long w;
+    int i;
+
+    for (i = 0; i + (int)sizeof(w) <= len; i += sizeof(w)) {
+	memcpy(&w, p + i, sizeof(w));
+	if (SWAR_EQ(w, FRAME_FLAG) | SWAR_EQ(w, FRAME_ESC))
+	    break;
+    }
+    for (; i < len; i++)
+	if (p[i] == FRAME_FLAG || p[i] == FRAME_ESC)
+	    break;
+    return i;
+}
+
+#ifdef HAVE_X86_SIMD
+/* bytes x <= 0x1f are those min(x, 0x1f) leaves alone */
+static int __attribute__((target("sse2")))
+scan_esc_sse2(const unsigned char *p, int len)
+{
+    const __m128i flag = _mm_set1_epi8(FRAME_FLAG);
+    const __m128i esc = _mm_set1_epi8(FRAME_ESC);
+    const __m128i ctl = _mm_set1_epi8(0x1f);
+    __m128i x;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(p + i));
+	mask = _mm_movemask_epi8(
+	    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, flag),
+				      _mm_cmpeq_epi8(x, esc)),
+			 _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_esc_word(p + i, len - i);
+}
+
+static int __attribute__((target("sse2")))
+scan_flag_sse2(const unsigned char *p, int len)
+{
+    const __m128i flag = _mm_set1_epi8(FRAME_FLAG);
+    const __m128i esc = _mm_set1_epi8(FRAME_ESC);
+    __m128i x;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(p + i));
+	mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, flag),
+					      _mm_cmpeq_epi8(x, esc)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_flag_word(p + i, len - i);
+}
+
+static int __attribute__((target("avx2")))
+scan_esc_avx2(const unsigned char *p, int len)
+{
+    const __m256i flag = _mm256_set1_epi8(FRAME_FLAG);
+    const __m256i esc = _mm256_set1_epi8(FRAME_ESC);
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    __m256i x;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(p + i));
+	mask = _mm256_movemask_epi8(
+	    _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, flag),
+					    _mm256_cmpeq_epi8(x, esc)),
+			    _mm256_cmpeq_epi8(_mm256_min_epu8(x, ctl), x)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_esc_sse2(p + i, len - i);
+}
+
+static int __attribute__((target("avx2")))
+scan_flag_avx2(const unsigned char *p, int len)
+{
+    const __m256i flag = _mm256_set1_epi8(FRAME_FLAG);
+    const __m256i esc = _mm256_set1_epi8(FRAME_ESC);
+    __m256i x;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(p + i));
+	mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, flag),
+						    _mm256_cmpeq_epi8(x, esc)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_flag_sse2(p + i, len - i);
+}
+#endif /* HAVE_X86_SIMD */
+
+static int (*scan_esc)(const unsigned char *p, int len) = scan_esc_word;
+static int (*scan_flag)(const unsigned char *p, int len) = scan_flag_word;
+
+/*
+ * Build the FCS tables and pick the scanners.  Once, before any frame is
+ * framed or de-framed, and before a second thread can get at them: both
+ * are only read from then on.
+ */
+void hdlc_init(void)
+{
+    fcs_init();
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	scan_esc = scan_esc_avx2;
+	scan_flag = scan_flag_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+	scan_esc = scan_esc_sse2;
+	scan_flag = scan_flag_sse2;
+    }
+#endif
+}
+
+void hdlc_rx_init(struct hdlc_rx *rx, int mru, int pass_bad)
+{
+    memset(rx, 0, sizeof(*rx));
+    rx->state = HDLC_HUNT; /* pppd opens every burst with a flag */
+    rx->mru = mru;
+    rx->pass_bad = pass_bad;
+}
+
+/*
+ * Hand the de-framer a new run of raw bytes.  If a frame is open, buf
+ * must not lie below rx->out, or decoding would overwrite unread input.
+ */
+void hdlc_rx_feed(struct hdlc_rx *rx, unsigned char *buf, int len)
+{
+    rx->in = buf;
+    rx->end = buf + len;
+    if (rx->state == HDLC_HUNT)
+	rx->frame = rx->out = rx->dst ? rx->dst : buf;
+}
+
+/* number of decoded bytes held by the open frame */
+int hdlc_rx_pending(struct hdlc_rx *rx)
+{
+    if (rx->state == HDLC_HUNT)
+	return 0;
+    return rx->out - rx->frame;
+}
+
+/* move the open frame to 'to'; the areas may overlap */
+void hdlc_rx_rebase(struct hdlc_rx *rx, unsigned char *to)
+{
+    int n = hdlc_rx_pending(rx);
+
+    if (n > 0 && to != rx->frame)
+	memmove(to, rx->frame, n);
+    rx->frame = to;
+    rx->out = to + n;
+}
+
+/* attach a receive ring; the first 'headroom' bytes are left to the caller */
+void hdlc_rx_ring(struct hdlc_rx *rx, unsigned char *ring, int size,
+		  int headroom)
+{
+    rx->base = ring + headroom;
+    rx->limit = ring + size;
+    hdlc_rx_rebase(rx, rx->base);
+}
+
+/*
+ * Where the next read from pppd goes, and how much it may take.  Reads
+ * follow each other through the ring so an open frame grows in place; the
+ * ring only starts over when nothing is pending or when less than 'want'
+ * bytes are left, and only then is the open frame moved to the front.
+ */
+int hdlc_rx_space(struct hdlc_rx *rx, unsigned char **rd, int want)
+{
+    if (rx->dst) {
+	*rd = rx->base;
+	return rx->limit - rx->base;
+    }
+    if (hdlc_rx_pending(rx) == 0 || rx->limit - rx->out < want)
+	hdlc_rx_rebase(rx, rx->base);
+    *rd = rx->out;
+    return rx->limit - rx->out;
+}
+
+/*
+ * Decode the open frame and the ones after it at 'dst' rather than over
+ * the raw input.  The open frame is moved there, which costs nothing right
+ * after hdlc_rx_frame() has returned one.
+ */
+void hdlc_rx_target(struct hdlc_rx *rx, unsigned char *dst)
+{
+    rx->dst = dst;
+    hdlc_rx_rebase(rx, dst);
+}
+
+/*
+ * Run the state machine until a complete frame has been decoded or the
+ * input is exhausted.  Returns 1 with the frame (address/control field
+ * included, FCS stripped) through frame and len, 0 when more input is
+ * needed.
+ * The returned frame stays valid until the next hdlc_rx_feed(), or with a
+ * target set, until the next call.
+ */
+int hdlc_rx_frame(struct hdlc_rx *rx, unsigned char **frame, int *len)
+{
+    register unsigned char *in = rx->in, *end = rx->end, *out = rx->out;
+    register unsigned short fcs = rx->fcs;
+    register unsigned char c;
+    int state = rx->state, n, run, found = 0;
+
+    while (in < end) {
+	/* take the run up to the next flag or escape in one go, unescaping
+	   and checking it in a single pass */
+	if (state == HDLC_HUNT)
+	    in += scan_flag(in, end - in);
+	else if (state == HDLC_DATA && (run = scan_flag(in, end - in)) > 0) {
+	    n = rx->mru - (out - rx->frame);
+	    if (run > n)
+		run = n;        /* the byte after it makes a giant */
+	    fcs = fcs_copy(fcs, out != in ? out : NULL, in, run);
+	    out += run;
+	    in += run;
+	}
+	if (in == end)
+	    break;
+	c = *in++;
+
+	if (c == FRAME_FLAG) {
+	    n = out - rx->frame;
+	    if (state == HDLC_ESC)
+		rx->aborts++;           /* 7d 7e: abort sequence */
+	    if (state != HDLC_DATA)
+		n = 0;
+	    else if (n > 0 && n < HDLC_MINFRAME)
+		rx->runts++;
+
+	    if (n >= HDLC_MINFRAME) {
+		if (fcs == PPPGOODFCS16)
+		    rx->frames++;
+		else
+		    rx->bad_fcs++;
+		if (fcs == PPPGOODFCS16 || rx->pass_bad) {
+		    *frame = rx->frame;
+		    *len = n - 2;
+		    found = 1;
+		}
+	    }
+
+	    /* the flag closing this frame also opens the next one */
+	    state = HDLC_DATA;
+	    fcs = PPPINITFCS16;
+	    rx->frame = out = rx->dst ? rx->dst : in;
+	    if (found)
+		break;
+	    continue;
+	}
+
+	if (state == HDLC_HUNT)
+	    continue;
+
+	if (c == FRAME_ESC) {
+	    state = HDLC_ESC;
+	    continue;
+	}
+
+	if (state == HDLC_ESC) {
+	    c ^= FRAME_ENC;
+	    state = HDLC_DATA;
+	}
+
+	if (out - rx->frame >= rx->mru) {
+	    rx->giants++;
+	    state = HDLC_HUNT;
+	    continue;
+	}
+
+	*out++ = c;
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ c) & 0xff];
+    }
+
+    rx->in = in;
+    rx->out = out;
+    rx->fcs = fcs;
+    rx->state = state;
+    return found;
+}
+
+#define ADD_OUT(c) { *out++ = (c); }
+#define ADD_TX(c)  { if (esc ? esc[c] : NEEDS_ESC(c)) \
+			{ ADD_OUT(FRAME_ESC); ADD_OUT((c) ^ FRAME_ENC); } \
+		     else ADD_OUT(c); }
+
+/*
+ * Frame a PPP packet (protocol field onwards) for pppd.  At most
+ * HDLC_ENCODED_MAX(len) bytes are written to out; returns their number.
+ */
+int hdlc_encode(struct hdlc_tx *tx, unsigned char *out,
+		const unsigned char *buf, int len)
+{
+    unsigned char *start = out;
+    const unsigned char *esc = NULL;
+    int (*scan)(const unsigned char *p, int len) = scan_esc;
+    unsigned short fcs;
+    unsigned char c;
+    int i, n, acfc = 0;
+
+    /* LCP always goes with the default map and a full header, everything
+       else as negotiated; with a map of 0 only flags and escapes stop a
+       run */
+    if (tx->accm_known &&
+	!(len >= 2 && ((buf[0] << 8) | buf[1]) == PPP_LCP)) {
+	esc = tx->esc;
+	if (tx->accm == 0)
+	    scan = scan_flag;
+	acfc = tx->acfc;
+	/* protocols below 0x100 fit in one byte */
+	if (tx->pfc && len >= 2 && buf[0] == 0 && (buf[1] & 1)) {
+	    buf++;
+	    len--;
+	}
+    }
+
+    if (!tx->started) {
+	ADD_OUT(FRAME_FLAG);
+	tx->started = 1;
+    }
+    fcs = PPPINITFCS16;
+    if (!acfc) {
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ FRAME_ADDR) & 0xff];
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ FRAME_CTL) & 0xff];
+	ADD_OUT(FRAME_ADDR);
+	c = FRAME_CTL;
+	ADD_TX(c);
+    }
+
+    for (i = 0; i < len; ) {
+	/* copy the run up to the next byte that may need escaping */
+	n = scan(buf + i, len - i);
+	if (n > 0) {
+	    fcs = fcs_copy(fcs, out, buf + i, n);
+	    out += n;
+	    i += n;
+	    if (i == len)
+		break;
+	}
+	c = buf[i++];
+	fcs = (fcs >> 8) ^ fcstab[(fcs ^ c) & 0xff];
+	ADD_TX(c);
+    }
+
+    fcs ^= 0xffff;
+    c = fcs & 0x00ff;
+    ADD_TX(c);
+    c = (fcs >> 8) & 0x00ff;
+    ADD_TX(c);
+    ADD_OUT(FRAME_FLAG);
+
+    return out - start;
+}
+
+/* escape the control characters in accm from now on */
+void hdlc_tx_accm(struct hdlc_tx *tx, unsigned long accm)
+{
+    int c;
+
+    memset(tx->esc, 0, sizeof(tx->esc));
+    for (c = 0; c < 0x20; c++)
+	tx->esc[c] = (accm >> c) & 1;
+    tx->esc[FRAME_FLAG] = 1;
+    tx->esc[FRAME_ESC] = 1;
+    tx->accm = accm & 0xffffffffUL;
+    tx->accm_known = 1;
+}
+
+/*
+ * Follow LCP on its way through the relay to learn which control
+ * characters pppd wants escaped and whether it takes compressed headers.
+ * pkt is a PPP packet (protocol field onwards), to_pppd says which way it
+ * goes.  pppd's options are in the Configure-Ack its peer sends it; a
+ * Configure-Request or Terminate from either side means LCP starts over,
+ * and until the next Ack everything is escaped again.
+ */
+void hdlc_tx_snoop(struct hdlc_tx *tx, const unsigned char *pkt, int len,
+		   int to_pppd)
+{
+    const unsigned char *opt, *end;
+    unsigned long accm = 0xffffffffUL;
+    int n;
+
+    if (len < 6 || ((pkt[0] << 8) | pkt[1]) != PPP_LCP)
+	return;
+
+    switch (pkt[2]) {
+    case LCP_CONFACK:
+	if (!to_pppd)
+	    return;
+	n = (pkt[4] << 8) | pkt[5];
+	end = pkt + 2 + (n < len - 2 ? n : len - 2);
+	tx->acfc = tx->pfc = 0;
+	for (opt = pkt + 6; opt + 2 <= end && opt[1] >= 2 &&
+		 opt + opt[1] <= end; opt += opt[1]) {
+	    if (opt[0] == LCP_OPT_ACCM && opt[1] == 6)
+		accm = ((unsigned long)opt[2] << 24) | ((unsigned long)opt[3] << 16) |
+		       ((unsigned long)opt[4] << 8) | opt[5];
+	    else if (opt[0] == LCP_OPT_ACFC)
+		tx->acfc = 1;
+	    else if (opt[0] == LCP_OPT_PFC)
+		tx->pfc = 1;
+	}
+	hdlc_tx_accm(tx, accm);
+	break;
+    case LCP_CONFREQ:
+    case LCP_TERMREQ:
+    case LCP_TERMACK:
+	tx->accm_known = 0;
+	break;
+    }
+}
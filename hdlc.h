@@ -0,0 +1,130 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * RFC 1662 HDLC-like framing used on the pppd side of the relay
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PPPOE_HDLC_H_
+#define _PPPOE_HDLC_H_
+
+#define PPPINITFCS16    0xffff  /* Initial FCS value */
+#define PPPGOODFCS16    0xf0b8  /* Good final FCS value */
+
+#define FRAME_ESC 0x7d
+#define FRAME_FLAG 0x7e
+#define FRAME_ADDR 0xff
+#define FRAME_CTL 0x03
+#define FRAME_ENC 0x20
+
+/* shortest frame worth looking at, FCS included (RFC 1662 4.3) */
+#define HDLC_MINFRAME   4
+
+extern unsigned short fcstab[256];
+
+void hdlc_init(void);
+
+unsigned short pppfcs16(register unsigned short fcs,
+			register unsigned char * cp,
+			register int len);
+
+/* de-framer states */
+#define HDLC_HUNT   0   /* discarding until the next flag */
+#define HDLC_DATA   1   /* inside a frame */
+#define HDLC_ESC    2   /* inside a frame, last byte was FRAME_ESC */
+
+/*
+ * Resumable de-framer for the byte stream coming from pppd.
+ *
+ * Raw bytes are consumed from [in, end) and the unescaped frame is written
+ * back over them starting at 'frame', so a frame never needs more room than
+ * the raw bytes it came from.  A frame that is still open when the input
+ * runs out stays decoded in [frame, out); the caller appends the next read
+ * at 'out' (or moves it with hdlc_rx_rebase()) and decoding simply goes on.
+ *
+ * With a receive ring attached (hdlc_rx_ring()), hdlc_rx_space() hands out
+ * the read position instead.  Frames then never start in the first
+ * 'headroom' bytes of the ring, and everything in front of a frame is either
+ * that headroom or frames already returned, so a link header can be built
+ * directly in front of each frame.
+ *
+ * hdlc_rx_target() sends frames elsewhere instead: each new frame is
+ * decoded at 'dst', which the caller moves on once it has taken a frame.
+ * Raw bytes are then consumed completely by every run, so reads always go
+ * to the start of the ring.
+ */
+struct hdlc_rx {
+    int             state;      /* HDLC_HUNT / HDLC_DATA / HDLC_ESC */
+    unsigned short  fcs;        /* running FCS of the frame in progress */
+    unsigned char   *frame;     /* first decoded byte of the open frame */
+    unsigned char   *out;       /* where the next decoded byte goes */
+    unsigned char   *in;        /* next raw byte */
+    unsigned char   *end;       /* end of raw bytes */
+    int             mru;        /* longest frame accepted, FCS included */
+    int             pass_bad;   /* also hand up frames with a bad FCS */
+    unsigned char   *base;      /* receive ring, after its headroom */
+    unsigned char   *limit;     /* end of the receive ring */
+    unsigned char   *dst;       /* where new frames go, NULL for in place */
+    /* statistics */
+    unsigned long   frames;
+    unsigned long   bad_fcs;
+    unsigned long   runts;
+    unsigned long   giants;
+    unsigned long   aborts;
+};
+
+/* LCP, as far as the framer cares (RFC 1661, RFC 1662 7.1) */
+#define PPP_LCP         0xc021
+#define LCP_CONFREQ     1
+#define LCP_CONFACK     2
+#define LCP_TERMREQ     5
+#define LCP_TERMACK     6
+#define LCP_OPT_ACCM    2
+#define LCP_OPT_PFC     7
+#define LCP_OPT_ACFC    8
+
+/*
+ * Frames going to pppd.  Until LCP has been followed to the point where
+ * pppd's options are known (hdlc_tx_snoop()), every control character is
+ * escaped and no header is compressed.
+ */
+struct hdlc_tx {
+    int             started;    /* opening flag sent */
+    int             accm_known; /* esc[], acfc and pfc were negotiated */
+    int             acfc;       /* pppd takes frames without FF 03 */
+    int             pfc;        /* and one byte protocol fields */
+    unsigned long   accm;       /* control characters pppd wants escaped */
+    unsigned char   esc[256];   /* bytes to escape under accm */
+};
+
+/* worst case length of an encoded frame: all escaped, FCS and flags */
+#define HDLC_ENCODED_MAX(len)   (2 * ((len) + 4) + 2)
+
+void hdlc_rx_init(struct hdlc_rx *rx, int mru, int pass_bad);
+void hdlc_rx_feed(struct hdlc_rx *rx, unsigned char *buf, int len);
+int  hdlc_rx_frame(struct hdlc_rx *rx, unsigned char **frame, int *len);
+int  hdlc_rx_pending(struct hdlc_rx *rx);
+void hdlc_rx_rebase(struct hdlc_rx *rx, unsigned char *to);
+void hdlc_rx_ring(struct hdlc_rx *rx, unsigned char *ring, int size,
+		  int headroom);
+int  hdlc_rx_space(struct hdlc_rx *rx, unsigned char **rd, int want);
+void hdlc_rx_target(struct hdlc_rx *rx, unsigned char *dst);
+int  hdlc_encode(struct hdlc_tx *tx, unsigned char *out,
+		 const unsigned char *buf, int len);
+void hdlc_tx_accm(struct hdlc_tx *tx, unsigned long accm);
+void hdlc_tx_snoop(struct hdlc_tx *tx, const unsigned char *pkt, int len,
+		   int to_pppd);
+
+#endif /* _PPPOE_HDLC_H_ */
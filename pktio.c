@@ -0,0 +1,710 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * Batched packet I/O on the session socket
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* sendmmsg(), recvmmsg() and vmsplice() are GNU extensions; this file must not include
+   pppoe.h, whose private struct ifreq clashes with the one _GNU_SOURCE
+   pulls in */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "pktio.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#ifdef MSG_WAITFORONE
+#define HAVE_MMSG
+#endif
+#ifdef TPACKET3_HDRLEN
+#define HAVE_TPACKET_V3
+#endif
+#ifdef PACKET_TX_HAS_OFF
+#define HAVE_TX_RING
+#endif
+#ifdef F_SETPIPE_SZ
+#define HAVE_PIPE_SZ
+#endif
+#ifdef SPLICE_F_GIFT
+#define HAVE_VMSPLICE
+#endif
+#endif
+
+#ifdef HAVE_TPACKET_V3
+#define RING_FRAME      2048    /* only used to size the ring */
+#define BLOCK(rx, i) \
+    ((struct tpacket_block_desc *)((rx)->ring + (i) * PKTIO_RING_BLOCK))
+#endif
+
+#ifdef HAVE_TX_RING
+#define SLOT(tx, i) \
+    ((struct tpacket2_hdr *)((tx)->ring + (i) * PKTIO_TX_SLOT))
+#define SLOT_DATA       TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+#define SLOT_STATUS(ph) (*(volatile unsigned int *)&(ph)->tp_status)
+#endif
+
+/* sock must be bound (see pktio_open()), frames carry no address */
+void pktio_tx_init(struct pktio_tx *tx, int sock)
+{
+    memset(tx, 0, sizeof(*tx));
+    tx->sock = sock;
+}
+
+/* queue one frame; the batch goes out by itself once it is full */
+int pktio_tx_add(struct pktio_tx *tx, void *hdr, int hlen, void *data, int len)
+{
+    struct iovec *iov = tx->iov[tx->n++];
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+    if (tx->n == PKTIO_BATCH)
+	return pktio_tx_flush(tx);
+    return 0;
+}
+
+/* one frame at a time, for kernels and libraries without sendmmsg() */
+static int tx_one(struct pktio_tx *tx, int i)
+{
+#ifdef USE_BPF
+    return writev(tx->sock, tx->iov[i], 2);
+#else
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = tx->iov[i];
+    msg.msg_iovlen = 2;
+    return sendmsg(tx->sock, &msg, 0);
+#endif
+}
+
+#ifdef HAVE_TX_RING
+/*
+ * Have the kernel send every committed slot.  Without MSG_DONTWAIT this
+ * also waits until they are all free again.
+ */
+static int tx_kick(struct pktio_tx *tx, int flags)
+{
+    struct tpacket2_hdr *ph;
+    int i;
+
+    if (send(tx->sock, NULL, 0, flags) < 0 && errno != EAGAIN) {
+	if (errno == EINTR)
+	    return 0;
+	/* nothing was taken (link down, say); drop the frames rather
+	   than wait for slots that will not come back */
+	perror("pppoe: send (pktio_tx_flush)");
+	for (i = 0; i < PKTIO_TX_SLOTS; i++) {
+	    ph = SLOT(tx, i);
+	    if (SLOT_STATUS(ph) == TP_STATUS_SEND_REQUEST) {
+		SLOT_STATUS(ph) = TP_STATUS_AVAILABLE;
+		tx->errors++;
+	    }
+	}
+	tx->queued = 0;
+	return -1;
+    }
+    if (tx->queued) {
+	tx->batches++;
+	tx->frames += tx->queued;
+	tx->queued = 0;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Send everything queued.  A frame the kernel refuses is counted and
+ * dropped so the rest of the batch still goes out; returns -1 if any
+ * frame was dropped.
+ */
+int pktio_tx_flush(struct pktio_tx *tx)
+{
+    int i = 0, c, ret = 0;
+#ifdef HAVE_MMSG
+    static int no_mmsg = 0;
+    struct mmsghdr msg[PKTIO_BATCH];
+#endif
+
+#ifdef HAVE_TX_RING
+    if (tx->ring)
+	return tx_kick(tx, MSG_DONTWAIT);
+#endif
+#ifdef HAVE_MMSG
+
+    if (!no_mmsg) {
+	memset(msg, 0, sizeof(msg[0]) * tx->n);
+	for (c = 0; c < tx->n; c++) {
+	    msg[c].msg_hdr.msg_iov = tx->iov[c];
+	    msg[c].msg_hdr.msg_iovlen = 2;
+	}
+	while (i < tx->n) {
+	    c = sendmmsg(tx->sock, &msg[i], tx->n - i, 0);
+	    if (c < 0 && errno == ENOSYS) {
+		no_mmsg = 1;
+		break;
+	    }
+	    tx->batches++;
+	    if (c < 0) {
+		/* the first frame was refused, skip it */
+		perror("pppoe: sendmmsg (pktio_tx_flush)");
+		tx->errors++;
+		ret = -1;
+		c = 1;
+	    } else
+		tx->frames += c;
+	    i += c;
+	}
+    }
+#endif
+    for (; i < tx->n; i++) {
+	tx->batches++;
+	if ((c = tx_one(tx, i)) < 0) {
+	    perror("pppoe: sendmsg (pktio_tx_flush)");
+	    tx->errors++;
+	    ret = -1;
+	} else
+	    tx->frames++;
+    }
+
+    tx->n = 0;
+    return ret;
+}
+
+/*
+ * Move the session's uplink onto a TPACKET_V2 transmit ring on a socket
+ * of its own, bound to ifname.  Returns -1, leaving tx as it was, if the
+ * kernel cannot do it.
+ */
+int pktio_tx_ring(struct pktio_tx *tx, const char *ifname)
+{
+#ifdef HAVE_TX_RING
+    struct tpacket_req req;
+    int sock, v;
+    void *map;
+
+    /* protocol 0: nothing is ever received on it */
+    if ((sock = pktio_open(ifname, 0)) < 0)
+	return -1;
+    v = TPACKET_V2;
+    if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0) {
+	perror("pppoe: setsockopt(PACKET_VERSION)");
+	goto fail;
+    }
+    /* frames start wherever the header ended up in the slot, and a
+       malformed one is skipped instead of stopping the ring */
+    v = 1;
+    if (setsockopt(sock, SOL_PACKET, PACKET_TX_HAS_OFF, &v, sizeof(v)) < 0 ||
+	setsockopt(sock, SOL_PACKET, PACKET_LOSS, &v, sizeof(v)) < 0) {
+	perror("pppoe: setsockopt(PACKET_TX_HAS_OFF)");
+	goto fail;
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = 2 * PKTIO_TX_SLOT;
+    req.tp_block_nr = PKTIO_TX_SLOTS / 2;
+    req.tp_frame_size = PKTIO_TX_SLOT;
+    req.tp_frame_nr = PKTIO_TX_SLOTS;
+    if (setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+	perror("pppoe: setsockopt(PACKET_TX_RING)");
+	goto fail;
+    }
+    map = mmap(NULL, PKTIO_TX_SLOTS * PKTIO_TX_SLOT,
+	       PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+    if (map == MAP_FAILED) {
+	perror("pppoe: mmap (pktio_tx_ring)");
+	goto fail;
+    }
+    if (tx->n > 0)
+	pktio_tx_flush(tx);
+    tx->sock = sock;
+    tx->ring = map;
+    tx->cur = 0;
+    tx->queued = 0;
+    tx->room = PKTIO_TX_SLOT - SLOT_DATA;
+    return 0;
+
+fail:
+    close(sock);
+#else
+    fprintf(stderr, "pppoe: no PACKET_TX_RING support\n");
+#endif
+    return -1;
+}
+
+/*
+ * The slot the next frame goes in; tx->room bytes from the returned
+ * address on are the caller's until pktio_tx_commit().  When the kernel
+ * still holds every slot, what is queued is sent and waited for.
+ */
+unsigned char *pktio_tx_slot(struct pktio_tx *tx)
+{
+#ifdef HAVE_TX_RING
+    struct tpacket2_hdr *ph = SLOT(tx, tx->cur);
+
+    while (SLOT_STATUS(ph) != TP_STATUS_AVAILABLE)
+	tx_kick(tx, 0);
+    __sync_synchronize();
+    return (unsigned char *)ph + SLOT_DATA;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * Queue the frame of 'len' bytes built at 'frame' in the current slot,
+ * which must lie at or after the address pktio_tx_slot() returned.  The
+ * ring is kicked by itself every PKTIO_BATCH frames.
+ */
+int pktio_tx_commit(struct pktio_tx *tx, void *frame, int len)
+{
+#ifdef HAVE_TX_RING
+    struct tpacket2_hdr *ph = SLOT(tx, tx->cur);
+
+    ph->tp_len = len;
+    ph->tp_mac = (unsigned char *)frame - (unsigned char *)ph;
+    __sync_synchronize();
+    SLOT_STATUS(ph) = TP_STATUS_SEND_REQUEST;
+    tx->cur = (tx->cur + 1) % PKTIO_TX_SLOTS;
+    if (++tx->queued == PKTIO_BATCH)
+	return tx_kick(tx, MSG_DONTWAIT);
+#endif
+    return 0;
+}
+
+void pktio_rx_init(struct pktio_rx *rx, int sock, unsigned char *buf,
+		   int size, int max)
+{
+    int i;
+
+    memset(rx, 0, sizeof(*rx));
+    rx->sock = sock;
+    rx->buf = buf;
+    rx->size = size;
+    if (max < 1 || max > PKTIO_BATCH)
+	max = PKTIO_BATCH;
+    rx->max = max;
+    for (i = 0; i < max; i++)
+	rx->frame[i] = buf + i * size;
+}
+
+/*
+ * Map a TPACKET_V3 ring on rx->sock, which must be an AF_PACKET socket
+ * (see pktio_open()).  Frames are then read straight out of the ring.
+ * Returns -1, leaving rx as it was, if the kernel cannot do it.
+ */
+int pktio_rx_ring(struct pktio_rx *rx)
+{
+#ifdef HAVE_TPACKET_V3
+    struct tpacket_req3 req;
+    int v = TPACKET_V3;
+    void *map;
+
+    if (setsockopt(rx->sock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0) {
+	perror("pppoe: setsockopt(PACKET_VERSION)");
+	return -1;
+    }
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = PKTIO_RING_BLOCK;
+    req.tp_block_nr = PKTIO_RING_BLOCKS;
+    req.tp_frame_size = RING_FRAME;
+    req.tp_frame_nr = PKTIO_RING_BLOCK / RING_FRAME * PKTIO_RING_BLOCKS;
+    req.tp_retire_blk_tov = PKTIO_RING_TIMEOUT;
+    if (setsockopt(rx->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+	perror("pppoe: setsockopt(PACKET_RX_RING)");
+	goto undo;
+    }
+    map = mmap(NULL, PKTIO_RING_BLOCK * PKTIO_RING_BLOCKS,
+	       PROT_READ | PROT_WRITE, MAP_SHARED, rx->sock, 0);
+    if (map == MAP_FAILED) {
+	perror("pppoe: mmap (pktio_rx_ring)");
+	memset(&req, 0, sizeof(req));
+	setsockopt(rx->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+	goto undo;
+    }
+    rx->ring = map;
+    rx->nblocks = PKTIO_RING_BLOCKS;
+    /* frames queued before the ring existed would keep the socket
+       readable for ever */
+    while (recv(rx->sock, &v, sizeof(v), MSG_DONTWAIT | MSG_TRUNC) >= 0)
+	;
+    return 0;
+
+undo:
+    v = TPACKET_V1;
+    setsockopt(rx->sock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v));
+#else
+    fprintf(stderr, "pppoe: no TPACKET_V3 support\n");
+#endif
+    return -1;
+}
+
+#ifdef HAVE_TPACKET_V3
+/* hand a block back to the kernel */
+static void ring_release(struct pktio_rx *rx, int i)
+{
+    __sync_synchronize();
+    BLOCK(rx, i)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+}
+
+/*
+ * Walk up to rx->max frames through the ring.  The blocks they lie in
+ * stay ours until the next call, which gives back every block walked to
+ * its end.
+ */
+static int ring_recv(struct pktio_rx *rx, int wait)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *ph;
+    struct pollfd pfd;
+    int n = 0;
+
+    while (rx->oldest != rx->cur) {
+	ring_release(rx, rx->oldest);
+	rx->oldest = (rx->oldest + 1) % rx->nblocks;
+    }
+    if (rx->inblk && rx->left == 0) {
+	ring_release(rx, rx->cur);
+	rx->inblk = 0;
+	rx->cur = rx->oldest = (rx->cur + 1) % rx->nblocks;
+    }
+
+    while (n < rx->max) {
+	if (!rx->inblk) {
+	    bd = BLOCK(rx, rx->cur);
+	    if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+		if (n > 0 || !wait)
+		    break;
+		pfd.fd = rx->sock;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0) {
+		    if (errno != EINTR)
+			perror("pppoe: poll (pktio_rx_recv)");
+		    return -1;
+		}
+		continue;
+	    }
+	    __sync_synchronize();
+	    rx->inblk = 1;
+	    rx->left = bd->hdr.bh1.num_pkts;
+	    rx->pkt = (unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt;
+	}
+	if (rx->left == 0) {
+	    /* walked to the end, but its frames may still be in use */
+	    if ((rx->cur + 1) % rx->nblocks == rx->oldest)
+		break; /* every block is held */
+	    rx->inblk = 0;
+	    rx->cur = (rx->cur + 1) % rx->nblocks;
+	    continue;
+	}
+	ph = (struct tpacket3_hdr *)rx->pkt;
+	rx->frame[n] = rx->pkt + ph->tp_mac;
+	rx->len[n] = ph->tp_snaplen;
+	n++;
+	rx->pkt += ph->tp_next_offset;
+	rx->left--;
+    }
+
+    if (n > 0) {
+	rx->batches++;
+	rx->frames += n;
+    }
+    return n;
+}
+#endif
+
+/*
+ * Open an AF_PACKET socket for one ethertype, bound to one interface, so
+ * it neither sees nor needs to name any other.  Where the kernel allows,
+ * it does not see our own transmissions either.
+ */
+int pktio_open(const char *ifname, unsigned short type)
+{
+#ifdef __linux__
+    struct sockaddr_ll sll;
+    int sock;
+#ifdef PACKET_IGNORE_OUTGOING
+    int one = 1;
+#endif
+
+    /* protocol 0 until bound, or frames from every interface queue up */
+    if ((sock = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+	perror("pppoe: socket (pktio_open)");
+	return -1;
+    }
+#ifdef PACKET_IGNORE_OUTGOING
+    /* kernels before 4.20 lack it; the callers still check the source */
+    setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(type);
+    if ((sll.sll_ifindex = if_nametoindex(ifname)) == 0 ||
+	bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+	perror("pppoe: bind (pktio_open)");
+	close(sock);
+	return -1;
+    }
+    return sock;
+#else
+    errno = EAFNOSUPPORT;
+    return -1;
+#endif
+}
+
+#ifdef __linux__
+/* jump targets, patched once the program is complete */
+#define TO_ACCEPT   0xfe
+#define TO_DROP     0xff
+#define INSN(c, t, f, v) \
+    (prog[n].code = (c), prog[n].jt = (t), prog[n].jf = (f), \
+     prog[n].k = (v), n++)
+#endif
+
+/*
+ * Have the kernel drop every frame on sock that does not match m, before
+ * it is queued, so the program is not woken for it.  A frame that gets
+ * through is still checked by the caller.  Attaching again replaces the
+ * filter.
+ */
+int pktio_filter(int sock, const struct pktio_match *m)
+{
+#ifdef __linux__
+    struct sock_filter prog[16 + PKTIO_MAX_CODES];
+    struct sock_fprog fprog;
+    const unsigned char *a;
+    int n = 0, i, off;
+
+    INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, 12);
+    INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, TO_DROP, m->type);
+    /* addresses as a word and a half-word */
+    for (off = 0; off <= 6; off += 6) {
+	if ((a = off ? m->src : m->dst) == NULL)
+	    continue;
+	INSN(BPF_LD | BPF_W | BPF_ABS, 0, 0, off);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, TO_DROP,
+	     ((unsigned int)a[0] << 24) | ((unsigned int)a[1] << 16) |
+	     ((unsigned int)a[2] << 8) | a[3]);
+	INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, off + 4);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, TO_DROP,
+	     ((unsigned int)a[4] << 8) | a[5]);
+    }
+    if (m->session >= 0) {
+	INSN(BPF_LD | BPF_H | BPF_ABS, 0, 0, 16);
+	INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, TO_DROP, m->session);
+    }
+    if (m->codes != NULL && m->ncodes > 0) {
+	INSN(BPF_LD | BPF_B | BPF_ABS, 0, 0, 15);
+	for (i = 0; i < m->ncodes && i < PKTIO_MAX_CODES; i++)
+	    INSN(BPF_JMP | BPF_JEQ | BPF_K, TO_ACCEPT,
+		 (i == m->ncodes - 1) ? TO_DROP : 0, m->codes[i]);
+    }
+    INSN(BPF_RET | BPF_K, 0, 0, (unsigned int)-1);
+    INSN(BPF_RET | BPF_K, 0, 0, 0);
+
+    for (i = 0; i < n; i++) {
+	if (prog[i].jt == TO_ACCEPT)
+	    prog[i].jt = n - 2 - (i + 1);
+	if (prog[i].jf == TO_DROP)
+	    prog[i].jf = n - 1 - (i + 1);
+    }
+
+    fprog.len = n;
+    fprog.filter = prog;
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+		   sizeof(fprog)) < 0) {
+	perror("pppoe: setsockopt(SO_ATTACH_FILTER)");
+	return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Take whatever is queued on the socket, up to rx->max frames.  With
+ * 'wait' set the call blocks until the first frame arrives, otherwise it
+ * returns 0 when nothing is queued.  Returns the number of frames, their
+ * lengths in rx->len[], or -1 on error.
+ */
+int pktio_rx_recv(struct pktio_rx *rx, int wait)
+{
+    int n = 0, c;
+#ifdef HAVE_MMSG
+    static int no_mmsg = 0;
+    struct mmsghdr msg[PKTIO_BATCH];
+    struct iovec iov[PKTIO_BATCH];
+#endif
+
+#ifdef HAVE_TPACKET_V3
+    if (rx->ring)
+	return ring_recv(rx, wait);
+#endif
+#ifdef HAVE_MMSG
+    if (!no_mmsg) {
+	memset(msg, 0, sizeof(msg[0]) * rx->max);
+	for (c = 0; c < rx->max; c++) {
+	    iov[c].iov_base = pktio_rx_frame(rx, c);
+	    iov[c].iov_len = rx->size;
+	    msg[c].msg_hdr.msg_iov = &iov[c];
+	    msg[c].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(rx->sock, msg, rx->max,
+		     wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+	if (n >= 0) {
+	    for (c = 0; c < n; c++)
+		rx->len[c] = msg[c].msg_len;
+	    goto done;
+	}
+	if (errno != ENOSYS)
+	    goto fail;
+	no_mmsg = 1;
+	n = 0;
+    }
+#endif
+    for (; n < rx->max; n++) {
+	c = recv(rx->sock, pktio_rx_frame(rx, n), rx->size,
+		 (n == 0 && wait) ? 0 : MSG_DONTWAIT);
+	if (c < 0) {
+	    if (n > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		break;
+	    goto fail;
+	}
+	rx->len[n] = c;
+    }
+
+done:
+    if (n > 0) {
+	rx->batches++;
+	rx->frames += n;
+    }
+    return n;
+
+fail:
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return 0;
+    if (errno != EINTR)
+	perror("pppoe: recv (pktio_rx_recv)");
+    return -1;
+}
+
+/*
+ * Give a pipe or socket that stands in for the pty (pppd's 'notty') 'size'
+ * bytes of buffer; a tty is left alone.  Returns -1 if the kernel refused.
+ */
+int pktio_pipe_size(int fd, int size)
+{
+    struct stat st;
+
+    if (size <= 0 || isatty(fd) || fstat(fd, &st) < 0)
+	return 0;
+#ifdef HAVE_PIPE_SZ
+    if (S_ISFIFO(st.st_mode))
+	return fcntl(fd, F_SETPIPE_SZ, size) < 0 ? -1 : 0;
+#endif
+    if (S_ISSOCK(st.st_mode) &&
+	(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0 ||
+	 setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0))
+	return -1;
+    return 0;
+}
+
+/* frames are built in buf0 and buf1 in turn; splice allows vmsplice() */
+void pktio_pipe_init(struct pktio_pipe *p, int fd, unsigned char *buf0,
+		     unsigned char *buf1, int splice)
+{
+#ifdef HAVE_VMSPLICE
+    struct stat st;
+#endif
+
+    memset(p, 0, sizeof(*p));
+    p->fd = fd;
+    p->buf[0] = buf0;
+    p->buf[1] = buf1;
+#ifdef HAVE_VMSPLICE
+    p->splice = splice && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+#endif
+}
+
+/*
+ * Write the first len bytes of the current buffer.  To a pipe its pages
+ * are handed over with vmsplice() instead of being copied, which leaves
+ * them in use until pppd has read them: the next frames are built in the
+ * other buffer, which is free again once pppd has read up to its end, as
+ * told by how much is still queued in the pipe.  While pppd lags behind
+ * and the other buffer is still queued, the current one is copied with
+ * write() and stays current.
+ */
+int pktio_pipe_write(struct pktio_pipe *p, int len)
+{
+    unsigned char *out = pktio_pipe_buf(p);
+    int c, splice = 0;
+#ifdef HAVE_VMSPLICE
+    struct iovec iov;
+    int other;
+
+    if (p->splice) {
+	other = !p->cur;
+	if (p->busy[other] && ioctl(p->fd, FIONREAD, &c) == 0 &&
+	    (long)(p->written - c - p->end[other]) >= 0)
+	    p->busy[other] = 0;
+	if ((splice = !p->busy[other])) {
+	    p->busy[p->cur] = 1;
+	    p->end[p->cur] = p->written + len;
+	    p->cur = other;
+	}
+    }
+#endif
+    while (len > 0) {
+#ifdef HAVE_VMSPLICE
+	if (splice) {
+	    iov.iov_base = out;
+	    iov.iov_len = len;
+	    c = vmsplice(p->fd, &iov, 1, 0);
+	} else
+#endif
+	    c = write(p->fd, out, len);
+	if (c < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (splice)
+	    p->spliced += c;
+	else
+	    p->copied += c;
+	p->written += c;
+	out += c;
+	len -= c;
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * Batched packet I/O on the session socket
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PPPOE_PKTIO_H_
+#define _PPPOE_PKTIO_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* frames handed to the kernel in one system call */
+#define PKTIO_BATCH     32
+
+/* transmit ring: slots of PKTIO_TX_SLOT bytes */
+#define PKTIO_TX_SLOTS      64
+#define PKTIO_TX_SLOT       2048
+
+/*
+ * Transmit batch.  Every frame is a link header and a payload that stay
+ * where the caller built them; both must be left alone until the batch
+ * has been flushed.
+ *
+ * Once a ring is mapped with pktio_tx_ring(), frames are built in the ring
+ * instead: pktio_tx_slot() gives the next free slot, pktio_tx_commit()
+ * queues the frame built in it, and a flush is a single kick.
+ */
+struct pktio_tx {
+    int             sock;
+    int             n;          /* frames queued */
+    struct iovec    iov[PKTIO_BATCH][2];
+    /* mapped ring, if any */
+    unsigned char   *ring;
+    int             cur;        /* slot being filled */
+    int             queued;     /* slots committed since the last kick */
+    int             room;       /* bytes a slot holds */
+    /* statistics */
+    unsigned long   frames;     /* frames sent */
+    unsigned long   batches;    /* system calls used to send them */
+    unsigned long   errors;     /* frames the kernel refused */
+};
+
+/* TPACKET_V3 receive ring: blocks of PKTIO_RING_BLOCK bytes */
+#define PKTIO_RING_BLOCKS   8
+#define PKTIO_RING_BLOCK    (16 * 1024)
+#define PKTIO_RING_TIMEOUT  1   /* ms before a partly filled block is handed over */
+
+/*
+ * Receive batch: up to 'max' frames per call.  Frames are copied into
+ * their own 'size' byte slot of 'buf', or, once a ring is mapped with
+ * pktio_rx_ring(), left where the kernel put them.  Either way they stay
+ * valid until the next pktio_rx_recv().
+ */
+struct pktio_rx {
+    int             sock;
+    int             max;        /* frames per call */
+    int             size;       /* bytes per slot */
+    unsigned char   *buf;       /* max * size bytes */
+    unsigned char   *frame[PKTIO_BATCH]; /* frames received */
+    int             len[PKTIO_BATCH]; /* and their lengths */
+    /* mapped ring, if any */
+    unsigned char   *ring;
+    int             nblocks;
+    int             cur;        /* block being walked */
+    int             oldest;     /* first block still held */
+    int             inblk;      /* cur is owned by us */
+    int             left;       /* frames not walked yet in cur */
+    unsigned char   *pkt;       /* next frame header in cur */
+    /* statistics */
+    unsigned long   frames;     /* frames received */
+    unsigned long   batches;    /* calls that returned frames */
+};
+
+#define pktio_rx_frame(rx, i)   ((rx)->frame[i])
+
+/* frames a packet socket lets through, see pktio_filter() */
+#define PKTIO_MAX_CODES 8
+struct pktio_match {
+    unsigned short  type;       /* ethertype */
+    const unsigned char *dst;   /* destination address, NULL for any */
+    const unsigned char *src;   /* source address, NULL for any */
+    int             session;    /* session ID (host order), -1 for any */
+    const unsigned char *codes; /* PPPoE codes, NULL for any */
+    int             ncodes;
+};
+
+/*
+ * The stream to pppd when it runs 'notty' on a pipe or socketpair rather
+ * than on a pty, see pktio_pipe_write().
+ */
+struct pktio_pipe {
+    int             fd;
+    int             splice;     /* fd is a pipe: pages go by vmsplice() */
+    int             cur;        /* buffer being filled */
+    int             busy[2];    /* spliced, maybe not read by pppd yet */
+    unsigned long   end[2];     /* 'written' once pppd has read all of it */
+    unsigned char   *buf[2];
+    unsigned long   written;    /* bytes put into fd */
+    /* statistics */
+    unsigned long   spliced;    /* bytes handed over by reference */
+    unsigned long   copied;     /* bytes copied with write() */
+};
+
+#define pktio_pipe_buf(p)   ((p)->buf[(p)->cur])
+
+void pktio_tx_init(struct pktio_tx *tx, int sock);
+int  pktio_tx_add(struct pktio_tx *tx, void *hdr, int hlen,
+		  void *data, int len);
+int  pktio_tx_flush(struct pktio_tx *tx);
+int  pktio_tx_ring(struct pktio_tx *tx, const char *ifname);
+unsigned char *pktio_tx_slot(struct pktio_tx *tx);
+int  pktio_tx_commit(struct pktio_tx *tx, void *frame, int len);
+void pktio_rx_init(struct pktio_rx *rx, int sock, unsigned char *buf,
+		   int size, int max);
+int  pktio_rx_ring(struct pktio_rx *rx);
+int  pktio_rx_recv(struct pktio_rx *rx, int wait);
+int  pktio_open(const char *ifname, unsigned short type);
+int  pktio_filter(int sock, const struct pktio_match *m);
+int  pktio_pipe_size(int fd, int size);
+void pktio_pipe_init(struct pktio_pipe *p, int fd, unsigned char *buf0,
+		     unsigned char *buf1, int splice);
+int  pktio_pipe_write(struct pktio_pipe *p, int len);
+
+#endif /* _PPPOE_PKTIO_H_ */
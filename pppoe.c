@@ -79,12 +79,30 @@ unsigned char local_ether[ETH_ALEN]; /* need to this filter packets */
 extern int errno;
 #endif
 
+#include "hdlc.h"
+#include "pktio.h"
+#include "thread.h"
+#include "tags.h"
+
 /* used as the size for a packet buffer */
 /* should be > 2 * size of max packet size */
 #define PACKETBUF (4096 + 30)
-/*  added start Winster Chan 11/25/2005 */
-#define TAGBUF 128
-/*  added end Winster Chan 11/25/2005 */
+/* longest frame accepted from pppd, FCS included */
+#define HDLC_MRU (PACKETBUF / 2)
+/* encoded frames buffered for one write to pppd */
+#define PPPDBUF (16 * 1024)
+/* room for one frame from sess_sock */
+#define SESSBUF 2048
+/* longest frame N_HDLC hands over in sync mode */
+#define SYNC_FRAME 4096
+/* buffers of a pipe or socket standing in for the pty */
+#define PIPEBUF (256 * 1024)
+/* LCP packets from pppd the downlink thread has yet to look at */
+#define LCP_NOTES 64
+/* ms a data thread gets to return when the session ends */
+#define WORKER_WAIT 100
+/* PADTs for the session from before a restart, see stale_send() */
+#define DISC_STALE_TRIES 3
 
 /*  added start, Winster Chan, 06/26/2006 */
 static int poxfd = -1;
@@ -122,8 +140,14 @@ struct pppoe_packet {
     /* payload follows */
 };
 
-/* maximum payload length */
-#define MAX_PAYLOAD (1484 - sizeof(struct pppoe_packet))
+/* PPP payload of a session in a 1500 byte Ethernet payload (RFC 2516),
+   and the most -m asks for beyond that (RFC 4638): SESSBUF and the
+   rings take such frames with room to spare */
+#define PPPOE_PAYLOAD 1492
+#define PPPOE_PAYLOAD_MAX 1500
+/* what the interface MTU holds besides the PPP payload: the PPPoE header
+   and the PPP protocol field */
+#define PPPOE_OVERHEAD 8
 
 /* PPPoE codes */
 #define CODE_SESS 0x00 /* PPPoE session */
@@ -146,6 +170,7 @@ struct pppoe_tag {
 /*  added start Winster Chan 11/25/2005 */
 #define TAG_STRUCT_SIZE  sizeof(struct pppoe_tag)
 #define PPP_PPPOE_SESSION   "/tmp/ppp/pppoe_session"
+#define PPP_PPPOE_STATS     "/tmp/ppp/pppoe_stats"
 /*#define PPP_PPPOE_IFNAME    "/tmp/ppp/pppoe_ifname"*/
 /*  added end Winster Chan 11/25/2005 */
 
@@ -157,6 +182,7 @@ struct pppoe_tag {
 #define TAG_AC_COOKIE          0x0104
 #define TAG_VENDOR_SPECIFIC    0x0105
 #define TAG_RELAY_SESSION_ID   0x0110
+#define TAG_PPP_MAX_PAYLOAD    0x0120
 #define TAG_SERVICE_NAME_ERROR 0x0201
 #define TAG_AC_SYSTEM_ERROR    0x0202
 #define TAG_GENERIC_ERROR      0x0203
@@ -165,41 +191,60 @@ struct pppoe_tag {
 int opt_verbose = 0;   /* logging */
 int opt_fwd = 0;       /* forward invalid packets */
 int opt_fwd_search = 0; /* search for next packet when forwarding */
+int opt_batch = PKTIO_BATCH; /* session frames taken per system call */
+int opt_ring = 0; /* map a receive ring for the session socket */
+int opt_txring = 0; /* build uplink frames in a mapped transmit ring */
+int opt_sync = 0; /* one unframed PPP frame per read/write on the pty */
+int opt_pipebuf = PIPEBUF; /* buffer size when pppd is 'notty' */
+int ppp_notty = 0; /* pppd is on a pipe or socket: EOF means it is gone */
+int opt_cpu[2] = { -1, -1 }; /* CPUs of the downlink and uplink threads */
+int opt_payload = 0; /* -m: PPP-Max-Payload asked for, 0 for none */
 FILE *log_file = NULL;
 FILE *error_file = NULL;
 
-pid_t sess_listen = 0, pppd_listen = 0; /* child processes */
+struct worker sess_worker, pppd_worker; /* sess_handler(), pppd_handler() */
+int sess_up = 0; /* the data threads are running */
+int sig_fd = -1; /* signals, taken by read_packet() once the threads run */
 int disc_sock = 0, sess_sock = 0; /* PPPoE sockets */
 char src_addr[ETH_ALEN]; /* source hardware address */
 char dst_addr[ETH_ALEN]; /* destination hardware address */
 char *if_name = NULL; /* interface to use */
 int session = 0; /* identifier for our session */
-int clean_child = 0; /* flag set when SIGCHLD received */
-/*  added start Winster Chan 11/25/2005 */
-char pado_tags[TAGBUF]; /* TAGs of PADO */
-int pado_tag_size = 0;
-typedef struct {
-    unsigned short  usPadLen;   /* Tag length in type of unsigned short */
-    int             nPadLen;    /* Tag length in type of integer */
-    char            *pPadStart; /* Start point of tag payload */
-} sPadxTag, *pPadxTag;
-/*  added end Winster Chan 11/25/2005 */
+int payload = PPPOE_PAYLOAD; /* PPP payload the PADS left it, see pads_payload() */
+char stale_ac[ETH_ALEN]; /* the session from before a restart, being ended */
+unsigned short stale_id = 0; /* as on the wire, 0 once the AC is done with it */
+int stale_tries = 0;
+long disc_begun; /* worker_now() when we started, see disc_stats() */
+struct hdlc_rx pppd_rx; /* frames coming from pppd */
+struct pktio_tx sess_tx; /* frames going out on sess_sock */
+struct pktio_rx sess_rx; /* frames coming in on sess_sock */
+struct hdlc_tx pppd_tx; /* frames going to pppd */
+unsigned char ppp_buf[2][PPPDBUF]; /* taken in turn, see pktio_pipe_write() */
+unsigned char *ppp_out = ppp_buf[0]; /* encoded frames not yet written to pppd */
+struct pktio_pipe ppp_pipe;
+int ppp_out_len = 0;
+/*
+ * pppd's LCP packets tell when to forget the escape map learned for
+ * pppd_tx, which only the downlink thread may touch: the uplink thread
+ * passes them on through pppd_lcp.
+ */
+struct lcp_note {
+    int len;
+    unsigned char pkt[60]; /* as much as hdlc_tx_snoop() looks at */
+};
+struct spsc pppd_lcp;
+struct tag_buf pado_tags; /* TAGs of PADO */
 
 /* Winster Chan debugtest */
 #define DEBUG_PRINT_PACKET  0
 #define DEBUG_SEND_PACKET   0
-#define BUFRING             40
+#define RXRING              (8 * 4096) /* bytes of pppd input buffered */
 #define DEBUG_PRINT         0
 #define PPPOE_DEBUG_FILE    "/tmp/ppp/pppoeDbg"
 FILE *fp0;
 pid_t main_pid, sess_pid, pppd_pid;
 
 
-typedef struct {
-    /* unsigned char *pBufAddr; */
-    unsigned char packetBuf[PACKETBUF];
-} sPktBuf, *pPktBuf;
-
 void
 print_hex(unsigned char *buf, int len)
 {
@@ -727,20 +772,13 @@ open_interface(char *if_name, unsigned short type, char *hw_addr)
 
   return fd;
 #else /* do regular linux stuff */
-  int optval = 1, rv;
+  int rv;
   struct ifreq ifr;
 
-  if ((rv = socket(PF_INET, SOCK_PACKET, htons(type))) < 0)
-  {
-      perror("pppoe: socket");
-      return -1;
-  }
-
-  if (setsockopt(rv, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0)
-  {
-      perror("pppoe: setsockopt");
+  /* bound to the interface: it only hears that one, and frames sent on
+     it need no address */
+  if ((rv = pktio_open(if_name, type)) < 0)
       return -1;
-  }
 
   if (hw_addr != NULL) {
       strncpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name));
@@ -764,450 +802,186 @@ open_interface(char *if_name, unsigned short type, char *hw_addr)
 #endif /* USE_BPF / linux */
 }
 
-/*  added start Winster Chan 12/02/2005 */
-int
-get_padx_tag(struct pppoe_tag *pTag, int nLen, pPadxTag pTagStruc, const unsigned short tagType)
+/*
+ * -m asks for more than the MTU of the interface, sock on it, leaves room
+ * for: ask for what it does.  Asking for no more than PPPOE_PAYLOAD is
+ * the same as not asking.
+ */
+void payload_fit(int sock)
 {
-    int bExitLoop = 0, nSearchLen = 0, bTagFound = 0;
-    struct pppoe_tag *pNextTag;
-
-    pTagStruc->usPadLen = 0;
-    pTagStruc->nPadLen = 0;
-    pTagStruc->pPadStart = NULL;
-
-    while (!bExitLoop && (nSearchLen < nLen)) {
-        if (htons(pTag->type) == tagType) {
-            pTagStruc->usPadLen = pTag->length;
-            pTagStruc->nPadLen = (int)(htons(pTag->length));
-            pTagStruc->pPadStart = (char *)pTag + TAG_STRUCT_SIZE;
-            bExitLoop = 1;
-            bTagFound = 1;
-        }
-        else {
-            pNextTag = (struct pppoe_tag *)((char *)pTag +
-                (TAG_STRUCT_SIZE + (int)(htons(pTag->length))));
-            nSearchLen += (int)((TAG_STRUCT_SIZE + (int)(htons(pTag->length))));
-            pTag = pNextTag;
-        }
-    }
-
-    return bTagFound;
+    struct ifreq ifr;
+
+    if (opt_payload == 0)
+        return;
+    strncpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name));
+    if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
+        perror("pppoe: ioctl(SIOCGIFMTU)");
+        opt_payload = 0;
+        return;
+    }
+    if (ifr.ifr_mtu - PPPOE_OVERHEAD < opt_payload) {
+        fprintf(error_file, "pppoe: MTU of %s is %d, asking for a PPP payload of %d\n",
+                if_name, ifr.ifr_mtu, ifr.ifr_mtu - PPPOE_OVERHEAD);
+        opt_payload = ifr.ifr_mtu - PPPOE_OVERHEAD;
+    }
+    if (opt_payload <= PPPOE_PAYLOAD)
+        opt_payload = 0;
 }
-/*  added end Winster Chan 12/02/2005 */
 
-int
-create_padi(struct pppoe_packet *packet, const char *src, const char *name)
+/* RFC 4638: the PPP payload -m asks for, in PADI and PADR */
+void add_max_payload(struct tag_out *o)
 {
-    int size;
+    unsigned short n;
 
-    if (packet == NULL)
-	return 0;
-
-    /* printf("Winster: create_padi\n"); */
-
-    size = sizeof(struct pppoe_packet) + sizeof(struct pppoe_tag);
-    if (name != NULL)
-	size += strlen(name);
+    if (opt_payload == 0)
+        return;
+    n = htons(opt_payload);
+    tag_add(o, TAG_PPP_MAX_PAYLOAD, &n, sizeof(n));
+}
 
+/* the Ethernet and PPPoE headers of a discovery packet with len bytes
+   of TAGs */
+void disc_header(struct pppoe_packet *packet, const char *src, const char *dst,
+		 int code, unsigned short session, int len)
+{
 #ifdef __linux__
-    memcpy(packet->ethhdr.h_dest, MAC_BCAST_ADDR, 6);
+    memcpy(packet->ethhdr.h_dest, dst, 6);
     memcpy(packet->ethhdr.h_source, src, 6);
     packet->ethhdr.h_proto = htons(ETH_P_PPPOE_DISC);
 #else
-    memcpy(packet->ethhdr.ether_dhost, MAC_BCAST_ADDR, 6);
+    memcpy(packet->ethhdr.ether_dhost, dst, 6);
     memcpy(packet->ethhdr.ether_shost, src, 6);
     packet->ethhdr.ether_type = htons(ETH_P_PPPOE_DISC);
 #endif
     packet->ver = 1;
     packet->type = 1;
-    packet->code = CODE_PADI;
-    packet->session = 0;
-    packet->length = htons(size - sizeof(struct pppoe_packet));
-
-    /* fill out a blank service-name tag */
-    (*(struct pppoe_tag *)(packet+1)).type = htons(TAG_SERVICE_NAME);
-    (*(struct pppoe_tag *)(packet+1)).length = name ? htons(strlen(name)) : 0;
-    if (name != NULL)
-	memcpy((char *)(packet + 1) + sizeof(struct pppoe_tag), name,
-	       strlen(name));
-
-    return size;
+    packet->code = code;
+    packet->session = session;
+    packet->length = htons(len);
 }
 
 int
-create_padr(struct pppoe_packet *packet, const char *src, const char *dst,
-	    char *name)
+create_padi(struct pppoe_packet *packet, const char *src, const char *name)
 {
-    int size;
-    /*  added start Winster Chan 11/25/2005 */
-    char *pCookieStart = NULL;
-    int nCookieSize = 0;
-    int nNameSize = 0;
-    unsigned short usCookieSize = 0;
-    sPadxTag sTag;
-    /*  added end Winster Chan 11/25/2005 */
-    /*  add start, Max Ding, 09/22/2008 for @add TAG_RELAY_SESSION_ID */
-    char *pRelaySessionIdStart = NULL;
-    int nRelaySessionIdSize = 0;
-    unsigned short usRelaySessionIdSize = 0;
-    char *pPacketPoint = packet;
-    /*  add end, Max Ding, 09/22/2008 */
+    struct tag_out o;
+    int len;
 
     if (packet == NULL)
 	return 0;
 
-    size = sizeof(struct pppoe_packet) + TAG_STRUCT_SIZE;
-    if (name != NULL) {
-    	size += strlen(name);
-        /*  added start Winster Chan 11/25/2005 */
-        nNameSize = strlen(name);
-        /*  added end Winster Chan 11/25/2005 */
-    }
-
-    /*  added start Winster Chan 12/02/2005 */
-    /* Add length of AC cookie to packet size */
-    if (get_padx_tag((struct pppoe_tag *)pado_tags, pado_tag_size, &sTag, TAG_AC_COOKIE)) {
-        nCookieSize = sTag.nPadLen;
-        usCookieSize = sTag.usPadLen;
-        pCookieStart = sTag.pPadStart;
-        size += (int)(TAG_STRUCT_SIZE + sTag.nPadLen);
-    }
-    /*  added end Winster Chan 12/02/2005 */
-    /*  add start, Max Ding, 09/22/2008 for @add TAG_RELAY_SESSION_ID */
-    if (get_padx_tag((struct pppoe_tag *)pado_tags, pado_tag_size, &sTag, TAG_RELAY_SESSION_ID)) {
-        nRelaySessionIdSize = sTag.nPadLen;
-        usRelaySessionIdSize = sTag.usPadLen;
-        pRelaySessionIdStart = sTag.pPadStart;
-        size += (int)(TAG_STRUCT_SIZE + sTag.nPadLen);
-    }
-    /*  add end, Max Ding, 09/22/2008 */
+    /* printf("Winster: create_padi\n"); */
 
-#ifdef __linux__
-    memcpy(packet->ethhdr.h_dest, dst, 6);
-    memcpy(packet->ethhdr.h_source, src, 6);
-    packet->ethhdr.h_proto = htons(ETH_P_PPPOE_DISC);
-#else
-    memcpy(packet->ethhdr.ether_dhost, dst, 6);
-    memcpy(packet->ethhdr.ether_shost, src, 6);
-    packet->ethhdr.ether_type = htons(ETH_P_PPPOE_DISC);
-#endif
-    packet->ver = 1;
-    packet->type = 1;
-    packet->code = CODE_PADR;
-    packet->session = 0;
-    packet->length = htons(size - sizeof(struct pppoe_packet));
+    tag_out_init(&o, packet + 1, TAGS_ROOM);
+    /* a blank service-name tag if there is no name */
+    tag_add(&o, TAG_SERVICE_NAME, name, name ? strlen(name) : 0);
+    add_max_payload(&o);
+    if ((len = tag_out_len(&o)) < 0)
+	return 0;
+    disc_header(packet, src, MAC_BCAST_ADDR, CODE_PADI, 0, len);
 
-    /* fill out a blank service-name tag */
-    (*(struct pppoe_tag *)(packet+1)).type = htons(TAG_SERVICE_NAME);
-    (*(struct pppoe_tag *)(packet+1)).length = name ? htons(strlen(name)) : 0;
-    if (name != NULL)
-	memcpy((char *)(packet + 1) + TAG_STRUCT_SIZE, name,
-	       strlen(name));
-
-    pPacketPoint = (char *)(packet+1)+TAG_STRUCT_SIZE+nNameSize;/*  added by Max Ding, 09/23/2008 @add TAG_RELAY_SESSION_ID */
-    /*  modified start, wklin, 03/27/2007, winster doesn't count name len */
-    /*  added start Winster Chan 11/25/2005 */
-    /* fill out the AC cookie tag from PADO */
-    if (nCookieSize > 0) {
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE+
-                               nNameSize)).type = htons(TAG_AC_COOKIE);
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE+
-                               nNameSize)).length = usCookieSize;
-        memcpy((char *)(packet+1)+(2*TAG_STRUCT_SIZE)+nNameSize,
-            (char *)pCookieStart, nCookieSize);
-        pPacketPoint = (char *)(packet+1)+(2*TAG_STRUCT_SIZE)+nNameSize+nCookieSize;/*  added by Max Ding, 09/23/2008 @add TAG_RELAY_SESSION_ID */
-    }
-    /*  added end Winster Chan 11/25/2005 */
-    /*  modified end, wklin, 03/27/2007 */
-    /*  add start, Max Ding, 09/22/2008 for @add TAG_RELAY_SESSION_ID */
-    if (nRelaySessionIdSize > 0) {
-        (*(struct pppoe_tag *)(pPacketPoint)).type = htons(TAG_RELAY_SESSION_ID);
-        (*(struct pppoe_tag *)(pPacketPoint)).length = usRelaySessionIdSize;
-        memcpy((pPacketPoint+TAG_STRUCT_SIZE),
-            (char *)pRelaySessionIdStart, nRelaySessionIdSize);
-        pPacketPoint += TAG_STRUCT_SIZE + nRelaySessionIdSize;
-    }
-    /*  add end, Max Ding, 09/22/2008 */
-
-    memset(((char *)packet) + size, 0, 14);
-    return size;
+    return sizeof(struct pppoe_packet) + len;
 }
 
-/*  added end Winster Chan 12/02/2005 */
+/* the AC-Cookie and Relay-Session-Id of the PADO go back as they came */
 int
-create_padt(struct pppoe_packet *packet, const char *src, const char *dst, unsigned short nSessId)
+create_padr(struct pppoe_packet *packet, const char *src, const char *dst,
+	    char *name)
 {
-    int size;
-    char *pCookieStart = NULL;
-    int nCookieSize = 0;
-    unsigned short usCookieSize = 0;
-    sPadxTag sTag;
+    struct tag_out o;
+    int len;
 
     if (packet == NULL)
 	return 0;
 
-    size = sizeof(struct pppoe_packet) + TAG_STRUCT_SIZE;
+    tag_out_init(&o, packet + 1, TAGS_ROOM);
+    tag_add(&o, TAG_SERVICE_NAME, name, name ? strlen(name) : 0);
+    tag_copy(&o, &pado_tags, TAG_AC_COOKIE);
+    tag_copy(&o, &pado_tags, TAG_RELAY_SESSION_ID);
+    add_max_payload(&o);
+    if ((len = tag_out_len(&o)) < 0)
+	return 0;
+    disc_header(packet, src, dst, CODE_PADR, 0, len);
 
-    if (get_padx_tag((struct pppoe_tag *)pado_tags, pado_tag_size, &sTag, TAG_AC_COOKIE)) {
-        nCookieSize = sTag.nPadLen;
-        usCookieSize = sTag.usPadLen;
-        pCookieStart = sTag.pPadStart;
-        size += (int)(TAG_STRUCT_SIZE + sTag.nPadLen);
-    }
+    memset((char *)(packet + 1) + len, 0, 14);
+    return sizeof(struct pppoe_packet) + len;
+}
 
-#ifdef __linux__
-    memcpy(packet->ethhdr.h_dest, dst, 6);
-    memcpy(packet->ethhdr.h_source, src, 6);
-    packet->ethhdr.h_proto = htons(ETH_P_PPPOE_DISC);
-#else
-    memcpy(packet->ethhdr.ether_dhost, dst, 6);
-    memcpy(packet->ethhdr.ether_shost, src, 6);
-    packet->ethhdr.ether_type = htons(ETH_P_PPPOE_DISC);
-#endif
-    packet->ver = 1;
-    packet->type = 1;
-    packet->code = CODE_PADT;
-    /*packet->session = session;*/
-    packet->session = nSessId;
-    packet->length = htons(size - sizeof(struct pppoe_packet));
+int
+create_padt(struct pppoe_packet *packet, const char *src, const char *dst, unsigned short nSessId)
+{
+    struct tag_out o;
+    int len;
 
-    /* fill out a blank generic-error tag */
-    (*(struct pppoe_tag *)(packet+1)).type = htons(TAG_GENERIC_ERROR);
-    (*(struct pppoe_tag *)(packet+1)).length = 0;
+    if (packet == NULL)
+	return 0;
 
-    /* fill out the AC cookie tag from PADO */
-    if (nCookieSize > 0) {
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE)).type
-            = htons(TAG_AC_COOKIE);
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE)).length
-            = usCookieSize;
-        memcpy((char *)(packet+1)+(2*TAG_STRUCT_SIZE),
-            (char *)pCookieStart, nCookieSize);
-    }
+    tag_out_init(&o, packet + 1, TAGS_ROOM);
+    /* a blank generic-error tag, and the AC cookie tag from PADO */
+    tag_add(&o, TAG_GENERIC_ERROR, NULL, 0);
+    tag_copy(&o, &pado_tags, TAG_AC_COOKIE);
+    if ((len = tag_out_len(&o)) < 0)
+	return 0;
+    disc_header(packet, src, dst, CODE_PADT, nSessId, len);
 
-    memset(((char *)packet) + size, 0, 14);
-    return size;
+    memset((char *)(packet + 1) + len, 0, 14);
+    return sizeof(struct pppoe_packet) + len;
 }
-/*  added end Winster Chan 12/02/2005 */
-
-unsigned short fcstab[256] = {
-    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
 
-#define PPPINITFCS16    0xffff  /* Initial FCS value */
-#define PPPGOODFCS16    0xf0b8  /* Good final FCS value */
-/*
- * Calculate a new fcs given the current fcs and the new data.
- */
-unsigned short pppfcs16(register unsigned short fcs,
-			register unsigned char * cp,
-			register int len)
+/* hand everything encode_ppp() collected to pppd */
+void flush_ppp(int fd)
 {
-/*    assert(sizeof (unsigned short) == 2);
-    assert(((unsigned short) -1) > 0); */
-
-    while (len--)
-	fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
-
-    return (fcs);
+    if (ppp_out_len > 0 && pktio_pipe_write(&ppp_pipe, ppp_out_len) < 0)
+        perror("pppoe: write (flush_ppp)");
+    ppp_out = pktio_pipe_buf(&ppp_pipe);
+    ppp_out_len = 0;
 }
 
-#define FRAME_ESC 0x7d
-#define FRAME_FLAG 0x7e
-#define FRAME_ADDR 0xff
-#define FRAME_CTL 0x03
-#define FRAME_ENC 0x20
-
-#define ADD_OUT(c) { *out++ = (c); n++; if (opt_verbose) fprintf(log_file, "%x ", (c)); }
-
+/*
+ * Frame a packet for pppd.  Frames are collected in ppp_out and go to fd
+ * in one write when flush_ppp() is called, or when the buffer is full.
+ */
 void encode_ppp(int fd, unsigned char *buf, int len)
 {
-    static int first = 0;
-    unsigned char out_buf[PACKETBUF];
-    unsigned char *out = out_buf;
-    unsigned char header[2], tail[2];
-    int i,n;
-    unsigned short fcs;
+    int n;
     time_t tm;
 
-    header[0] = FRAME_ADDR;
-    header[1] = FRAME_CTL;
-    fcs = pppfcs16(PPPINITFCS16, header, 2);
-    fcs = pppfcs16(fcs, buf, len) ^ 0xffff;
-    tail[0] = fcs & 0x00ff;
-    tail[1] = (fcs >> 8) & 0x00ff;
-
+    if (PPPDBUF - ppp_out_len < HDLC_ENCODED_MAX(len))
+        flush_ppp(fd);
+    hdlc_tx_snoop(&pppd_tx, buf, len, 1);
+    if (opt_sync) {
+        /* one frame per write, as it came; the address/control field is
+           optional in sync mode */
+        if (write(fd, buf, len) < 0)
+            perror("pppoe: write (encode_ppp)");
+        return;
+    }
+    n = hdlc_encode(&pppd_tx, ppp_out + ppp_out_len, buf, len);
     if (opt_verbose)
     {
 	time(&tm);
 	fprintf(log_file, "%sWriting to pppd: \n", ctime(&tm));
+	print_hex(ppp_out + ppp_out_len, n);
+	fputc('\n', log_file);
     }
-
-    n = 0;
-    if (!first) {
-	ADD_OUT(FRAME_FLAG);
-	first = 1;
-    }
-    ADD_OUT(FRAME_ADDR); /* the header - which is constant */
-    ADD_OUT(FRAME_ESC);
-    ADD_OUT(FRAME_CTL ^ FRAME_ENC);
-
-    for (i = 0; i < len; i++)
-	if (buf[i] == FRAME_FLAG || buf[i] == FRAME_ESC || buf[i] < 0x20)
-	{
-	    ADD_OUT(FRAME_ESC);
-	    ADD_OUT(buf[i] ^ FRAME_ENC);
-	}
-	else
-	    ADD_OUT(buf[i]);
-
-    for (i = 0; i < 2; i++) {
-	if (tail[i] == FRAME_FLAG || tail[i] == FRAME_ESC || tail[i] < 0x20) {
-	    ADD_OUT(FRAME_ESC);
-	    ADD_OUT(tail[i] ^ FRAME_ENC);
-	} else
-	    ADD_OUT(tail[i]);
-    }
-    ADD_OUT(FRAME_FLAG);
-
-    write(fd, out_buf, n);
-
-    if (opt_verbose)
-	fprintf(log_file, "\n");
+    ppp_out_len += n;
 }
 
+
+/*
+ * Fill in the Ethernet and PPPoE headers for a PPP frame of 'len' bytes
+ * which the de-framer has already left at (packet + 1).
+ */
 int
 create_sess(struct pppoe_packet *packet, const char *src, const char *dst,
-	    unsigned char *buf, int bufsize, int sess, int *bufRemain)
+	    int len, int sess)
 {
     int size;
-    int i, o = 0;
-    int nBufLen = 0;
-    int nTotalLen = 0, nAllLen = 0;
-    int nTemp = 0;
-    unsigned short usTotalLen = 0x0;
-    unsigned char bufLen[2];
-
-    /* Clear the length of remain buffer */
-    *bufRemain = 0;
-
-    if (opt_fwd || !((buf[0] == FRAME_FLAG) || (buf[0] == FRAME_ADDR)))
-    {
-    	if (opt_fwd_search) /* search for a valid packet */
-    	{
-    	    while (*buf++ != FRAME_FLAG && bufsize != 0)
-    		bufsize--;
-            if (bufsize == 0) {
-                fprintf(error_file, "create_sess: bufsize == 0\n");
-                return 0;
-            }
-    	}
-    	else
-    	{
-    	    /* fprintf(error_file, "create_sess: invalid data\n"); */ /*  wklin
-                                                                         removed,
-                                                                         07/26/2007
-                                                                         */
-    	    return 0;
-    	}
-    }
-
-    bufLen[0] = 0x0;
-    bufLen[1] = 0x0;
-    if (bufsize <= 4) {
-        *bufRemain = bufsize;
-        return 0;
-    }
-    else {
-        nTemp = (buf[0] == FRAME_FLAG) ? 4 : 3;
-        for (i = nTemp; i < bufsize; i++) {
-            if (buf[i] == FRAME_ESC) {
-                if ((o == 4) || (o == 5))
-                    bufLen[o-4] = buf[++i] ^ FRAME_ENC;
-                else
-                    ++i;
-            }
-            else {
-                if ((o == 4) || (o == 5))
-                    bufLen[o-4] = buf[i];
-            }
-            o++;
-
-            /* Get the total length from IP packet header */
-            if (o == 6) {
-                usTotalLen = ntohs(*(unsigned short *)bufLen);
-                nTotalLen = (int)usTotalLen;
-                nAllLen = nTotalLen + 5;
-            }
-
-            /* Get the total buffer length of packet */
-            if ((o >= 6) && (o == nAllLen)) {
-                nBufLen = i + 1;
-                break;
-            }
-        }
-
-        if ((o < nAllLen) || (o < 6)) {
-            *bufRemain = bufsize;
-            return 0;
-        }
-        o = 0;
-    }
-
-    /* for (i = (buf[0] == FRAME_FLAG ? 4 : 3); i < bufsize; i++) { */
-    for (i = nTemp; i < bufsize; i++) {
-        if (buf[i] == FRAME_ESC) {
-            buf[o++] = buf[++i] ^ FRAME_ENC;
-        }
-        else {
-            buf[o++] = buf[i];
-        }
-
-        if (o == nAllLen)
-            break;
-    }   /* End for() */
-
-    /* Compute the length of remain buffer */
-    *bufRemain = bufsize - nBufLen;
-
-    bufsize = nTotalLen + 2;
 
     if (packet == NULL) {
         return 0;
     }
 
-    size = sizeof(struct pppoe_packet) + bufsize;
+    size = sizeof(struct pppoe_packet) + len;
 
 #ifdef __linux__
     memcpy(packet->ethhdr.h_dest, dst, 6);
@@ -1228,7 +1002,7 @@ create_sess(struct pppoe_packet *packet, const char *src, const char *dst,
 }
 
 int
-send_packet(int sock, struct pppoe_packet *packet, int len, const char *ifn)
+send_packet(int sock, struct pppoe_packet *packet, int len)
 {
 #ifdef USE_BPF
   int c;
@@ -1236,13 +1010,9 @@ send_packet(int sock, struct pppoe_packet *packet, int len, const char *ifn)
     perror("pppoe: write (send_packet)");
   return c;
 #else /* regular linux stuff */
-    struct sockaddr addr;
     int c;
     time_t tm;
 
-    memset(&addr, 0, sizeof(addr));
-    strcpy(addr.sa_data, ifn);
-
     if (opt_verbose == 1)
     {
 	time(&tm);
@@ -1252,9 +1022,9 @@ send_packet(int sock, struct pppoe_packet *packet, int len, const char *ifn)
     }
 
 
-    if ((c = sendto(sock, packet, len, 0, &addr, sizeof(addr))) < 0) {
-	/* fprintf(error_file, "send_packet c[%d] = sendto(len = %d)\n", c, len); */
-	perror("pppoe: sendto (send_packet)");
+    if ((c = send(sock, packet, len, 0)) < 0) {
+	/* fprintf(error_file, "send_packet c[%d] = send(len = %d)\n", c, len); */
+	perror("pppoe: send (send_packet)");
     }
 
     return c;
@@ -1366,6 +1136,7 @@ read_packet(int sock, struct pppoe_packet *packet, int *len)
 #ifdef USE_BPF
 	{
 	    int j;
+	    *len = PACKETBUF; /* the length field has to do */
 	    if ((j = read_bpf_packet(sock, packet)) < 0)
 		return -1; /* read_bpf_packet() will report error */
 	    else if (j > 0)
@@ -1378,13 +1149,18 @@ read_packet(int sock, struct pppoe_packet *packet, int *len)
 	
 	FD_ZERO(&fdset);
 	FD_SET(sock, &fdset);
+	if (sig_fd >= 0)
+	    FD_SET(sig_fd, &fdset);
     	tm.tv_usec = 0; 
 	tm.tv_sec = 3; /* wait for 3 seconds */
-	if (select(sock + 1, &fdset, (fd_set *) NULL, (fd_set *) NULL, &tm) <= 0) {
+	if (select((sock > sig_fd ? sock : sig_fd) + 1, &fdset,
+		   (fd_set *) NULL, (fd_set *) NULL, &tm) <= 0) {
             return -1; /* timeout or error */
+	} else if (sig_fd >= 0 && FD_ISSET(sig_fd, &fdset)) {
+	    return sig_fd; /* see worker_sigread() */
 	} else if (FD_ISSET(sock, &fdset)) {
-	    if (recvfrom(sock, packet, PACKETBUF, 0,
-		 NULL /*(struct sockaddr *)&from*/, &fromlen) < 0) {
+	    if ((*len = recvfrom(sock, packet, PACKETBUF, 0,
+		 NULL /*(struct sockaddr *)&from*/, &fromlen)) < 0) {
 	        perror("pppoe: recv (read_packet)");
 	        return -1;
 	    }
@@ -1409,11 +1185,85 @@ read_packet(int sock, struct pppoe_packet *packet, int *len)
     }
 }
 
-void sigchild(int src) {
-    clean_child = 1;
+/* bytes of TAGs in packet, of len bytes in all */
+int disc_payload(struct pppoe_packet *packet, int len)
+{
+    len -= sizeof(*packet);
+    if (len > ntohs(packet->length))
+        len = ntohs(packet->length);
+    return len;
+}
+
+/*
+ * The PPP payload the PADS in packet, of len bytes, leaves the session:
+ * what -m asked for if the AC says it back (RFC 4638), or what it says
+ * if that is less, and PPPOE_PAYLOAD if it says nothing.
+ */
+int pads_payload(struct pppoe_packet *packet, int len)
+{
+    const struct tag_view *v;
+    struct tags tags;
+    unsigned short n;
+
+    if (opt_payload == 0)
+        return PPPOE_PAYLOAD;
+    if (tags_parse(&tags, (unsigned char *)(packet + 1),
+                   disc_payload(packet, len)) < 0 ||
+        (v = tags_find(&tags, TAG_PPP_MAX_PAYLOAD)) == NULL || v->len != sizeof(n)) {
+        fprintf(stderr, "pppoe: no PPP-Max-Payload in PADS, payload %d\n",
+                PPPOE_PAYLOAD);
+        return PPPOE_PAYLOAD;
+    }
+    memcpy(&n, (char *)(packet + 1) + v->off, sizeof(n));
+    n = ntohs(n);
+    if (n > opt_payload)
+        return opt_payload;
+    return n < PPPOE_PAYLOAD ? PPPOE_PAYLOAD : n;
+}
+
+/*
+ * Append the counters kept by this process to PPP_PPPOE_STATS; the file is
+ * removed when a session starts, so it describes the current one only.
+ */
+void save_stats(void)
+{
+    FILE *fp;
+    unsigned long avg;
+
+    if (sess_tx.batches == 0 && sess_rx.batches == 0)
+        return;
+    if (!(fp = fopen(PPP_PPPOE_STATS, "a")))
+        return;
+    /* average batch sizes, in hundredths */
+    if (sess_tx.batches) {
+        avg = sess_tx.frames * 100 / sess_tx.batches;
+        fprintf(fp, "uplink: %lu frames %lu sends %lu.%02lu per send %lu errors\n",
+                sess_tx.frames, sess_tx.batches, avg / 100, avg % 100,
+                sess_tx.errors);
+        fprintf(fp, "hdlc: %lu frames %lu bad fcs %lu runts %lu giants %lu aborts\n",
+                pppd_rx.frames, pppd_rx.bad_fcs, pppd_rx.runts, pppd_rx.giants,
+                pppd_rx.aborts);
+    }
+    if (sess_rx.batches) {
+        avg = sess_rx.frames * 100 / sess_rx.batches;
+        fprintf(fp, "downlink: %lu frames %lu receives %lu.%02lu per receive\n",
+                sess_rx.frames, sess_rx.batches, avg / 100, avg % 100);
+        if (ppp_pipe.spliced)
+            fprintf(fp, "pipe: %lu bytes spliced %lu copied\n",
+                    ppp_pipe.spliced, ppp_pipe.copied);
+    }
+    if (pppd_lcp.dropped)
+        fprintf(fp, "lcp: %lu packets from pppd not passed on\n",
+                pppd_lcp.dropped);
+    fclose(fp);
 }
 
 void cleanup_and_exit(int status) {
+    signal(SIGTERM, SIG_IGN);
+    /* the data threads first, so their counters are final */
+    worker_stop(&sess_worker, WORKER_WAIT);
+    worker_stop(&pppd_worker, WORKER_WAIT);
+    save_stats();
     /*  modified start, Winster Chan, 06/26/2006 */
     pptp_pppox_release(&poxfd, &pppfd);
     close(pppfd); pppfd = -1;
@@ -1424,24 +1274,6 @@ void cleanup_and_exit(int status) {
     close(sess_sock);
     close(1);
 
-    if (pppd_listen > 0)
-    /*if (pppd_pid > 0)*/
-    {
-#ifdef __linux__
-        kill(pppd_listen, SIGTERM);
-#else
-        kill(SIGTERM, pppd_listen);
-#endif
-    }
-    if (sess_listen > 0)
-    /*if (sess_pid > 0)*/
-    {
-#ifdef __linux__
-        kill(sess_listen, SIGTERM);
-#else
-        kill(SIGTERM, sess_listen);
-#endif
-    }
     /* system("killall pppoecd"); */ /*  added, Winster Chan, 06/26/2006
                                       */ /*  wklin removed, 07/26/2007 */
     exit(status);
@@ -1454,7 +1286,11 @@ void sigint(int src)
     int pkt_size;
     FILE *fp;
 
-    if (disc_sock && (pppd_listen > 0)) {
+    /* with SysV signal() semantics a second SIGTERM, from pppd going
+       down too, would cut this short */
+    signal(SIGTERM, SIG_IGN);
+
+    if (disc_sock && sess_up) {
         /* allocate packet once */
         packet = malloc(PACKETBUF);
         assert(packet != NULL);
@@ -1464,7 +1300,7 @@ void sigint(int src)
   	        fprintf(stderr, "pppoe: unable to create PADT packet\n");
             /* exit(1); */
         }
-        if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
+        if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
             fprintf(stderr, "pppoe: unable to send PADT packet\n");
             /* exit(1); */
         }  else {
@@ -1504,7 +1340,7 @@ void sigint2(int src)
             fprintf(stderr, "pppoe: unable to create PADT packet\n");
         /* exit(1); */
     }
-    if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
+    if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
         fprintf(stderr, "pppoe: unable to send PADT packet\n");
         /* exit(1); */
     }  else {
@@ -1531,10 +1367,92 @@ void sigint2(int src)
 /*  added end James 11/12/2008 @new_internet_detection */ 
 #endif
 
-void sess_handler(void) {
+/*
+ * Set up the receive side of sess_sock.  With -M, frames are read from a
+ * ring mapped on it.
+ */
+void sess_rx_setup(void)
+{
+    unsigned char *rxBuf;
+
+    /* allocate the receive slots once */
+    rxBuf = malloc(opt_batch * SESSBUF);
+    assert(rxBuf != NULL);
+    pktio_rx_init(&sess_rx, sess_sock, rxBuf, SESSBUF, opt_batch);
+    if (opt_ring && pktio_rx_ring(&sess_rx) < 0)
+        fprintf(error_file, "pppoe: no receive ring, copying session frames\n");
+}
+
+/*
+ * Leave it to the kernel to drop what the code below would throw away:
+ * frames not addressed to us, discovery codes we never wait for, and
+ * once the session is up, anything from another AC or session.  Called
+ * when the discovery socket is opened and again when the session is
+ * established, where only a PADT from our AC still matters to disc_sock.
+ */
+void set_filters(void)
+{
+#ifndef USE_BPF
+    static const unsigned char disc_codes[] = { CODE_PADO, CODE_PADS, CODE_PADT };
+    static const unsigned char padt_code[] = { CODE_PADT };
+    struct pktio_match m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = ETH_P_PPPOE_DISC;
+    m.dst = (unsigned char *)src_addr;
+    m.session = -1;
+    m.codes = disc_codes;
+    m.ncodes = sizeof(disc_codes);
+    if (session != 0) {
+        m.src = (unsigned char *)dst_addr;
+        m.codes = padt_code;
+        m.ncodes = sizeof(padt_code);
+    }
+    pktio_filter(disc_sock, &m);
+
+    if (session != 0) {
+        m.type = ETH_P_PPPOE_SESS;
+        m.session = ntohs(session);
+        m.codes = NULL;
+        m.ncodes = 0;
+        pktio_filter(sess_sock, &m);
+    }
+#endif
+}
+
+/* downlink thread: the LCP packets pppd sent before what is to be encoded */
+void snoop_drain(void)
+{
+    struct lcp_note *n;
+
+    while ((n = spsc_peek(&pppd_lcp)) != NULL) {
+        hdlc_tx_snoop(&pppd_tx, n->pkt, n->len, 0);
+        spsc_pop(&pppd_lcp);
+    }
+}
+
+/* uplink thread: pass an LCP packet from pppd on to snoop_drain() */
+void snoop_pppd(const unsigned char *frame, int len)
+{
+    struct lcp_note *n;
+
+    if (len < 6 || frame[0] != (PPP_LCP >> 8) || frame[1] != (PPP_LCP & 0xff))
+        return;
+    /* full only if the downlink thread is stuck, which matters more */
+    if ((n = spsc_slot(&pppd_lcp)) == NULL)
+        return;
+    n->len = len < (int)sizeof(n->pkt) ? len : (int)sizeof(n->pkt);
+    memcpy(n->pkt, frame, n->len);
+    spsc_push(&pppd_lcp);
+}
+
+void sess_handler(struct worker *w) {
     /* pull packets of sess_sock and feed to pppd */
     struct pppoe_packet *packet = NULL;
-    int pkt_size;
+    int k, n, pkt_size;
+#ifndef USE_BPF
+    time_t tm;
+#endif
 
 #ifdef BUGGY_AC
 /* the following code deals with buggy AC software which sometimes sends
@@ -1549,87 +1467,225 @@ void sess_handler(void) {
     memset(dup_check, 0, sizeof(dup_check));
 #endif
 
+#ifdef USE_BPF
     /* allocate packet once */
     packet = malloc(PACKETBUF);
     assert(packet != NULL);
+#endif
 
     /* fprintf(error_file, "sess_handler %d\n", getpid()); */ /*  wklin
                                                                  removed,
                                                                  07/27/2007 */
-    while(1)
+    while (!worker_stopping(w))
     {
-	while(read_packet(sess_sock,packet,&pkt_size) != sess_sock)
-	    ;
+#ifdef USE_BPF
+	if (read_packet(sess_sock,packet,&pkt_size) != sess_sock)
+	    continue;
+	n = 1;
+	pkt_size = PACKETBUF;
+#else
+	/* wait for a frame, take whatever else is queued along with it,
+	   then write all of it to pppd at once */
+	if ((n = pktio_rx_recv(&sess_rx, 1)) <= 0)
+	    continue;
+	if (opt_verbose)
+	    time(&tm);
+#endif
+	snoop_drain();
+
+	for (k = 0; k < n; k++)
+	{
+#ifndef USE_BPF
+	    packet = (struct pppoe_packet *)pktio_rx_frame(&sess_rx, k);
+	    pkt_size = sess_rx.len[k];
+	    if (opt_verbose)
+	    {
+		fprintf(log_file, "Received packet at %s", ctime(&tm));
+		print_packet(packet);
+		fputc('\n', log_file);
+	    }
+#endif
+	    if (pkt_size < (int)sizeof(struct pppoe_packet) ||
+		ntohs(packet->length) > pkt_size - sizeof(struct pppoe_packet))
+		continue; /* truncated */
 #ifdef __linux__
-	if (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr)) != 0)
+	    if (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr)) != 0)
 #else
-	if (memcmp(packet->ethhdr.ether_shost, dst_addr, sizeof(dst_addr))
-	    != 0)
+	    if (memcmp(packet->ethhdr.ether_shost, dst_addr, sizeof(dst_addr))
+		!= 0)
 #endif
-	    continue; /* packet not from AC */
-	if (packet->session != session)
-	    continue; /* discard other sessions */
+		continue; /* packet not from AC */
+	    if (packet->session != session)
+		continue; /* discard other sessions */
 #ifdef __linux__
-	if (packet->ethhdr.h_proto != htons(ETH_P_PPPOE_SESS))
-	{
-	    fprintf(log_file, "pppoe: invalid session proto %x detected\n",
-		    ntohs(packet->ethhdr.h_proto));
-	    continue;
-	}
+	    if (packet->ethhdr.h_proto != htons(ETH_P_PPPOE_SESS))
+	    {
+		fprintf(log_file, "pppoe: invalid session proto %x detected\n",
+			ntohs(packet->ethhdr.h_proto));
+		continue;
+	    }
 #else
-	if (packet->ethhdr.ether_type != htons(ETH_P_PPPOE_SESS))
-	{
-	    fprintf(log_file, "pppoe: invalid session proto %x detected\n",
-		    ntohs(packet->ethhdr.ether_type));
-	    continue;
-	}
+	    if (packet->ethhdr.ether_type != htons(ETH_P_PPPOE_SESS))
+	    {
+		fprintf(log_file, "pppoe: invalid session proto %x detected\n",
+			ntohs(packet->ethhdr.ether_type));
+		continue;
+	    }
 #endif
-	if (packet->code != CODE_SESS) {
-	    fprintf(log_file, "pppoe: invalid session code %x\n", packet->code);
-	    continue;
-	}
+	    if (packet->code != CODE_SESS) {
+		fprintf(log_file, "pppoe: invalid session code %x\n", packet->code);
+		continue;
+	    }
 #if BUGGY_AC
-	/* we need to go through a list of recently-received packets to
-	   make sure the AC hasn't sent us a duplicate */
-	for (i = 0; i < DUP_COUNT; i++)
-	    if (memcmp(packet, dup_check[i], sizeof(dup_check[0])) == 0)
-		return; /* we've received a dup packet */
+	    /* we need to go through a list of recently-received packets to
+	       make sure the AC hasn't sent us a duplicate */
+	    for (i = 0; i < DUP_COUNT; i++)
+		if (memcmp(packet, dup_check[i], sizeof(dup_check[0])) == 0)
+		    break; /* we've received a dup packet */
+	    if (i < DUP_COUNT)
+		continue;
 #define min(a,b) ((a) < (b) ? (a) : (b))
-	memcpy(dup_check[ptr], packet, min(ntohs(packet->length),
-						 sizeof(dup_check[0])));
-	ptr = ++ptr % DUP_COUNT;
+	    memcpy(dup_check[ptr], packet, min(ntohs(packet->length),
+						     sizeof(dup_check[0])));
+	    ptr = ++ptr % DUP_COUNT;
 #endif /* BUGGY_AC */
 
-	encode_ppp(1, (unsigned char *)(packet+1), ntohs(packet->length));
+	    encode_ppp(1, (unsigned char *)(packet+1), ntohs(packet->length));
+	}
+	flush_ppp(1);
     }
 }
 
-void pppd_handler(void) {
+/*
+ * Synchronous PPP (-s, pppd's 'sync' option): with N_HDLC on the pty, or
+ * a packet socket or pipe in its place, every read is one frame and there
+ * is neither escaping nor FCS to undo.  Take the frames that are waiting,
+ * up to a batch, and send them together.  Returns -1 on a read error.
+ */
+int pppd_sync(struct pppoe_packet *txHdr)
+{
+    static unsigned char rxBuf[RXRING];
+    struct pppoe_packet *packet;
+    unsigned char *rd;
+    int len, room, n = 0, off = 0;
+    time_t tm;
+
+    do {
+        /* straight into a ring slot, behind room for the header */
+        if (sess_tx.ring) {
+            rd = pktio_tx_slot(&sess_tx) + sizeof(*packet);
+            room = sess_tx.room - sizeof(*packet);
+        } else {
+            rd = rxBuf + off;
+            room = sizeof(rxBuf) - off;
+        }
+        if ((len = read(0, rd, room)) <= 0) {
+            if (n > 0)
+                break;
+            if (len < 0)
+                perror("pppoe: read (pppd_sync)");
+            return len;
+        }
+        if (!sess_tx.ring)
+            off += len;
+        if (opt_verbose == 1) {
+            time(&tm);
+            fprintf(log_file, "\n%sInput of %d bytes:\n", ctime(&tm), len);
+            print_hex(rd, len);
+            fputc('\n', log_file);
+        }
+        if (len >= 2 && rd[0] == FRAME_ADDR && rd[1] == FRAME_CTL) {
+            rd += 2;
+            len -= 2;
+        }
+        if (len <= 0)
+            continue;
+        snoop_pppd(rd, len);
+
+        if (sess_tx.ring) {
+            packet = (struct pppoe_packet *)rd - 1;
+            memcpy(packet, &txHdr[0], sizeof(*packet));
+            packet->length = htons(len);
+            if (pktio_tx_commit(&sess_tx, packet, sizeof(*packet) + len) < 0)
+                fprintf(error_file,
+                        "pppd_handler: unable to send PPPoE packet\n");
+        } else {
+            packet = &txHdr[sess_tx.n];
+            packet->length = htons(len);
+            if (pktio_tx_add(&sess_tx, packet, sizeof(*packet), rd, len) < 0)
+                fprintf(error_file,
+                        "pppd_handler: unable to send PPPoE packet\n");
+        }
+    } while (++n < PKTIO_BATCH && sizeof(rxBuf) - off >= SYNC_FRAME &&
+             ioctl(0, FIONREAD, &len) == 0 && len > 0);
+
+    if ((sess_tx.n > 0 || sess_tx.queued > 0) && pktio_tx_flush(&sess_tx) < 0)
+        fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+    return n;
+}
+
+void pppd_handler(struct worker *w) {
   /* take packets from pppd and feed them to sess_sock */
   struct pppoe_packet *packet = NULL;
   time_t tm;
-  sPktBuf pktBuf[BUFRING];
-  int nPkt = 0;
-  /* unsigned char buf[PACKETBUF]; */
-  int len, pkt_size;
-  int i, bufRemain = 0, bufPos;
-  unsigned char *currBufStart;
+  static unsigned char rxRing[RXRING];
+  static struct pppoe_packet txHdr[PKTIO_BATCH];
+  int len, room, i;
+  unsigned char *rdStart, *frame;
 
   /* fprintf(error_file, "pppd_handler %d\n", getpid()); */ /*  wklin
                                                                removed,
                                                                07/27/2007 */
 
-  /* Clear data buffer */
-  for (i=0; i<BUFRING; i++) {
-    memset(pktBuf[i].packetBuf, 0x0, sizeof(pktBuf[i].packetBuf));
+  hdlc_rx_init(&pppd_rx, HDLC_MRU, opt_fwd);
+  hdlc_rx_ring(&pppd_rx, rxRing, sizeof(rxRing), 0);
+  /* the headers only differ in their length field */
+  for (i = 0; i < PKTIO_BATCH; i++)
+    create_sess(&txHdr[i], src_addr, dst_addr, 0, session);
+  pktio_tx_init(&sess_tx, sess_sock);
+  if (opt_txring) {
+    if (pktio_tx_ring(&sess_tx, if_name) < 0)
+      fprintf(error_file, "pppoe: no transmit ring, copying uplink frames\n");
+    else {
+      /* frames are decoded straight into the ring, each behind room
+         for its header */
+      if (pppd_rx.mru > sess_tx.room - (int)sizeof(*packet))
+        pppd_rx.mru = sess_tx.room - sizeof(*packet);
+      hdlc_rx_target(&pppd_rx, pktio_tx_slot(&sess_tx) + sizeof(*packet));
+    }
   }
 
-  while(1) {
-    /* Read in data buffer, Maximum size is 4095 bytes for evey one read() */
-    if ((len = read(0, &(pktBuf[nPkt].packetBuf[(20+bufRemain)]), (4095-bufRemain))) < 0) {
+  while (!worker_stopping(w)) {
+    if (opt_sync) {
+      if ((len = pppd_sync(txHdr)) < 0) {
+        if (errno == EINTR)
+          continue;
+        fprintf(error_file, "pppd_handler: read packet error len < 0\n");
+        return;
+      }
+      if (len == 0 && ppp_notty) {
+        fprintf(error_file, "pppd_handler: pppd closed the connection\n");
+        return;
+      }
+      if (len == 0)
+        usleep(10000); /* sleep 10ms */
+      continue;
+    }
+
+    /* Read behind the frame left open by the previous read, so it is
+       never copied except when the ring starts over */
+    room = hdlc_rx_space(&pppd_rx, &rdStart, 4095);
+
+    if ((len = read(0, rdStart, room)) < 0) {
+      if (errno == EINTR)
+        continue;
       perror("pppoe");
       fprintf(error_file, "pppd_handler: read packet error len < 0\n");
-      exit(1);
+      return;
+    }
+    if (len == 0 && ppp_notty) {
+      fprintf(error_file, "pppd_handler: pppd closed the connection\n");
+      return;
     }
     if (len == 0) {
       /*  wklin modified start, 07/27/2007 */
@@ -1638,69 +1694,116 @@ void pppd_handler(void) {
       /*  wklin modified end, 07/27/2007 */
       continue;
     }
-    /* Append the length of previous remained data */
-    len += bufRemain;
 
     if (opt_verbose == 1) {
         time(&tm);
         fprintf(log_file, "\n%sInput of %d bytes:\n", ctime(&tm), len);
-        /*print_hex(buf, len);*/
-        print_hex(pktBuf[nPkt].packetBuf, len);
+        print_hex(rdStart, len);
         fputc('\n', log_file);
     }
 
-    bufPos = 0;
-    packet = &(pktBuf[nPkt].packetBuf[0]);
-    currBufStart = &(pktBuf[nPkt].packetBuf[20]);
-    do {
-        /* Segment and compose packet from buffer */
-        if ((pkt_size = create_sess(packet, src_addr, dst_addr, currBufStart, len,
-                                    session, &bufRemain)) == 0) {
-          /* Copy incomplete content to next buffer */
-          if (bufRemain > 0) {
-            if ((nPkt+1) < BUFRING) {
-                memcpy(&(pktBuf[nPkt+1].packetBuf[20]),
-                       &(pktBuf[nPkt].packetBuf[(4115-bufRemain)]),         /* 4115 = 4095 + 20 */
-                       bufRemain);
-            }
-            else {
-                memcpy(&(pktBuf[0].packetBuf[20]),
-                       &(pktBuf[(BUFRING-1)].packetBuf[(4115-bufRemain)]),  /* 4115 = 4095 + 20 */
-                       bufRemain);
+    /* Split the input on flags, whatever protocol the frames carry, and
+       send all frames of this read with as few system calls as possible */
+    hdlc_rx_feed(&pppd_rx, rdStart, len);
+    while (hdlc_rx_frame(&pppd_rx, &frame, &len)) {
+        /* PPPoE carries no address/control field; under ACFC pppd
+           leaves it out itself, and a compressed protocol goes as is */
+        if (len >= 2 && frame[0] == FRAME_ADDR && frame[1] == FRAME_CTL) {
+            frame += 2;
+            len -= 2;
+        }
+        if (len <= 0)
+            continue;
+        snoop_pppd(frame, len);
+
+        if (sess_tx.ring) {
+            /* already in its slot; the header goes in front of it */
+            packet = (struct pppoe_packet *)frame - 1;
+            memcpy(packet, &txHdr[0], sizeof(*packet));
+            packet->length = htons(len);
+            if (pktio_tx_commit(&sess_tx, packet, sizeof(*packet) + len) < 0) {
+              fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+              return;
             }
-          }
-          break;
+            hdlc_rx_target(&pppd_rx,
+                           pktio_tx_slot(&sess_tx) + sizeof(*packet));
+            continue;
         }
 
-        len -= bufRemain;
-
-        /* Send the completely composed packet */
-        if (send_packet(sess_sock, packet, pkt_size, if_name) < 0) {
+        packet = &txHdr[sess_tx.n];
+        packet->length = htons(len);
+        if (pktio_tx_add(&sess_tx, packet, sizeof(*packet), frame, len) < 0) {
           fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
-          exit(1);
+          return;
         }
+    }
+    if ((sess_tx.n > 0 || sess_tx.queued > 0) &&
+        pktio_tx_flush(&sess_tx) < 0) {
+      fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+      return;
+    }
+  }
+}
 
-        /* Check if all the contents of buffer were processed */
-        if (bufRemain <= 0) {
-            break;
-        }
-        else {
-            /* Renew the positions of packet header and data buffer */
-            bufPos += len;
-            currBufStart = &(pktBuf[nPkt].packetBuf[bufPos+20]);
-            packet = &(pktBuf[nPkt].packetBuf[bufPos]);
-            len = bufRemain;
-        }
-    } while (bufRemain > 0);
+/*
+ * The session from before we were restarted is ended alongside the new
+ * discovery rather than before it: its PADT goes out again with each
+ * PADI or PADR sent again, DISC_STALE_TRIES times in all, until the AC
+ * sends one back.
+ */
+void stale_send(void)
+{
+    static struct pppoe_packet *packet = NULL;
+    int pkt_size;
 
-    /* Process next read buffer */
-    nPkt++;
-    if (nPkt >= BUFRING)
-        nPkt = 0;
+    if (stale_id == 0)
+        return;
+    if (stale_tries++ == DISC_STALE_TRIES) {
+        stale_id = 0; /* the AC has had time enough */
+        return;
+    }
+    if (packet == NULL) {
+        packet = malloc(PACKETBUF);
+        assert(packet != NULL);
+    }
+    /* send PADT to server to clear the previous connection */
+    if ((pkt_size = create_padt(packet, src_addr, stale_ac, stale_id)) == 0) {
+        fprintf(stderr, "pppoe: unable to create PADT packet\n");
+        cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
+    }
+    if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
+        fprintf(stderr, "pppoe: unable to send PADT packet\n");
+        cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
+    }
+    fprintf(stderr, "PPPOE: PADT sent\n"); /*  wklin added, 07/26/2007 */
+}
 
-  }
+/* 1 if packet is the AC's PADT for the session from before */
+int stale_padt(struct pppoe_packet *packet)
+{
+    if (stale_id == 0 || packet->code != CODE_PADT ||
+        packet->session != stale_id ||
+#ifdef __linux__
+        memcmp(packet->ethhdr.h_source, stale_ac, ETH_ALEN) != 0)
+#else
+        memcmp(packet->ethhdr.ether_shost, stale_ac, ETH_ALEN) != 0)
+#endif
+        return 0;
+    stale_id = 0;
+    return 1;
 }
 
+/* how long the PADS took from our start, ahead of save_stats()'s counters */
+void disc_stats(void)
+{
+    FILE *fp;
+    long now = worker_now();
+
+    if (!(fp = fopen(PPP_PPPOE_STATS, "a")))
+        return;
+    fprintf(fp, "discovery: %ld ms to PADS\n", now - disc_begun);
+    fclose(fp);
+}
 
 int main(int argc, char **argv)
 {
@@ -1714,10 +1817,23 @@ int main(int argc, char **argv)
 
     int opt;
     int ret_sock; /*  wklin added, 12/27/2007 */
+    int stale = 0; /* the PADS loop got the PADT stale_send() asked for */
+    int sig;
     time_t tm; /*  wklin added, 12/27/2007 */
+    char *p;
+    /* the ones handled by sigint() and sigint2() */
+#ifdef NEW_WANDETECT
+    static const int sigs[] = { SIGINT, SIGTERM, SIGUSR1 };
+#else
+    static const int sigs[] = { SIGINT, SIGTERM };
+#endif
+
+    disc_begun = worker_now();
 
     /* initialize error_file here to avoid glibc2.1 issues */
      error_file = stderr;
+    /* FCS tables and scanners, before any thread could race for them */
+    hdlc_init();
 
     /*  wklin added start, 07/26/2007 */
     fd = open("/dev/console", O_WRONLY);
@@ -1727,7 +1843,7 @@ int main(int argc, char **argv)
 
     /* parse options */
     /*  wklin modified, 03/27/2007, add service name option S */
-    while ((opt = getopt(argc, argv, "I:L:VE:F:S:")) != -1)
+    while ((opt = getopt(argc, argv, "I:L:VE:F:S:B:MTsb:C:m:")) != -1)
 	switch(opt)
 	{
 	case 'F': /* sets invalid forwarding */
@@ -1774,6 +1890,49 @@ int main(int argc, char **argv)
 		exit(1);
 	    }
 	    break;
+	case 'M': /* read session frames from a mapped ring */
+	    opt_ring = 1;
+	    break;
+	case 'T': /* build uplink frames in a mapped ring */
+	    opt_txring = 1;
+	    break;
+	case 's': /* pppd runs with 'sync': unframed PPP on the pty */
+	    opt_sync = 1;
+	    break;
+	case 'b': /* kilobytes of buffer when pppd is on a pipe or socket */
+	    opt_pipebuf = atoi(optarg) * 1024;
+	    if (opt_pipebuf <= 0)
+	    {
+		fprintf(stderr, "Invalid buffer size %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'C': /* CPUs of the downlink and the uplink thread */
+	    opt_cpu[0] = opt_cpu[1] = atoi(optarg);
+	    if ((p = strchr(optarg, ',')) != NULL)
+		opt_cpu[1] = atoi(p + 1);
+	    if (opt_cpu[0] < 0 || opt_cpu[1] < 0)
+	    {
+		fprintf(stderr, "Invalid CPU %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'm': /* PPP-Max-Payload to ask for */
+	    opt_payload = atoi(optarg);
+	    if (opt_payload < PPPOE_PAYLOAD || opt_payload > PPPOE_PAYLOAD_MAX)
+	    {
+		fprintf(stderr, "Invalid PPP payload %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'B': /* session frames taken per system call */
+	    opt_batch = atoi(optarg);
+	    if (opt_batch < 1 || opt_batch > PKTIO_BATCH)
+	    {
+		fprintf(stderr, "Invalid batch size %s\n", optarg);
+		exit(1);
+	    }
+	    break;
 	case 'V': /* version */
 	    printf("pppoe version %d.%d\n", VERSION_MAJOR, VERSION_MINOR);
 	    exit(0);
@@ -1852,6 +2011,8 @@ int main(int argc, char **argv)
 	fprintf(error_file, "pppoe: unable to create raw socket\n");
 	return 1;
     }
+    payload_fit(disc_sock);
+    set_filters();
 
     /* initiate connection */
 
@@ -1862,13 +2023,10 @@ int main(int argc, char **argv)
     else {
         unsigned int nMacAddr[ETH_ALEN];
         int nSessId, i;
-        char cMacAddr[ETH_ALEN];
-        unsigned short usSessId;
 
         /* Init variables */
         for (i=0; i<ETH_ALEN; i++) {
             nMacAddr[i] = 0;
-            cMacAddr[i] = 0x0;
         }
         nSessId = 0;
 
@@ -1881,39 +2039,19 @@ int main(int argc, char **argv)
 
             /* Transfer types of data */
             for (i=0; i<ETH_ALEN; i++) {
-                cMacAddr[i] = (char)nMacAddr[i];
+                stale_ac[i] = (char)nMacAddr[i];
             }
-            usSessId = (unsigned short)nSessId;
+            stale_id = htons((unsigned short)nSessId);
 
             /* Check if the previous MAC address and Session ID exist. */
-            if (!((cMacAddr[0]==0x0) && (cMacAddr[1]==0x0) && (cMacAddr[2]==0x0) &&
-                 (cMacAddr[3]==0x0) && (cMacAddr[4]==0x0) && (cMacAddr[5]==0x0)) &&
-                (htons(usSessId) != 0x0)) {
-                    
-                /* send PADT to server to clear the previous connection */
-                if ((pkt_size = create_padt(packet, src_addr, cMacAddr,
-                                    (unsigned short)htons(usSessId))) == 0) {
-          	        fprintf(stderr, "pppoe: unable to create PADT packet\n");
-                    fclose(fp);
-                    /*exit(1);*/
-                    cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
-                }
-                if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
-                    fprintf(stderr, "pppoe: unable to send PADT packet\n");
-                    fclose(fp);
-                    /*exit(1);*/
-                    cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
-                } else {
-                    fprintf(stderr, "PPPOE: PADT sent\n"); /*  wklin added, 07/26/2007 */
-                }
-
-                /*  modified start, Winster Chan, 06/26/2006 */
-                /*pptp_pppox_release(&poxfd, &pppfd);*/ /*  removed by EricHuang, 05/24/2007 */
-                /*  modified end, Winster Chan, 06/26/2006 */
-
-                /* Waiting 3 seconds for server finishing the termination */
-                sleep(3);
-            }
+            for (i = 0; i < ETH_ALEN && stale_ac[i] == 0; i++)
+                ;
+            if (i == ETH_ALEN)
+                stale_id = 0;
+
+            /* no waiting for the server to finish the termination: that
+               goes on while we look for the next session */
+            stale_send();
         }
         fclose(fp);
     }
@@ -1926,20 +2064,27 @@ int main(int argc, char **argv)
 	exit(1);
     }
     /* send the PADI packet */
-    if (send_packet(disc_sock, packet, pkt_size, if_name) < 0) {
+    if (send_packet(disc_sock, packet, pkt_size) < 0) {
 	fprintf(stderr, "pppoe: unable to send PADI packet\n");
 	exit(1);
     }
 
     time(&tm); /*  wklin added, 12/27/2007, for storing PADI time */
     /* wait for PADO */
+    /* a PADO whose TAGs do not parse is no better than none; one that
+       does has them kept, for the PADR and the PADT */
     while ((ret_sock = read_packet(disc_sock, packet, &pkt_size)) != disc_sock ||
-	   (packet->code != CODE_PADO )) { /*  wklin modified, 12/27/2007 */
+	   (packet->code != CODE_PADO ) || /*  wklin modified, 12/27/2007 */
+	   tag_buf_set(&pado_tags, (unsigned char *)(packet + 1),
+		       disc_payload(packet, pkt_size), NULL) < 0) {
+	if (ret_sock == disc_sock && stale_padt(packet))
+	    continue;
 	fprintf(log_file, "pppoe: unexpected packet %x\n",
 		packet->code);
 	/*  wklin added start, 12/27/2007 */
 	if (ret_sock == disc_sock && 
-		(packet->code == CODE_PADI || packet->code == CODE_PADR)) {
+		(packet->code == CODE_PADI || packet->code == CODE_PADR ||
+		 packet->code == CODE_PADO)) { /* or a PADO spoilt */
 	    if (time(NULL) - tm < 3)
 	       continue;
 	}
@@ -1953,12 +2098,13 @@ int main(int argc, char **argv)
 		exit(1);
     	}
     	/* send the PADI packet */
-    	if (send_packet(disc_sock, packet, pkt_size, if_name) < 0) {
+    	if (send_packet(disc_sock, packet, pkt_size) < 0) {
 		fprintf(stderr, "pppoe: unable to send PADI packet\n");
 		exit(1);
     	}
 	time(&tm); /*  added, 12/27/2007, for storing PADI time */
 	/* wklin added end, 01/10/2007 */
+	stale_send();
 	continue;
     }
 
@@ -1986,41 +2132,39 @@ int main(int argc, char **argv)
 #else
     memcpy(dst_addr, packet->ethhdr.ether_shost, sizeof(dst_addr));
 #endif
-    /*  added start Winster Chan 11/25/2005 */
-    /* Stored tags of PADO */
-    memset(pado_tags, 0x0, sizeof(pado_tags));
-    if ((htons(packet->length) < 0) || (htons(packet->length) > sizeof(pado_tags))) {
-        pado_tag_size = sizeof(pado_tags);
-    }
-    else {
-        pado_tag_size = (int)(htons(packet->length));
-    }
-    memcpy((char *)pado_tags, (char *)(packet + 1), pado_tag_size);
-    /*  added end Winster Chan 11/25/2005 */
-
     /* send PADR */
     /*  wklin modified, 03/27/2007, add service name */
     if ((pkt_size = create_padr(packet, src_addr, dst_addr, service_name)) == 0) {
 	fprintf(stderr, "pppoe: unable to create PADR packet\n");
 	exit(1);
     }
-    if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
+    if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
 	fprintf(stderr, "pppoe: unable to send PADR packet\n");
 	exit(1);
     }
 
     /* wait for PADS */
 #ifdef __linux__
-    while (read_packet(disc_sock, packet, &pkt_size) != disc_sock ||
+    while ((ret_sock = read_packet(disc_sock, packet, &pkt_size)) != disc_sock ||
+	   (stale = stale_padt(packet)) ||
 	   (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr)) != 0) || 
        (packet->code != CODE_PADS && packet->code != CODE_PADT)) /*  wklin modified, 08/09/2007 */
 #else
-    while (read_packet(disc_sock, packet, &pkt_size) != disc_sock ||
+    while ((ret_sock = read_packet(disc_sock, packet, &pkt_size)) != disc_sock ||
+	   (stale = stale_padt(packet)) ||
 	   (memcmp(packet->ethhdr.ether_shost,
 		   dst_addr, sizeof(dst_addr)) != 0))
 #endif
     {
         static int retried=0; /* wklin added, 01/26/2007 */
+
+	/* the AC ending the old session is what stale_send() asked for,
+	   not a reason to send the PADR again (stale_padt() takes it only
+	   once, so the loop condition keeps what it said) */
+	if (ret_sock == disc_sock && stale) {
+	    stale = 0;
+	    continue;
+	}
         /*  wklin removed start, 08/09/2007 */
 	    /* if (packet->code != CODE_PADS && packet->code != CODE_PADT)
 	    fprintf(log_file, "pppoe: unexpected packet %x\n", packet->code);
@@ -2034,10 +2178,11 @@ int main(int argc, char **argv)
 	    fprintf(stderr, "pppoe: unable to create PADR packet\n");
             exit(1);
         }
-        if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
+        if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
 	    fprintf(stderr, "pppoe: unable to send PADR packet\n");
             exit(1);
         }
+        stale_send();
         if (retried++ == 5) {
             retried = 0;
             packet->code = CODE_PADT; 
@@ -2072,6 +2217,7 @@ int main(int argc, char **argv)
     }
 
     session = packet->session;
+    payload = pads_payload(packet, pkt_size);
 
     /*  wklin added start, 07/31/2007 */
     if (session == 0) { /* PADS generic error */
@@ -2086,6 +2232,8 @@ int main(int argc, char **argv)
     	fprintf(log_file, "pppoe: unable to create raw socket\n");
     	cleanup_and_exit(1);
     }
+    sess_rx_setup();
+    set_filters();
 
     /*  added start, Winster Chan, 06/26/2006 */
     memcpy(dstMac, dst_addr, ETH_ALEN);
@@ -2103,44 +2251,63 @@ int main(int argc, char **argv)
         perror(PPP_PPPOE_SESSION);
     }
     else {
-        /* Save the PPPoE server MAC address and Session ID */
-        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
+        /* Save the PPPoE server MAC address and Session ID, and the PPP
+           payload for pppd's MTU and MRU */
+        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d %d\n",
             (unsigned char)(dst_addr[0]), (unsigned char)(dst_addr[1]),
             (unsigned char)(dst_addr[2]), (unsigned char)(dst_addr[3]),
             (unsigned char)(dst_addr[4]), (unsigned char)(dst_addr[5]),
-            (int)htons(session));
+            (int)htons(session), payload);
         fclose(fp);
     }
     /*  added end Winster Chan 12/05/2005 */
 
-    clean_child = 0;
-    signal(SIGCHLD, sigchild);
+    if (opt_sync && isatty(0)) {
+        /* have the pty keep frame boundaries */
+        int disc = N_HDLC;
 
-    /* all sockets are open fork off handlers */
-    if ((sess_listen = fork()) == 0)
-    {
-	    sess_handler(); /* child */
-    }
-    if (sess_listen < 0) {
-    	perror("pppoe: fork");
-    	cleanup_and_exit(1);
-    }
-    if ((pppd_listen = fork()) == 0)
-    {
-	    pppd_handler(); /* child */
-    }
-    if (pppd_listen < 0) {
-    	perror("pppoe: fork");
-    	cleanup_and_exit(1);
+        if (ioctl(0, TIOCSETD, &disc) < 0) {
+            perror("pppoe: ioctl(TIOCSETD)");
+            fprintf(error_file, "pppoe: no N_HDLC line discipline, cannot run -s\n");
+            cleanup_and_exit(1);
+        }
     }
+    /* pppd 'notty' on a pipe pair or socketpair: no tty layer in the way,
+       so give it room, and hand the encoded stream over by reference */
+    ppp_notty = !isatty(0);
+    if (pktio_pipe_size(0, opt_pipebuf) < 0 ||
+        pktio_pipe_size(1, opt_pipebuf) < 0)
+        perror("pppoe: cannot size the buffers to pppd");
+    pktio_pipe_init(&ppp_pipe, 1, ppp_buf[0], ppp_buf[1], !opt_sync);
+    ppp_out = pktio_pipe_buf(&ppp_pipe);
+    ppp_out_len = 0;
+    unlink(PPP_PPPOE_STATS); /* counters of the previous session */
+    disc_stats();
+
+    /* one thread per direction, sharing this process and its buffers;
+       signals are left to this one, which takes them next to disc_sock
+       rather than in a handler, so they never cut into
+       cleanup_and_exit() */
+    if ((sig_fd = worker_sigfd(sigs, sizeof(sigs) / sizeof(sigs[0]))) < 0 ||
+        worker_init() < 0 ||
+        spsc_init(&pppd_lcp, LCP_NOTES, sizeof(struct lcp_note)) < 0 ||
+        worker_start(&sess_worker, sess_handler, opt_cpu[0]) < 0 ||
+        worker_start(&pppd_worker, pppd_handler, opt_cpu[1]) < 0)
+        cleanup_and_exit(1);
+    sess_up = 1;
 
-    /* wait for all children to die */
-    /* this is not perfect - race conditions on dying children are still
-       possible */
-    while(1) {
-	if (waitpid((pid_t)-1,NULL,WNOHANG) < 0 && errno == ECHILD)
-	    break; /* all children dead */
-	if (read_packet(disc_sock, packet, &pkt_size) == disc_sock) {
+    /* until the AC ends the session, or a data thread gives up: a
+       returning thread interrupts read_packet() */
+    while (!worker_done(&sess_worker) && !worker_done(&pppd_worker)) {
+	if ((ret_sock = read_packet(disc_sock, packet, &pkt_size)) == sig_fd) {
+	    while ((sig = worker_sigread(sig_fd)) > 0)
+#ifdef NEW_WANDETECT
+		if (sig == SIGUSR1)
+		    sigint2(sig);
+		else
+#endif
+		    sigint(sig);
+	} else if (ret_sock == disc_sock) {
         /*  wklin modified, 03/23/2007, check PADT session ID */
         /*  wklin added start, 07/26/2007 */
         if (packet->code == CODE_PADT)
@@ -2152,15 +2319,9 @@ int main(int argc, char **argv)
 		    cleanup_and_exit(1);
 	    }
 	}
-	/* clean up any dead children */
-	while (waitpid((pid_t)-1,NULL,WNOHANG) > 0)
-	    ;
-
     }
-    /*  added start, Winster Chan, 06/26/2006 */
-    close(pppfd); pppfd = -1;
-    close(poxfd); poxfd = -1;
-    /*  added end, Winster Chan, 06/26/2006 */
+    /* pppd is gone, or the link is: tell the AC */
+    sigint(SIGTERM);
 
     return 0;
 }
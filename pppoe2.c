@@ -80,17 +80,68 @@ unsigned char local_ether[ETH_ALEN]; /* need to this filter packets */
 extern int errno;
 #endif
 
+#include "hdlc.h"
+#include "pktio.h"
+#include "evloop.h"
+#include "uring.h"
+#include "tags.h"
+
 /* used as the size for a packet buffer */
 /* should be > 2 * size of max packet size */
 #define PACKETBUF (4096 + 30)
-/*  added start Winster Chan 11/25/2005 */
-#define TAGBUF 128
-/*  added end Winster Chan 11/25/2005 */
+/* longest frame accepted from pppd, FCS included */
+#define HDLC_MRU (PACKETBUF / 2)
+/* encoded frames buffered for one write to pppd */
+#define PPPDBUF (16 * 1024)
+/* room for one frame from sess_sock */
+#define SESSBUF 2048
+/* longest frame N_HDLC hands over in sync mode */
+#define SYNC_FRAME 4096
+/* bytes of pppd input buffered */
+#define RXRING (8 * 4096)
+/* buffers of a pipe or socket standing in for the pty */
+#define PIPEBUF (256 * 1024)
+/* io_uring (-U): uplink frames in flight, and buffers taken by the
+   receives kept posted on sess_sock and the pty */
+#define UR_SLOTS 64
+#define UR_SESSBUFS 64
+#define UR_PPPDBUFS 16
+#define UR_PPPDBUF 4096
+/* what a completion is for */
+#define UR_SESS_RX 1
+#define UR_PPPD_RX 2
+#define UR_PPPD_TX 3
+#define UR_SESS_TX 4
+/* ms discovery waits for an answer before sending PADI or PADR again:
+   at first, and at most once doubled (see -r) */
+#define DISC_RTO 1000
+#define DISC_RTO_MAX 16000
+/* PADRs sent before the AC is given up on, and with -q, before the AC
+   of the last session is */
+#define DISC_PADR_TRIES 5
+#define DISC_QUICK_TRIES 2
+/* PADTs for the session from before a restart, DISC_STALE_RTO ms apart,
+   after which the AC is taken to be done with it */
+#define DISC_STALE_TRIES 3
+#define DISC_STALE_RTO 1000
+/* ms of waiting for a better PADO (see -w), and after a failure or a
+   PADT before starting over */
+#define DISC_PADO_WAIT 3000
+#define DISC_HOLDOFF 3000
+/* ms the AC that lost a PADR race (-x) has to answer, and be sent a PADT */
+#define DISC_RIVAL_WAIT 3000
+/* what an offer is worth, in ms of latency: one naming the AC or the
+   service asked for, one from an AC that failed every time before, and
+   with MULTIPLE_PPPOE, one from an AC a unit has just taken */
+#define DISC_NAME_BONUS 10000
+#define DISC_LOST_COST 2000
+#define DISC_USED_COST 2000
+/* s after which an AC a unit took costs nothing more; until then
+   DISC_USED_COST fades away evenly */
+#define DISC_USED_AGE 600
 
 /*  added start, Winster Chan, 06/26/2006 */
-static int poxfd = -1;
-static int pppfd = -1;
-unsigned short sessId = 0;
+unsigned short sessId = 0; /* the session pptp_pppox_connect() is for */
 char dstMac[ETH_ALEN];
 /*  added start, Winster Chan, 06/26/2006 */
 
@@ -123,8 +174,14 @@ struct pppoe_packet {
     /* payload follows */
 };
 
-/* maximum payload length */
-#define MAX_PAYLOAD (1484 - sizeof(struct pppoe_packet))
+/* PPP payload of a session in a 1500 byte Ethernet payload (RFC 2516),
+   and the most -m asks for beyond that (RFC 4638): SESSBUF and the
+   rings take such frames with room to spare */
+#define PPPOE_PAYLOAD 1492
+#define PPPOE_PAYLOAD_MAX 1500
+/* what the interface MTU holds besides the PPP payload: the PPPoE header
+   and the PPP protocol field */
+#define PPPOE_OVERHEAD 8
 
 /* PPPoE codes */
 #define CODE_SESS 0x00 /* PPPoE session */
@@ -147,7 +204,9 @@ struct pppoe_tag {
 /*  added start Winster Chan 11/25/2005 */
 #define TAG_STRUCT_SIZE  sizeof(struct pppoe_tag)
 #define PPP_PPPOE_SESSION   "/tmp/ppp/pppoe_session"
+#define PPP_PPPOE_STATS     "/tmp/ppp/pppoe_stats"
 #define PPP_PPPOE2_SESSION   "/tmp/ppp/pppoe2_session"
+#define PPP_PPPOEN_SESSION   "/tmp/ppp/pppoe%d_session" /* and on */
 /*#define PPP_PPPOE_IFNAME    "/tmp/ppp/pppoe_ifname"*/
 /*  added end Winster Chan 11/25/2005 */
 
@@ -159,6 +218,7 @@ struct pppoe_tag {
 #define TAG_AC_COOKIE          0x0104
 #define TAG_VENDOR_SPECIFIC    0x0105
 #define TAG_RELAY_SESSION_ID   0x0110
+#define TAG_PPP_MAX_PAYLOAD    0x0120
 #define TAG_SERVICE_NAME_ERROR 0x0201
 #define TAG_AC_SYSTEM_ERROR    0x0202
 #define TAG_GENERIC_ERROR      0x0203
@@ -167,6 +227,22 @@ struct pppoe_tag {
 int opt_verbose = 0;   /* logging */
 int opt_fwd = 0;       /* forward invalid packets */
 int opt_fwd_search = 0; /* search for next packet when forwarding */
+int opt_batch = PKTIO_BATCH; /* session frames taken per system call */
+int opt_ring = 0; /* map a receive ring for the session socket */
+int opt_txring = 0; /* build uplink frames in a mapped transmit ring */
+int opt_sync = 0; /* one unframed PPP frame per read/write on the pty */
+int opt_pipebuf = PIPEBUF; /* buffer size when pppd is 'notty' */
+int opt_uring = 0; /* sess_sock and the pty through io_uring */
+long opt_rto = DISC_RTO, opt_rto_max = DISC_RTO_MAX; /* -r */
+#ifdef MULTIPLE_PPPOE
+long opt_pado_wait = DISC_PADO_WAIT; /* -w: for better PADOs than the first */
+#else
+long opt_pado_wait = 0;
+#endif
+char *opt_ac_name = NULL; /* -A: the AC-Name preferred */
+int opt_race = 0; /* -x: PADR to the two best ACs, keep the first PADS */
+int opt_quick = 0; /* -q: PADR straight to the AC of the last session */
+int opt_payload = 0; /* -m: PPP-Max-Payload asked for, 0 for none */
 #ifdef MULTIPLE_PPPOE
 #define log_file stderr
 #else
@@ -179,19 +255,104 @@ int ppp_ifunit = 0; /*  wklin added, 08/16/2007 */
 pid_t sess_listen = 0, pppd_listen = 0; /* child processes */
 int disc_sock = 0, sess_sock = 0; /* PPPoE sockets */
 char src_addr[ETH_ALEN]; /* source hardware address */
-char dst_addr[ETH_ALEN]; /* destination hardware address */
 char *if_name = NULL; /* interface to use */
-int session = 0; /* identifier for our session */
 int clean_child = 0; /* flag set when SIGCHLD received */
-/*  added start Winster Chan 11/25/2005 */
-char pado_tags[TAGBUF]; /* TAGs of PADO */
-int pado_tag_size = 0;
-typedef struct {
-    unsigned short  usPadLen;   /* Tag length in type of unsigned short */
-    int             nPadLen;    /* Tag length in type of integer */
-    char            *pPadStart; /* Start point of tag payload */
-} sPadxTag, *pPadxTag;
-/*  added end Winster Chan 11/25/2005 */
+struct pktio_tx sess_tx; /* frames going out on sess_sock */
+struct pktio_rx sess_rx; /* frames coming in on sess_sock */
+struct uring ur; /* -U */
+struct uring_bufs ur_sess_bufs, ur_pppd_bufs;
+unsigned char *ur_slots; /* UR_SLOTS uplink frames of SESSBUF bytes */
+int ur_free[UR_SLOTS], ur_nfree; /* slots not waiting for a send */
+int ur_slot; /* the slot pppd_rx decodes into */
+int ur_queued; /* sends prepared since the last submit */
+struct pppoe_packet ur_hdr; /* header of every uplink frame */
+int ur_cur = 0; /* ppp_buf[] being filled */
+unsigned char *ur_wr; /* the write to pppd in flight, if ur_wr_len > 0 */
+int ur_wr_len = 0;
+/* everything main() waits for, each registered once; every session
+   has its own for pppd and a timer for discovery */
+struct ev_handler disc_ev, sess_ev, sig_ev, uring_ev;
+struct pppoe_packet *disc_pkt = NULL; /* discovery packets going out */
+int sess_over = 0; /* no session left, leave the main loop */
+/* an AC that answered our PADI, while we choose */
+struct disc_offer {
+    char            ac[ETH_ALEN];
+    long            score;      /* disc_score(), more is better */
+    struct tag_buf  tags;       /* of its PADO */
+};
+
+/*
+ * One PPPoE session and the pppd it carries.  Frames from sess_sock find
+ * their session through sess_index[] by ID, and the AC's address tells
+ * apart sessions two ACs happened to give the same ID.  Contexts start on
+ * a cache line of their own, with what every frame looks at up front.
+ */
+#define SESS_LINE 64
+
+/* where discovery is at for a session */
+#define DISC_IDLE        0 /* not looking for one: not started, or pppd is gone */
+#define DISC_PADI_SENT   1 /* waiting for a PADO */
+#define DISC_PADR_SENT   2 /* an AC is chosen, waiting for its PADS */
+#define DISC_SESSION     3 /* PADS came, frames flow */
+#define DISC_TERMINATING 4 /* ended by a PADT or a failure, holding off */
+
+struct sess_ctx {
+    unsigned short  id;         /* session ID as on the wire, 0 until PADS */
+    char            ac[ETH_ALEN]; /* hardware address of the AC */
+    int             state;      /* DISC_* */
+    int             dirty;      /* on sess_dirty */
+    struct sess_ctx *next_id;   /* next one with the same ID */
+    struct sess_ctx *next_dirty;
+    int             in, out;    /* pppd channel, -1 for none */
+    int             notty;      /* pppd is on a pipe or socket: EOF means it is gone */
+    unsigned char   *ppp_out;   /* encoded frames not yet written to pppd */
+    int             ppp_out_len;
+    struct hdlc_rx  rx;         /* frames coming from pppd */
+    struct hdlc_tx  tx;         /* frames going to pppd */
+    struct pktio_pipe pipe;
+    struct ev_handler pppd_ev;
+    int             unit;       /* ppp unit, and which state file */
+    int             poxfd, pppfd; /* kernel PPPoX channel */
+    char            file[40];   /* PPP_PPPOE_SESSION or one like it */
+    struct tag_buf  pado_tags;  /* TAGs of PADO */
+    /* discovery */
+    struct ev_tmo   timer;      /* retransmits, and the hold-off */
+    unsigned short  uniq;       /* Host-Uniq of our PADI and PADR, with nsess > 1 */
+    long            rto;        /* ms to wait after the next send */
+    int             tries;      /* sends of tmpl so far */
+    long            sent;       /* ev_now() of the last one */
+    long            since;      /* ev_now() of the PADS */
+    int             payload;    /* PPP payload the PADS left it, see pads_payload() */
+    struct disc_offer offer[2]; /* the best two of this round, then the rival */
+    int             noffers;
+    int             rival;      /* -x: offer[1] got a PADR too, and is not done with */
+    int             quick;      /* -q: the PADR is to the AC of the last session */
+    long            begun;      /* ev_now() discovery started at */
+    /* the session of s from before we were restarted, ended meanwhile */
+    struct ev_tmo   stale_tmo;
+    char            stale_ac[ETH_ALEN];
+    unsigned short  stale_id;   /* as on the wire, 0 once the AC is done with it */
+    int             stale_tries;
+    int             held;       /* a PADR its AC refused meanwhile, to send again */
+    unsigned char   tmpl[PACKETBUF]; /* the PADI or PADR, as sent each time */
+    int             tmpl_len;
+    /* the headers only differ in their length field */
+    struct pppoe_packet txhdr[PKTIO_BATCH];
+    unsigned char   ppp_buf[2][PPPDBUF]; /* taken in turn, see pktio_pipe_write() */
+    unsigned char   ring[RXRING]; /* pppd input */
+} __attribute__ ((aligned(SESS_LINE)));
+
+/* what the command line asks for, until sess_init() */
+struct sess_opt {
+    int in, out, unit;
+} *sess_opts = NULL;
+
+struct sess_ctx *sess_tab = NULL; /* nsess of them */
+int nsess = 0;
+int nsess_live = 0; /* whose pppd is still there */
+unsigned short sess_index[65536]; /* by ID: 1 + the first in sess_tab with it */
+struct sess_ctx *sess_dirty = NULL; /* encode_ppp() left frames for these */
+struct sess_ctx *ur_sess = NULL; /* the one -U serves */
 #ifdef NEW_WANDETECT
 int bWanDetect = 0;/*  added by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
 #endif
@@ -199,18 +360,12 @@ int bWanDetect = 0;/*  added by Max Ding, 04/23/2009 not use pppd to reduce memo
 /* Winster Chan debugtest */
 #define DEBUG_PRINT_PACKET  0
 #define DEBUG_SEND_PACKET   0
-#define BUFRING             5 /* 40 */ /*  wklin modified, 08/13/2007 */
 #define DEBUG_PRINT         0
 #define PPPOE_DEBUG_FILE    "/tmp/ppp/pppoeDbg"
 FILE *fp0;
 pid_t main_pid, sess_pid, pppd_pid;
 
 
-typedef struct {
-    /* unsigned char *pBufAddr; */
-    unsigned char packetBuf[PACKETBUF];
-} sPktBuf, *pPktBuf;
-
 void
 print_hex(unsigned char *buf, int len)
 {
@@ -582,18 +737,13 @@ void pptp_pppox_release(int *poxfd, int *pppfd)
 int
 open_interface(char *if_name, unsigned short type, char *hw_addr)
 {
-    int optval = 1, rv;
+    int rv;
     struct ifreq ifr;
 
-    if ((rv = socket(PF_INET, SOCK_PACKET, htons(type))) < 0) {
-        perror("pppoe: socket");
-        return -1;
-    }
-
-    if (setsockopt(rv, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval)) < 0) {
-        perror("pppoe: setsockopt");
+    /* bound to the interface: it only hears that one, and frames sent on
+       it need no address */
+    if ((rv = pktio_open(if_name, type)) < 0)
         return -1;
-    }
 
     if (hw_addr != NULL) {
         strncpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name));
@@ -607,236 +757,142 @@ open_interface(char *if_name, unsigned short type, char *hw_addr)
             fprintf(error_file, "pppoe: interface %s is not Ethernet!\n", if_name);
             return -1;
         }
-        memcpy(hw_addr, ifr.ifr_hwaddr.sa_data, sizeof(ifr.ifr_hwaddr.sa_data));
+        memcpy(hw_addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
     }
     return rv;
 }
 
-/*  added start Winster Chan 12/02/2005 */
-int
-get_padx_tag(struct pppoe_tag *pTag, int nLen, pPadxTag pTagStruc, const unsigned short tagType)
-{
-    int bExitLoop = 0, nSearchLen = 0, bTagFound = 0;
-    struct pppoe_tag *pNextTag;
-
-    pTagStruc->usPadLen = 0;
-    pTagStruc->nPadLen = 0;
-    pTagStruc->pPadStart = NULL;
-
-    while (!bExitLoop && (nSearchLen < nLen)) {
-        if (htons(pTag->type) == tagType) {
-            pTagStruc->usPadLen = pTag->length;
-            pTagStruc->nPadLen = (int)(htons(pTag->length));
-            pTagStruc->pPadStart = (char *)pTag + TAG_STRUCT_SIZE;
-            bExitLoop = 1;
-            bTagFound = 1;
-        }
-        else {
-            pNextTag = (struct pppoe_tag *)((char *)pTag +
-                (TAG_STRUCT_SIZE + (int)(htons(pTag->length))));
-            nSearchLen += (int)((TAG_STRUCT_SIZE + (int)(htons(pTag->length))));
-            pTag = pNextTag;
-        }
-    }
+/*
+ * -m asks for more than the MTU of the interface, sock on it, leaves room
+ * for: ask for what it does.  Asking for no more than PPPOE_PAYLOAD is
+ * the same as not asking.
+ */
+void payload_fit(int sock)
+{
+    struct ifreq ifr;
 
-    return bTagFound;
+    if (opt_payload == 0)
+        return;
+    strncpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name));
+    if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
+        perror("pppoe: ioctl(SIOCGIFMTU)");
+        opt_payload = 0;
+        return;
+    }
+    if (ifr.ifr_mtu - PPPOE_OVERHEAD < opt_payload) {
+        fprintf(error_file, "pppoe: MTU of %s is %d, asking for a PPP payload of %d\n",
+                if_name, ifr.ifr_mtu, ifr.ifr_mtu - PPPOE_OVERHEAD);
+        opt_payload = ifr.ifr_mtu - PPPOE_OVERHEAD;
+    }
+    if (opt_payload <= PPPOE_PAYLOAD)
+        opt_payload = 0;
 }
-/*  added end Winster Chan 12/02/2005 */
 
-int
-create_padi(struct pppoe_packet *packet, const char *src, const char *name)
+/* RFC 4638: the PPP payload -m asks for, in PADI and PADR */
+void add_max_payload(struct tag_out *o)
 {
-    int size;
+    unsigned short n;
 
-    if (packet == NULL)
-	return 0;
-
-    /* printf("Winster: create_padi\n"); */
-
-    size = sizeof(struct pppoe_packet) + sizeof(struct pppoe_tag);
-    if (name != NULL)
-	size += strlen(name);
+    if (opt_payload == 0)
+        return;
+    n = htons(opt_payload);
+    tag_add(o, TAG_PPP_MAX_PAYLOAD, &n, sizeof(n));
+}
 
+/* the Ethernet and PPPoE headers of a discovery packet with len bytes
+   of TAGs */
+void disc_header(struct pppoe_packet *packet, const char *src, const char *dst,
+		 int code, unsigned short session, int len)
+{
 #ifdef __linux__
-    memcpy(packet->ethhdr.h_dest, MAC_BCAST_ADDR, 6);
+    memcpy(packet->ethhdr.h_dest, dst, 6);
     memcpy(packet->ethhdr.h_source, src, 6);
     packet->ethhdr.h_proto = htons(ETH_P_PPPOE_DISC);
 #else
-    memcpy(packet->ethhdr.ether_dhost, MAC_BCAST_ADDR, 6);
+    memcpy(packet->ethhdr.ether_dhost, dst, 6);
     memcpy(packet->ethhdr.ether_shost, src, 6);
     packet->ethhdr.ether_type = htons(ETH_P_PPPOE_DISC);
 #endif
     packet->ver = 1;
     packet->type = 1;
-    packet->code = CODE_PADI;
-    packet->session = 0;
-    packet->length = htons(size - sizeof(struct pppoe_packet));
-
-    /* fill out a blank service-name tag */
-    (*(struct pppoe_tag *)(packet+1)).type = htons(TAG_SERVICE_NAME);
-    (*(struct pppoe_tag *)(packet+1)).length = name ? htons(strlen(name)) : 0;
-    if (name != NULL)
-	memcpy((char *)(packet + 1) + sizeof(struct pppoe_tag), name,
-	       strlen(name));
-
-    return size;
+    packet->code = code;
+    packet->session = session;
+    packet->length = htons(len);
 }
 
 int
-create_padr(struct pppoe_packet *packet, const char *src, const char *dst,
-	    char *name)
+create_padi(struct pppoe_packet *packet, const char *src, const char *name,
+	    const char *uniq, int uniq_len)
 {
-    int size;
-    /*  added start Winster Chan 11/25/2005 */
-    char *pCookieStart = NULL;
-    int nCookieSize = 0;
-    int nNameSize = 0;
-    unsigned short usCookieSize = 0;
-    sPadxTag sTag;
-    /*  added end Winster Chan 11/25/2005 */
-    /*  add start, Max Ding, 09/22/2008 for @add TAG_RELAY_SESSION_ID */
-    char *pRelaySessionIdStart = NULL;
-    int nRelaySessionIdSize = 0;
-    unsigned short usRelaySessionIdSize = 0;
-    char *pPacketPoint = packet;
-    /*  add end, Max Ding, 09/22/2008 */
+    struct tag_out o;
+    int len;
 
     if (packet == NULL)
 	return 0;
 
-    size = sizeof(struct pppoe_packet) + TAG_STRUCT_SIZE;
-    if (name != NULL) {
-    	size += strlen(name);
-        /*  added start Winster Chan 11/25/2005 */
-        nNameSize = strlen(name);
-        /*  added end Winster Chan 11/25/2005 */
-    }
-
-    /*  added start Winster Chan 12/02/2005 */
-    /* Add length of AC cookie to packet size */
-    if (get_padx_tag((struct pppoe_tag *)pado_tags, pado_tag_size, &sTag, TAG_AC_COOKIE)) {
-        nCookieSize = sTag.nPadLen;
-        usCookieSize = sTag.usPadLen;
-        pCookieStart = sTag.pPadStart;
-        size += (int)(TAG_STRUCT_SIZE + sTag.nPadLen);
-    }
-    /*  added end Winster Chan 12/02/2005 */
-    /*  add start, Max Ding, 09/22/2008 for @add TAG_RELAY_SESSION_ID */
-    if (get_padx_tag((struct pppoe_tag *)pado_tags, pado_tag_size, &sTag, TAG_RELAY_SESSION_ID)) {
-        nRelaySessionIdSize = sTag.nPadLen;
-        usRelaySessionIdSize = sTag.usPadLen;
-        pRelaySessionIdStart = sTag.pPadStart;
-        size += (int)(TAG_STRUCT_SIZE + sTag.nPadLen);
-    }
-    /*  add end, Max Ding, 09/22/2008 */
-
-#ifdef __linux__
-    memcpy(packet->ethhdr.h_dest, dst, 6);
-    memcpy(packet->ethhdr.h_source, src, 6);
-    packet->ethhdr.h_proto = htons(ETH_P_PPPOE_DISC);
-#else
-    memcpy(packet->ethhdr.ether_dhost, dst, 6);
-    memcpy(packet->ethhdr.ether_shost, src, 6);
-    packet->ethhdr.ether_type = htons(ETH_P_PPPOE_DISC);
-#endif
-    packet->ver = 1;
-    packet->type = 1;
-    packet->code = CODE_PADR;
-    packet->session = 0;
-    packet->length = htons(size - sizeof(struct pppoe_packet));
+    /* printf("Winster: create_padi\n"); */
 
-    /* fill out a blank service-name tag */
-    (*(struct pppoe_tag *)(packet+1)).type = htons(TAG_SERVICE_NAME);
-    (*(struct pppoe_tag *)(packet+1)).length = name ? htons(strlen(name)) : 0;
-    if (name != NULL)
-	memcpy((char *)(packet + 1) + TAG_STRUCT_SIZE, name,
-	       strlen(name));
-
-    pPacketPoint = (char *)(packet+1)+TAG_STRUCT_SIZE+nNameSize;/*  added by Max Ding, 09/23/2008 @add TAG_RELAY_SESSION_ID */
-    /*  modified start, wklin, 03/27/2007, winster doesn't count name len */
-    /*  added start Winster Chan 11/25/2005 */
-    /* fill out the AC cookie tag from PADO */
-    if (nCookieSize > 0) {
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE+
-                               nNameSize)).type = htons(TAG_AC_COOKIE);
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE+
-                               nNameSize)).length = usCookieSize;
-        memcpy((char *)(packet+1)+(2*TAG_STRUCT_SIZE)+nNameSize,
-            (char *)pCookieStart, nCookieSize);
-        pPacketPoint = (char *)(packet+1)+(2*TAG_STRUCT_SIZE)+nNameSize+nCookieSize;/*  added by Max Ding, 09/23/2008 @add TAG_RELAY_SESSION_ID */
-    }
-    /*  added end Winster Chan 11/25/2005 */
-    /*  modified end, wklin, 03/27/2007 */
-    /*  add start, Max Ding, 09/22/2008 for @add TAG_RELAY_SESSION_ID */
-    if (nRelaySessionIdSize > 0) {
-        (*(struct pppoe_tag *)(pPacketPoint)).type = htons(TAG_RELAY_SESSION_ID);
-        (*(struct pppoe_tag *)(pPacketPoint)).length = usRelaySessionIdSize;
-        memcpy((pPacketPoint+TAG_STRUCT_SIZE),
-            (char *)pRelaySessionIdStart, nRelaySessionIdSize);
-        pPacketPoint += TAG_STRUCT_SIZE + nRelaySessionIdSize;
-    }
-    /*  add end, Max Ding, 09/22/2008 */
+    tag_out_init(&o, packet + 1, TAGS_ROOM);
+    /* a blank service-name tag if there is no name */
+    tag_add(&o, TAG_SERVICE_NAME, name, name ? strlen(name) : 0);
+    if (uniq != NULL)
+	tag_add(&o, TAG_HOST_UNIQ, uniq, uniq_len);
+    add_max_payload(&o);
+    if ((len = tag_out_len(&o)) < 0)
+	return 0;
+    disc_header(packet, src, MAC_BCAST_ADDR, CODE_PADI, 0, len);
 
-    memset(((char *)packet) + size, 0, 14);
-    return size;
+    return sizeof(struct pppoe_packet) + len;
 }
 
-/*  added end Winster Chan 12/02/2005 */
+/* the AC-Cookie and Relay-Session-Id of the PADO go back as they came */
 int
-create_padt(struct pppoe_packet *packet, const char *src, const char *dst, unsigned short nSessId)
+create_padr(struct pppoe_packet *packet, const char *src, const char *dst,
+	    char *name, const struct tag_buf *pado,
+	    const char *uniq, int uniq_len)
 {
-    int size;
-    char *pCookieStart = NULL;
-    int nCookieSize = 0;
-    unsigned short usCookieSize = 0;
-    sPadxTag sTag;
+    struct tag_out o;
+    int len;
 
     if (packet == NULL)
 	return 0;
 
-    size = sizeof(struct pppoe_packet) + TAG_STRUCT_SIZE;
+    tag_out_init(&o, packet + 1, TAGS_ROOM);
+    tag_add(&o, TAG_SERVICE_NAME, name, name ? strlen(name) : 0);
+    tag_copy(&o, pado, TAG_AC_COOKIE);
+    tag_copy(&o, pado, TAG_RELAY_SESSION_ID);
+    if (uniq != NULL)
+	tag_add(&o, TAG_HOST_UNIQ, uniq, uniq_len);
+    add_max_payload(&o);
+    if ((len = tag_out_len(&o)) < 0)
+	return 0;
+    disc_header(packet, src, dst, CODE_PADR, 0, len);
 
-    if (get_padx_tag((struct pppoe_tag *)pado_tags, pado_tag_size, &sTag, TAG_AC_COOKIE)) {
-        nCookieSize = sTag.nPadLen;
-        usCookieSize = sTag.usPadLen;
-        pCookieStart = sTag.pPadStart;
-        size += (int)(TAG_STRUCT_SIZE + sTag.nPadLen);
-    }
+    memset((char *)(packet + 1) + len, 0, 14);
+    return sizeof(struct pppoe_packet) + len;
+}
 
-#ifdef __linux__
-    memcpy(packet->ethhdr.h_dest, dst, 6);
-    memcpy(packet->ethhdr.h_source, src, 6);
-    packet->ethhdr.h_proto = htons(ETH_P_PPPOE_DISC);
-#else
-    memcpy(packet->ethhdr.ether_dhost, dst, 6);
-    memcpy(packet->ethhdr.ether_shost, src, 6);
-    packet->ethhdr.ether_type = htons(ETH_P_PPPOE_DISC);
-#endif
-    packet->ver = 1;
-    packet->type = 1;
-    packet->code = CODE_PADT;
-    /*packet->session = session;*/
-    packet->session = nSessId;
-    packet->length = htons(size - sizeof(struct pppoe_packet));
+int
+create_padt(struct pppoe_packet *packet, const char *src, const char *dst, unsigned short nSessId,
+	    const struct tag_buf *pado)
+{
+    struct tag_out o;
+    int len;
 
-    /* fill out a blank generic-error tag */
-    (*(struct pppoe_tag *)(packet+1)).type = htons(TAG_GENERIC_ERROR);
-    (*(struct pppoe_tag *)(packet+1)).length = 0;
+    if (packet == NULL)
+	return 0;
 
-    /* fill out the AC cookie tag from PADO */
-    if (nCookieSize > 0) {
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE)).type
-            = htons(TAG_AC_COOKIE);
-        (*(struct pppoe_tag *)((char *)(packet+1)+TAG_STRUCT_SIZE)).length
-            = usCookieSize;
-        memcpy((char *)(packet+1)+(2*TAG_STRUCT_SIZE),
-            (char *)pCookieStart, nCookieSize);
-    }
+    tag_out_init(&o, packet + 1, TAGS_ROOM);
+    /* a blank generic-error tag, and the AC cookie tag from PADO */
+    tag_add(&o, TAG_GENERIC_ERROR, NULL, 0);
+    tag_copy(&o, pado, TAG_AC_COOKIE);
+    if ((len = tag_out_len(&o)) < 0)
+	return 0;
+    disc_header(packet, src, dst, CODE_PADT, nSessId, len);
 
-    memset(((char *)packet) + size, 0, 14);
-    return size;
+    memset((char *)(packet + 1) + len, 0, 14);
+    return sizeof(struct pppoe_packet) + len;
 }
-/*  added end Winster Chan 12/02/2005 */
 
 /*  added start pling 09/09/2009 */
 int create_lcp_terminate_request
@@ -886,227 +942,137 @@ int create_lcp_terminate_request
 }
 /*  added end pling 09/09/2009 */
 
-unsigned short fcstab[256] = {
-    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
+/*
+ * A write to pppd through the uring is done.  Only one is ever in flight,
+ * so the stream stays in order; a short one is continued right away.
+ */
+void uring_write_done(struct uring_cqe *c)
+{
+    if (c->res < 0) {
+        errno = -c->res;
+        perror("pppoe: write (uring)");
+        ur_wr_len = 0;
+        return;
+    }
+    ur_wr += c->res;
+    ur_wr_len -= c->res;
+    if (ur_wr_len > 0 &&
+        uring_write_fixed(&ur, ur_sess->out, ur_wr, ur_wr_len, URING_INDEX(c->tag),
+                          c->tag) < 0) {
+        perror("pppoe: write (uring)");
+        ur_wr_len = 0;
+    }
+}
 
-#define PPPINITFCS16    0xffff  /* Initial FCS value */
-#define PPPGOODFCS16    0xf0b8  /* Good final FCS value */
 /*
- * Calculate a new fcs given the current fcs and the new data.
+ * Queue ppp_buf[ur_cur] for pppd and fill the other one meanwhile, which
+ * must be written out by now.  The write goes with the next submit.
  */
-unsigned short pppfcs16(register unsigned short fcs,
-			register unsigned char * cp,
-			register int len)
+void uring_write_ppp(struct sess_ctx *s, int len)
 {
-/*    assert(sizeof (unsigned short) == 2);
-    assert(((unsigned short) -1) > 0); */
+    struct uring_cqe c;
 
-    while (len--)
-	fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
+    while (ur_wr_len > 0) {
+        if (uring_wait(&ur, UR_PPPD_TX, &c) < 0) {
+            perror("pppoe: io_uring_enter (uring_write_ppp)");
+            ur_wr_len = 0;
+            break;
+        }
+        uring_write_done(&c);
+    }
+    ur_wr = s->ppp_buf[ur_cur];
+    ur_wr_len = len;
+    if (uring_write_fixed(&ur, s->out, ur_wr, len, ur_cur,
+                          URING_TAG(UR_PPPD_TX, ur_cur)) < 0) {
+        perror("pppoe: write (uring)");
+        ur_wr_len = 0;
+    }
+    ur_cur ^= 1;
+}
 
-    return (fcs);
+/* hand everything encode_ppp() collected for s to its pppd */
+void flush_ppp(struct sess_ctx *s)
+{
+    if (opt_uring) {
+        if (s->ppp_out_len > 0)
+            uring_write_ppp(s, s->ppp_out_len);
+        s->ppp_out = s->ppp_buf[ur_cur];
+        s->ppp_out_len = 0;
+        return;
+    }
+    if (s->ppp_out_len > 0 && pktio_pipe_write(&s->pipe, s->ppp_out_len) < 0)
+        perror("pppoe: write (flush_ppp)");
+    s->ppp_out = pktio_pipe_buf(&s->pipe);
+    s->ppp_out_len = 0;
 }
 
-#define FRAME_ESC 0x7d
-#define FRAME_FLAG 0x7e
-#define FRAME_ADDR 0xff
-#define FRAME_CTL 0x03
-#define FRAME_ENC 0x20
+/* the same for every session a batch from sess_sock had frames for */
+void flush_dirty(void)
+{
+    struct sess_ctx *s;
 
-#define ADD_OUT(c) { *out++ = (c); n++; if (opt_verbose) fprintf(log_file, "%x ", (c)); }
+    while ((s = sess_dirty) != NULL) {
+        sess_dirty = s->next_dirty;
+        s->dirty = 0;
+        flush_ppp(s);
+    }
+}
 
-void encode_ppp(int fd, unsigned char *buf, int len)
+/*
+ * Frame a packet for the pppd of s.  Frames are collected in s->ppp_out and
+ * go out in one write when flush_ppp() is called, or when the buffer is full.
+ */
+void encode_ppp(struct sess_ctx *s, unsigned char *buf, int len)
 {
-    static int first = 0;
-    unsigned char out_buf[PACKETBUF];
-    unsigned char *out = out_buf;
-    unsigned char header[2], tail[2];
-    int i,n;
-    unsigned short fcs;
+    int n;
 #ifndef MULTIPLE_PPPOE
     time_t tm;
 #endif
-    header[0] = FRAME_ADDR;
-    header[1] = FRAME_CTL;
-    fcs = pppfcs16(PPPINITFCS16, header, 2);
-    fcs = pppfcs16(fcs, buf, len) ^ 0xffff;
-    tail[0] = fcs & 0x00ff;
-    tail[1] = (fcs >> 8) & 0x00ff;
+
+    if (PPPDBUF - s->ppp_out_len < HDLC_ENCODED_MAX(len))
+        flush_ppp(s);
+    hdlc_tx_snoop(&s->tx, buf, len, 1);
+    if (opt_sync) {
+        /* one frame per write, as it came; the address/control field is
+           optional in sync mode */
+        if (write(s->out, buf, len) < 0)
+            perror("pppoe: write (encode_ppp)");
+        return;
+    }
+    n = hdlc_encode(&s->tx, s->ppp_out + s->ppp_out_len, buf, len);
 #ifndef MULTIPLE_PPPOE
     if (opt_verbose)
     {
 	time(&tm);
 	fprintf(log_file, "%sWriting to pppd: \n", ctime(&tm));
+	print_hex(s->ppp_out + s->ppp_out_len, n);
+	fputc('\n', log_file);
     }
 #endif
-    n = 0;
-    if (!first) {
-	ADD_OUT(FRAME_FLAG);
-	first = 1;
-    }
-    ADD_OUT(FRAME_ADDR); /* the header - which is constant */
-    ADD_OUT(FRAME_ESC);
-    ADD_OUT(FRAME_CTL ^ FRAME_ENC);
-
-    for (i = 0; i < len; i++)
-	if (buf[i] == FRAME_FLAG || buf[i] == FRAME_ESC || buf[i] < 0x20)
-	{
-	    ADD_OUT(FRAME_ESC);
-	    ADD_OUT(buf[i] ^ FRAME_ENC);
-	}
-	else
-	    ADD_OUT(buf[i]);
-
-    for (i = 0; i < 2; i++) {
-	if (tail[i] == FRAME_FLAG || tail[i] == FRAME_ESC || tail[i] < 0x20) {
-	    ADD_OUT(FRAME_ESC);
-	    ADD_OUT(tail[i] ^ FRAME_ENC);
-	} else
-	    ADD_OUT(tail[i]);
+    s->ppp_out_len += n;
+    if (!s->dirty) {
+        s->dirty = 1;
+        s->next_dirty = sess_dirty;
+        sess_dirty = s;
     }
-    ADD_OUT(FRAME_FLAG);
-
-    write(fd, out_buf, n);
-
-#ifndef MULTIPLE_PPPOE
-    if (opt_verbose)
-	fprintf(log_file, "\n");
-#endif
 }
 
+
+/*
+ * Fill in the Ethernet and PPPoE headers for a PPP frame of 'len' bytes
+ * which the de-framer has already left at (packet + 1).
+ */
 int
 create_sess(struct pppoe_packet *packet, const char *src, const char *dst,
-	    unsigned char *buf, int bufsize, int sess, int *bufRemain)
+	    int len, int sess)
 {
     int size;
-    int i, o = 0;
-    int nBufLen = 0;
-    int nTotalLen = 0, nAllLen = 0;
-    int nTemp = 0;
-    unsigned short usTotalLen = 0x0;
-    unsigned char bufLen[2];
-
-    /* Clear the length of remain buffer */
-    *bufRemain = 0;
-
-    if (opt_fwd || !((buf[0] == FRAME_FLAG) || (buf[0] == FRAME_ADDR)))
-    {
-    	if (opt_fwd_search) /* search for a valid packet */
-    	{
-    	    while (*buf++ != FRAME_FLAG && bufsize != 0)
-    		bufsize--;
-            if (bufsize == 0) {
-                fprintf(error_file, "create_sess: bufsize == 0\n");
-                return 0;
-            }
-    	}
-    	else
-    	{
-    	    /* fprintf(error_file, "create_sess: invalid data\n"); */ /*  wklin
-                                                                         removed,
-                                                                         07/26/2007
-                                                                         */
-    	    return 0;
-    	}
-    }
-
-    bufLen[0] = 0x0;
-    bufLen[1] = 0x0;
-    if (bufsize <= 4) {
-        *bufRemain = bufsize;
-        return 0;
-    }
-    else {
-        nTemp = (buf[0] == FRAME_FLAG) ? 4 : 3;
-        for (i = nTemp; i < bufsize; i++) {
-            if (buf[i] == FRAME_ESC) {
-                if ((o == 4) || (o == 5))
-                    bufLen[o-4] = buf[++i] ^ FRAME_ENC;
-                else
-                    ++i;
-            }
-            else {
-                if ((o == 4) || (o == 5))
-                    bufLen[o-4] = buf[i];
-            }
-            o++;
-
-            /* Get the total length from IP packet header */
-            if (o == 6) {
-                usTotalLen = ntohs(*(unsigned short *)bufLen);
-                nTotalLen = (int)usTotalLen;
-                nAllLen = nTotalLen + 5;
-            }
-
-            /* Get the total buffer length of packet */
-            if ((o >= 6) && (o == nAllLen)) {
-                nBufLen = i + 1;
-                break;
-            }
-        }
-
-        if ((o < nAllLen) || (o < 6)) {
-            *bufRemain = bufsize;
-            return 0;
-        }
-        o = 0;
-    }
-
-    /* for (i = (buf[0] == FRAME_FLAG ? 4 : 3); i < bufsize; i++) { */
-    for (i = nTemp; i < bufsize; i++) {
-        if (buf[i] == FRAME_ESC) {
-            buf[o++] = buf[++i] ^ FRAME_ENC;
-        }
-        else {
-            buf[o++] = buf[i];
-        }
-
-        if (o == nAllLen)
-            break;
-    }   /* End for() */
-
-    /* Compute the length of remain buffer */
-    *bufRemain = bufsize - nBufLen;
-
-    bufsize = nTotalLen + 2;
 
     if (packet == NULL) {
         return 0;
     }
 
-    size = sizeof(struct pppoe_packet) + bufsize;
+    size = sizeof(struct pppoe_packet) + len;
 
 #ifdef __linux__
     memcpy(packet->ethhdr.h_dest, dst, 6);
@@ -1127,15 +1093,12 @@ create_sess(struct pppoe_packet *packet, const char *src, const char *dst,
 }
 
 int
-send_packet(int sock, struct pppoe_packet *packet, int len, const char *ifn)
+send_packet(int sock, struct pppoe_packet *packet, int len)
 {
-    struct sockaddr addr;
     int c;
 #ifndef MULTIPLE_PPPOE
     time_t tm;
 #endif
-    memset(&addr, 0, sizeof(addr));
-    strcpy(addr.sa_data, ifn);
 
 #ifndef MULTIPLE_PPPOE
     if (opt_verbose == 1)
@@ -1147,225 +1110,530 @@ send_packet(int sock, struct pppoe_packet *packet, int len, const char *ifn)
     }
 #endif
 
-    if ((c = sendto(sock, packet, len, 0, &addr, sizeof(addr))) < 0) {
-	/* fprintf(error_file, "send_packet c[%d] = sendto(len = %d)\n", c, len); */
-	perror("pppoe: sendto (send_packet)");
+    if ((c = send(sock, packet, len, 0)) < 0) {
+	/* fprintf(error_file, "send_packet c[%d] = send(len = %d)\n", c, len); */
+	perror("pppoe: send (send_packet)");
     }
 
     return c;
 }
-#ifdef MULTIPLE_PPPOE
-int
-read_packet_nowait(int sock, struct pppoe_packet *packet, int *len)
+/*
+ * Contexts for the sessions asked for, each on cache lines of its own:
+ * the first is on stdin/stdout, as pppd starts us, the others on the
+ * descriptors of -c or, with MULTIPLE_PPPOE, the ppp units of -P.
+ */
+void sess_init(void)
 {
-    socklen_t fromlen = PACKETBUF;
-
-    if (recvfrom(sock, packet, PACKETBUF, 0,
-             NULL /*(struct sockaddr *)&from*/, &fromlen) < 0) {
-        perror("pppoe: recv (read_packet_nowait)");
-        return -1;
-    }
+    struct sess_ctx *s;
+    unsigned char *mem;
+    int i;
 
-    return sock;
+    mem = malloc(nsess * sizeof(*s) + SESS_LINE - 1);
+    assert(mem != NULL);
+    sess_tab = (struct sess_ctx *)(((unsigned long)mem + SESS_LINE - 1) &
+                                   ~(unsigned long)(SESS_LINE - 1));
+    memset(sess_tab, 0, nsess * sizeof(*s));
+    for (i = 0; i < nsess; i++) {
+        s = &sess_tab[i];
+        s->in = sess_opts[i].in;
+        s->out = sess_opts[i].out;
+        s->unit = sess_opts[i].unit;
+        s->poxfd = s->pppfd = -1;
+        s->pppd_ev.fd = -1;
+        s->uniq = htons(i + 1);
+        if (s->unit == 0)
+            strcpy(s->file, PPP_PPPOE_SESSION);
+        else
+            sprintf(s->file, PPP_PPPOEN_SESSION, s->unit + 1);
+    }
+    nsess_live = nsess;
 }
 
-int
-read_packet(int sock, struct pppoe_packet *packet, int *len)
+/* the session of a frame from sess_sock, NULL if it is none of ours */
+struct sess_ctx *sess_find(unsigned short id, const char *ac)
 {
-    socklen_t fromlen = PACKETBUF;
-    fd_set fdset;
-    struct timeval tma;
-
-    FD_ZERO(&fdset);
-    FD_SET(sock, &fdset);
-    tma.tv_usec = 0; 
-    tma.tv_sec = 3; /* wait for 3 seconds at most */
-    while(1) {
-        if (select(sock + 1, &fdset, (fd_set *) NULL, (fd_set *) NULL,
-		    &tma) <= 0) {
-            return -1; /* timeout or error */
-        } else if (FD_ISSET(sock, &fdset)) {
-            if (recvfrom(sock, packet, PACKETBUF, 0,
-                  NULL /*(struct sockaddr *)&from*/, &fromlen) < 0) {
-            	perror("pppoe: recv (read_packet)");
-                return -1;
-            } else if (memcmp(packet->ethhdr.h_dest,src_addr,sizeof(src_addr))!=0){
-		/* fprintf(stderr, "pppoe: received a packet not for me.\n");*/
-		continue;
-	    }
-        }
-        return sock;
-    }
+    struct sess_ctx *s;
+    int i;
+
+    if ((i = sess_index[id]) == 0)
+        return NULL;
+    for (s = &sess_tab[i - 1]; s != NULL; s = s->next_id)
+        if (memcmp(s->ac, ac, ETH_ALEN) == 0)
+            return s;
+    return NULL;
 }
-#endif
-#ifndef MULTIPLE_PPPOE
-/*  wklin added start, 08/10/2007 */
-int
-read_packet2(int sock, struct pppoe_packet *packet, int *len)
+
+void sess_link(struct sess_ctx *s)
 {
-#if defined(__GNU_LIBRARY__) && __GNU_LIBRARY__ < 6
-    int fromlen = PACKETBUF;
-#else
-    socklen_t fromlen = PACKETBUF;
-#endif
-    time_t tm;
+    int i = sess_index[s->id];
 
-    if (recvfrom(sock, packet, PACKETBUF, 0,
-                 NULL /*(struct sockaddr *)&from*/, &fromlen) < 0) {
-        perror("pppoe: recv (read_packet2)");
-        return -1;
-    }
+    s->next_id = i ? &sess_tab[i - 1] : NULL;
+    sess_index[s->id] = s - sess_tab + 1;
+}
 
-    if (opt_verbose)
-    {
-        time(&tm);
-        fprintf(log_file, "Received packet at %s", ctime(&tm));
-        print_packet(packet);
-        fputc('\n', log_file);
-    }
+void sess_unlink(struct sess_ctx *s)
+{
+    struct sess_ctx **p;
+    int i = sess_index[s->id];
 
-     return sock;
+    if (i == 0)
+        return;
+    if (&sess_tab[i - 1] == s) {
+        sess_index[s->id] = s->next_id ? s->next_id - sess_tab + 1 : 0;
+        return;
+    }
+    for (p = &sess_tab[i - 1].next_id; *p != NULL; p = &(*p)->next_id)
+        if (*p == s) {
+            *p = s->next_id;
+            break;
+        }
 }
-/*  wklin added end, 08/10/2007 */
 
-int
-read_packet(int sock, struct pppoe_packet *packet, int *len)
+/*
+ * With -q, what a PADR to the AC of s needs, kept next to its state file
+ * for the next of us: the AC, the Service-Name asked for, and the TAGs of
+ * its PADO, AC-Cookie and Relay-Session-Id among them, the last two in
+ * hex.  Unlike the state file, it stays when the session ends.
+ */
+void sess_save_ac(struct sess_ctx *s)
 {
-/*    struct sockaddr_in from; */
-#if defined(__GNU_LIBRARY__) && __GNU_LIBRARY__ < 6
-    int fromlen = PACKETBUF;
-#else
-    socklen_t fromlen = PACKETBUF;
-#endif
-    time_t tm;
+    FILE *fp;
+    char path[48];
+    const char *p;
+    int i;
 
-    time(&tm);
+    sprintf(path, "%s.ac", s->file);
+    if (!(fp = fopen(path, "w"))) {
+        perror(path);
+        return;
+    }
+    fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x ",
+        (unsigned char)(s->ac[0]), (unsigned char)(s->ac[1]),
+        (unsigned char)(s->ac[2]), (unsigned char)(s->ac[3]),
+        (unsigned char)(s->ac[4]), (unsigned char)(s->ac[5]));
+    if (service_name == NULL || *service_name == 0)
+        fputc('-', fp);
+    for (p = service_name; p != NULL && *p; p++)
+        fprintf(fp, "%02x", (unsigned char)*p);
+    fputc(' ', fp);
+    if (s->pado_tags.len == 0)
+        fputc('-', fp);
+    for (i = 0; i < s->pado_tags.len; i++)
+        fprintf(fp, "%02x", s->pado_tags.buf[i]);
+    fputc('\n', fp);
+    fclose(fp);
+}
 
-    while(1) {
-	/* wklin modified start, 01/10/2007 */
-        fd_set fdset;
-        struct timeval tm;
-	
-	FD_ZERO(&fdset);
-	FD_SET(sock, &fdset);
-    	tm.tv_usec = 0; 
-	tm.tv_sec = 3; /* wait for 3 seconds */
-	if (select(sock + 1, &fdset, (fd_set *) NULL, (fd_set *) NULL, &tm) <= 0) {
-            return -1; /* timeout or error */
-	} else if (FD_ISSET(sock, &fdset)) {
-	    if (recvfrom(sock, packet, PACKETBUF, 0,
-		 NULL /*(struct sockaddr *)&from*/, &fromlen) < 0) {
-	        perror("pppoe: recv (read_packet)");
-	        return -1;
-	    }
-	}
-	/* wklin modified end, 01/10/2007 */
-	if (opt_verbose)
-	{
-	    fprintf(log_file, "Received packet at %s", ctime(&tm));
-	    print_packet(packet);
-	    fputc('\n', log_file);
-	}
+/* note the AC and session in the state file, or clear them */
+void sess_save(struct sess_ctx *s, int clear)
+{
+    FILE *fp;
 
-	return sock;
+    if (!(fp = fopen(s->file, "w"))) {
+        perror(s->file);
+        return;
     }
+    if (clear)
+        /* Clear the PPPoE server MAC address and Session ID */
+        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0);
+    else
+        /* Save the PPPoE server MAC address and Session ID, and the PPP
+           payload for pppd's MTU and MRU */
+        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d %d\n",
+            (unsigned char)(s->ac[0]), (unsigned char)(s->ac[1]),
+            (unsigned char)(s->ac[2]), (unsigned char)(s->ac[3]),
+            (unsigned char)(s->ac[4]), (unsigned char)(s->ac[5]),
+            (int)htons(s->id), s->payload);
+    fclose(fp);
+    if (!clear && opt_quick)
+        sess_save_ac(s);
 }
-#endif
 
-void sigchild(int src) {
-    clean_child = 1;
+/* have pptp_pppox_connect() and friends work on s */
+void sess_pppox(struct sess_ctx *s)
+{
+    memcpy(dstMac, s->ac, ETH_ALEN);
+    sessId = s->id;
+#ifdef MULTIPLE_PPPOE
+    ppp_ifunit = s->unit;
+#endif
 }
 
-void cleanup_and_exit(int status) {
+/* undo sess_start()'s pptp_pppox_connect() */
+void sess_release(struct sess_ctx *s)
+{
 #ifdef MULTIPLE_PPPOE
-    if (pppfd > 0)
-        close(pppfd); 
-    if (poxfd > 0)
-        close(poxfd);
-    if (disc_sock > 0)
-        close(disc_sock);
-    if (sess_sock > 0)
-        close(sess_sock);
-    close(1);
-
-    exit(status);
+    if (s->pppfd > 0)
+        close(s->pppfd);
+    if (s->poxfd > 0)
+        close(s->poxfd);
 #else
     /*  modified start, Winster Chan, 06/26/2006 */
-#ifdef NEW_WANDETECT
-    if (!bWanDetect) /*  added by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
-#endif
-    {
-        pptp_pppox_release(&poxfd, &pppfd);
-        close(pppfd); pppfd = -1;
-        close(poxfd); poxfd = -1;
-    }
+    sess_pppox(s);
+    pptp_pppox_release(&s->poxfd, &s->pppfd);
+    close(s->pppfd);
+    close(s->poxfd);
     /*  modified end, Winster Chan, 06/26/2006 */
+#endif
+    s->pppfd = s->poxfd = -1;
+}
 
+/*
+ * Leave it to the kernel to drop what the code below would throw away:
+ * frames not addressed to us, discovery codes we never wait for, and
+ * while no session is being discovered, anything else than a PADT.  With
+ * a single session, the AC and session ID narrow it down further.  Called
+ * when the discovery socket is opened and whenever a session comes or goes.
+ */
+void set_filters(void)
+{
+#ifndef USE_BPF
+    static const unsigned char disc_codes[] = { CODE_PADO, CODE_PADS, CODE_PADT };
+    static const unsigned char padt_code[] = { CODE_PADT };
+    struct pktio_match m;
+    struct sess_ctx *one = NULL;
+    int i, discovering = 0;
+
+    for (i = 0; i < nsess; i++)
+        if (sess_tab[i].state == DISC_PADI_SENT ||
+            sess_tab[i].state == DISC_PADR_SENT || sess_tab[i].rival)
+            discovering = 1;
+    if (nsess == 1 && sess_tab[0].state == DISC_SESSION)
+        one = &sess_tab[0];
+
+    memset(&m, 0, sizeof(m));
+    m.type = ETH_P_PPPOE_DISC;
+    m.dst = (unsigned char *)src_addr;
+    m.session = -1;
+    m.codes = disc_codes;
+    m.ncodes = sizeof(disc_codes);
+    if (!discovering) {
+        if (one)
+            m.src = (unsigned char *)one->ac;
+        m.codes = padt_code;
+        m.ncodes = sizeof(padt_code);
+    }
+    pktio_filter(disc_sock, &m);
+
+    if (sess_sock > 0) {
+        m.type = ETH_P_PPPOE_SESS;
+        m.src = one ? (unsigned char *)one->ac : NULL;
+        m.session = one ? ntohs(one->id) : -1;
+        m.codes = NULL;
+        m.ncodes = 0;
+        pktio_filter(sess_sock, &m);
+    }
+#endif
+}
+
+/*
+ * What we know of the ACs that gave us sessions, or failed to, kept in
+ * AC_RECORD_FILE so it outlives us and, with MULTIPLE_PPPOE, is shared by
+ * the process of every unit.  Read when PADOs start coming in, rather
+ * than for each of them, and written when something happens.  Counts
+ * are halved now and then, so what an AC did lately weighs more.
+ */
+#define AC_RECORD_FILE "/tmp/ppp/PPPoE_server_record"
+#define AC_MAX 16
+#define AC_HISTORY 32
+/* ms within which a session the AC ends counts against it */
+#define AC_SHORT_LIVED 60000
+
+struct ac_rec {
+    char            mac[ETH_ALEN];
+    long            used;       /* uptime, in seconds, of its last PADS */
+    int             pads;       /* sessions it gave */
+    int             lost;       /* PADRs it refused or left unanswered, and
+                                   sessions it cut short */
+} ac_tab[AC_MAX];
+int nac = 0;
+
+void ac_load(void)
+{
+    FILE *fp;
+    char line[80];
+    unsigned int m[ETH_ALEN];
+    struct ac_rec *r;
+    int i;
+
+    nac = 0;
+    if ((fp = fopen(AC_RECORD_FILE, "r")) == NULL)
+        return;
+    while (nac < AC_MAX && fgets(line, sizeof(line), fp)) {
+        r = &ac_tab[nac];
+        r->pads = r->lost = 0;
+        /* older versions only wrote down the uptime */
+        if (sscanf(line, "%02x:%02x:%02x:%02x:%02x:%02x %ld %d %d",
+                   &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+                   &r->used, &r->pads, &r->lost) < 7)
+            continue;
+        for (i = 0; i < ETH_ALEN; i++)
+            r->mac[i] = (char)m[i];
+        nac++;
+    }
+    fclose(fp);
+}
+
+/* the record of the AC at mac; with add, a new one, in place of the
+   least recently used when there is no room */
+struct ac_rec *ac_find(const char *mac, int add)
+{
+    struct ac_rec *r, *old = NULL;
+    int i;
+
+    for (i = 0; i < nac; i++) {
+        r = &ac_tab[i];
+        if (memcmp(r->mac, mac, ETH_ALEN) == 0)
+            return r;
+        if (old == NULL || r->used < old->used)
+            old = r;
+    }
+    if (!add)
+        return NULL;
+    r = nac < AC_MAX ? &ac_tab[nac++] : old;
+    memset(r, 0, sizeof(*r));
+    memcpy(r->mac, mac, ETH_ALEN);
+    return r;
+}
+
+/* count a session from the AC at mac, or with lost, a failure */
+void ac_note(const char *mac, int lost)
+{
+    FILE *fp;
+    struct ac_rec *r;
+    struct sysinfo info;
+    int i;
+
+    ac_load(); /* what other units wrote meanwhile */
+    r = ac_find(mac, 1);
+    if (lost)
+        r->lost++;
+    else {
+        r->pads++;
+        sysinfo(&info);
+        r->used = info.uptime;
+    }
+    if (r->pads + r->lost > AC_HISTORY) {
+        r->pads /= 2;
+        r->lost /= 2;
+    }
+    if ((fp = fopen(AC_RECORD_FILE, "w")) == NULL)
+        return;
+    for (i = 0; i < nac; i++) {
+        r = &ac_tab[i];
+        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %010ld %d %d\n",
+                (unsigned char)r->mac[0], (unsigned char)r->mac[1],
+                (unsigned char)r->mac[2], (unsigned char)r->mac[3],
+                (unsigned char)r->mac[4], (unsigned char)r->mac[5],
+                r->used, r->pads, r->lost);
+    }
+    fclose(fp);
+}
+
+/* frames of s no longer go anywhere */
+void sess_down(struct sess_ctx *s)
+{
+    sess_unlink(s);
+    if (s->poxfd >= 0) /* none with -R */
+        sess_release(s);
+}
+
+/*
+ * The AC ended the session of s.  As the only session, pppd started us
+ * for it, so we leave; otherwise its pppd stays on, and s looks for a
+ * new session after a while for pppd to renegotiate on.
+ */
+void sess_end(struct sess_ctx *s)
+{
+    if (s->state != DISC_SESSION)
+        return;
+    if (ev_now() - s->since < AC_SHORT_LIVED)
+        ac_note(s->ac, 1);
+    if (nsess == 1) {
+        sess_over = 1; /* cleanup and exit */
+        return;
+    }
+    sess_down(s);
+    s->state = DISC_TERMINATING;
+    ev_tmo_set(&s->timer, DISC_HOLDOFF);
+    set_filters();
+}
+
+/* a PADT ends the session it names, if that is one of ours */
+int sess_padt(struct pppoe_packet *packet)
+{
+    struct sess_ctx *s;
+    time_t tm;
+
+    if (packet->code != CODE_PADT)
+        return 0;
+#ifdef __linux__
+    s = sess_find(packet->session, (char *)packet->ethhdr.h_source);
+#else
+    s = sess_find(packet->session, (char *)packet->ethhdr.ether_shost);
+#endif
+    if (s == NULL)
+        return 0;
+    time(&tm);
+#ifdef MULTIPLE_PPPOE
+    fprintf(stderr, "PPPOE%d: PADT received (%d) %s\n", s->unit, ntohs(s->id), ctime(&tm));
+#else
+    fprintf(stderr, "PPPOE: PADT received (%d/%d), %s\n",
+        ntohs(packet->session), ntohs(s->id), ctime(&tm));
+#endif
+    sess_end(s);
+    return 1;
+}
+
+/* one discovery packet if there is one queued, without waiting; its
+   size goes to *len */
+int
+read_packet_nowait(int sock, struct pppoe_packet *packet, int *len)
+{
+#if defined(__GNU_LIBRARY__) && __GNU_LIBRARY__ < 6
+    int fromlen = PACKETBUF;
+#else
+    socklen_t fromlen = PACKETBUF;
+#endif
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+#endif
+
+    if ((*len = recvfrom(sock, packet, PACKETBUF, MSG_DONTWAIT,
+                 NULL /*(struct sockaddr *)&from*/, &fromlen)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            perror("pppoe: recv (read_packet_nowait)");
+        return -1;
+    }
+#ifndef MULTIPLE_PPPOE
+    if (opt_verbose)
+    {
+        time(&tm);
+        fprintf(log_file, "Received packet at %s", ctime(&tm));
+        print_packet(packet);
+        fputc('\n', log_file);
+    }
+#endif
+
+    return sock;
+}
+
+void sigchild(int src) {
+    clean_child = 1;
+}
+
+/*
+ * Append the counters kept by this process to PPP_PPPOE_STATS; the file is
+ * removed when a session starts, so it describes the current one only.
+ */
+void save_stats(void)
+{
+    FILE *fp;
+    unsigned long avg;
+    struct hdlc_rx rx;
+    struct pktio_pipe pipe;
+    int i;
+
+    if (sess_tx.batches == 0 && sess_rx.batches == 0)
+        return;
+    if (!(fp = fopen(PPP_PPPOE_STATS, "a")))
+        return;
+    /* all sessions together */
+    memset(&rx, 0, sizeof(rx));
+    memset(&pipe, 0, sizeof(pipe));
+    for (i = 0; i < nsess; i++) {
+        rx.frames += sess_tab[i].rx.frames;
+        rx.bad_fcs += sess_tab[i].rx.bad_fcs;
+        rx.runts += sess_tab[i].rx.runts;
+        rx.giants += sess_tab[i].rx.giants;
+        rx.aborts += sess_tab[i].rx.aborts;
+        pipe.spliced += sess_tab[i].pipe.spliced;
+        pipe.copied += sess_tab[i].pipe.copied;
+    }
+    /* average batch sizes, in hundredths */
+    if (sess_tx.batches) {
+        avg = sess_tx.frames * 100 / sess_tx.batches;
+        fprintf(fp, "uplink: %lu frames %lu sends %lu.%02lu per send %lu errors\n",
+                sess_tx.frames, sess_tx.batches, avg / 100, avg % 100,
+                sess_tx.errors);
+        fprintf(fp, "hdlc: %lu frames %lu bad fcs %lu runts %lu giants %lu aborts\n",
+                rx.frames, rx.bad_fcs, rx.runts, rx.giants, rx.aborts);
+    }
+    if (sess_rx.batches) {
+        avg = sess_rx.frames * 100 / sess_rx.batches;
+        fprintf(fp, "downlink: %lu frames %lu receives %lu.%02lu per receive\n",
+                sess_rx.frames, sess_rx.batches, avg / 100, avg % 100);
+        if (pipe.spliced)
+            fprintf(fp, "pipe: %lu bytes spliced %lu copied\n",
+                    pipe.spliced, pipe.copied);
+    }
+    if (opt_uring)
+        fprintf(fp, "uring: %lu requests %lu system calls\n",
+                ur.submitted, ur.enters);
+    fclose(fp);
+}
+
+void cleanup_and_exit(int status) {
+    int i;
+
+    save_stats();
+    for (i = 0; i < nsess; i++) {
+#ifdef NEW_WANDETECT
+        if (bWanDetect) /*  added by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
+            break;
+#endif
+        if (sess_tab[i].poxfd >= 0)
+            sess_release(&sess_tab[i]);
+    }
+#ifdef MULTIPLE_PPPOE
+    if (disc_sock > 0)
+        close(disc_sock);
+    if (sess_sock > 0)
+        close(sess_sock);
+#else
     close(disc_sock);
 #ifdef NEW_WANDETECT
     if (!bWanDetect) /*  added by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
 #endif
         close(sess_sock);
+#endif
     close(1);
 
     exit(status);
-#endif
 }
 
-void sigint(int src)
+/* tell the AC of s that its session is over */
+int sess_send_padt(struct sess_ctx *s, struct pppoe_packet *packet)
 {
-#ifdef MULTIPLE_PPPOE
-    struct pppoe_packet *packet = NULL;
     int pkt_size;
-    FILE *fp;
-
-    /*  modified start pling 10/08/2009 */
-    /* Don't reference pppd_listen any more as this var is not used. */
-    /* if (disc_sock >= 0 && (pppd_listen >= 0)) { */
-    if (disc_sock > 0) {
-    /*  modified end pling 10/08/2009 */
-        /* allocate packet once */
-        packet = malloc(PACKETBUF);
-        assert(packet != NULL);
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+#endif
 
-        /* send PADT */
-        if ((pkt_size = create_padt(packet, src_addr, dst_addr, session)) == 0) {
-              fprintf(stderr, "pppoe: unable to create PADT packet\n");
-              if (packet != NULL) 
-                  free(packet);
-              exit(1);
-        }
-        if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
-            fprintf(stderr, "pppoe: unable to send PADT packet\n");
-            if (packet != NULL) 
-                free(packet);
-            exit(1);
-        }  else {
-            ; /* fprintf(stderr, "PPPOE: PADT sent*\n"); */
-        }
+    /* send PADT */
+    if ((pkt_size = create_padt(packet, src_addr, s->ac, s->id,
+                                &s->pado_tags)) == 0) {
+        fprintf(stderr, "pppoe: unable to create PADT packet\n");
+        return -1;
     }
-
-    if (ppp_ifunit == 0)
-        fp = fopen(PPP_PPPOE_SESSION, "w+");
-    else
-        fp = fopen(PPP_PPPOE2_SESSION, "w+");
-
-    if (fp) {
-        /* Clear the PPPoE server MAC address and Session ID */
-        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0);
-        fclose(fp);
+    if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
+        fprintf(stderr, "pppoe: unable to send PADT packet\n");
+        return -1;
     }
+#ifndef MULTIPLE_PPPOE
+    time(&tm);
+    fprintf(stderr, "PPPOE: PADT sent* %s\n",ctime(&tm)); /*  wklin added, 07/26/2007 */
+#endif
+    return 0;
+}
 
-    if (packet != NULL) 
-        free(packet);
-    cleanup_and_exit(1);
-#else
+/* end every session that is up, and leave */
+void sigint(int src)
+{
     /*  added start Winster Chan 12/02/2005 */
     struct pppoe_packet *packet = NULL;
-    int pkt_size;
-    FILE *fp;
-    time_t tm;
+    int i;
 
     /*  modified start pling 10/08/2009 */
     /* Don't reference pppd_listen any more as this var is not used. */
@@ -1376,47 +1644,51 @@ void sigint(int src)
         packet = malloc(PACKETBUF);
         assert(packet != NULL);
 
-        /* send PADT */
-        if ((pkt_size = create_padt(packet, src_addr, dst_addr, session)) == 0) {
-  	        fprintf(stderr, "pppoe: unable to create PADT packet\n");
-            /* exit(1); */
-        }
-        if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
-            fprintf(stderr, "pppoe: unable to send PADT packet\n");
-            /* exit(1); */
-        }  else {
-            time(&tm);
-            fprintf(stderr, "PPPOE: PADT sent* %s\n",ctime(&tm)); /*  wklin added, 07/26/2007 */
-        }
+        for (i = 0; i < nsess; i++)
+            if (sess_tab[i].state == DISC_SESSION)
+                sess_send_padt(&sess_tab[i], packet);
+        free(packet);
     }
     /*  added end Winster Chan 12/02/2005 */
 
     /*  added start Winster Chan 12/05/2005 */
-    if (!(fp = fopen(PPP_PPPOE_SESSION, "w"))) {
-        perror(PPP_PPPOE_SESSION);
-    }
-    else {
-        /* Clear the PPPoE server MAC address and Session ID */
-        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0);
-        fclose(fp);
-    }
-
-    if (packet != NULL) 
-        free(packet);
-
+    for (i = 0; i < nsess; i++)
+        sess_save(&sess_tab[i], 1);
     /*  added end Winster Chan 12/05/2005 */
     cleanup_and_exit(1);
-#endif
+}
+
+/*
+ * The pppd of s is gone.  So is its session then, if it has one, and the
+ * whole process with the last pppd.
+ */
+void sess_close(struct sess_ctx *s)
+{
+    if (nsess_live <= 1)
+        sigint(SIGTERM);
+    if (s->state == DISC_SESSION) {
+        sess_send_padt(s, disc_pkt);
+        sess_save(s, 1);
+        sess_down(s);
+    }
+    s->state = DISC_IDLE;
+    ev_tmo_set(&s->timer, 0);
+    ev_del(&s->pppd_ev);
+    close(s->in);
+    if (s->out != s->in)
+        close(s->out);
+    s->in = s->out = -1;
+    nsess_live--;
+    set_filters();
 }
 
 /* added start James 11/12/2008 @new_internet_detection*/
 #ifdef NEW_WANDETECT
 void sigint2(int src)
 {
+    struct sess_ctx *s = &sess_tab[0];
     struct pppoe_packet *packet = NULL;
     int pkt_size;
-    FILE *fp;
     time_t tm;
 
     /* allocate packet once */
@@ -1428,11 +1700,11 @@ void sigint2(int src)
      *  to make the PPP server terminates our session.
      */
     if ((pkt_size = create_lcp_terminate_request(packet, 
-                        src_addr, dst_addr, session)) == 0) {
+                        src_addr, s->ac, s->id)) == 0) {
         fprintf(stderr, "pppoe: unable to create LCP terminate req packet\n");
     } else {
         sleep(1);
-        if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
+        if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
             fprintf(stderr, "pppoe: unable to send PADT packet\n");
         } else {
             time(&tm);
@@ -1443,11 +1715,12 @@ void sigint2(int src)
     /*  added end pling 09/09/2009 */
 
     /* send PADT */
-    if ((pkt_size = create_padt(packet, src_addr, dst_addr, session)) == 0) {
+    if ((pkt_size = create_padt(packet, src_addr, s->ac, s->id,
+                                &s->pado_tags)) == 0) {
             fprintf(stderr, "pppoe: unable to create PADT packet\n");
         /* exit(1); */
     }
-    if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
+    if (send_packet(disc_sock, packet, pkt_size+14) < 0) {
         fprintf(stderr, "pppoe: unable to send PADT packet\n");
         /* exit(1); */
     }  else {
@@ -1458,15 +1731,7 @@ void sigint2(int src)
     /*  added end Winster Chan 12/02/2005 */
 
     /*  added start Winster Chan 12/05/2005 */
-    if (!(fp = fopen(PPP_PPPOE_SESSION, "w"))) {
-        perror(PPP_PPPOE_SESSION);
-    }
-    else {
-        /* Clear the PPPoE server MAC address and Session ID */
-        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0);
-        fclose(fp);
-    }
+    sess_save(s, 1);
     if (packet != NULL) 
         free(packet);
 
@@ -1477,43 +1742,42 @@ void sigint2(int src)
 #endif
 /*  added end James 11/12/2008 @new_internet_detection */ 
 
-void sess_handler(void) {
-    /* pull packets of sess_sock and feed to pppd */
-    static struct pppoe_packet *packet = NULL;
-    int pkt_size;
+/*
+ * Set up the receive side of sess_sock.  With -M, frames are read from a
+ * ring mapped on it.
+ */
+void sess_rx_setup(void)
+{
+    unsigned char *rxBuf;
+
+    /* allocate the receive slots once */
+    rxBuf = malloc(opt_batch * SESSBUF);
+    assert(rxBuf != NULL);
+    pktio_rx_init(&sess_rx, sess_sock, rxBuf, SESSBUF, opt_batch);
+    if (opt_ring && pktio_rx_ring(&sess_rx) < 0)
+        fprintf(error_file, "pppoe: no receive ring, copying session frames\n");
+}
 
+/*
+ * Check one frame from sess_sock and queue it for the pppd of its session;
+ * nothing is written until flush_dirty().
+ */
+void sess_frame(struct pppoe_packet *packet, int pkt_size)
+{
+    struct sess_ctx *s;
 #ifdef BUGGY_AC
 /* the following code deals with buggy AC software which sometimes sends
    duplicate packets */
 #define DUP_COUNT 10
 #define DUP_LENGTH 20
     static unsigned char dup_check[DUP_COUNT][DUP_LENGTH];
-    int i, ptr = 0;
+    static int ptr = 0;
+    int i;
 #endif /* BUGGY_AC */
 
-    if (!packet) {
-#ifdef BUGGY_AC
-        memset(dup_check, 0, sizeof(dup_check));
-#endif
-        /* allocate packet once */
-        packet = malloc(PACKETBUF);
-        assert(packet != NULL);
-    }
-
-    /* while(1) */
-    {
-#ifdef MULTIPLE_PPPOE
-        if (read_packet_nowait(sess_sock,packet,&pkt_size) != sess_sock)
-#else
-	    if (read_packet2(sess_sock,packet,&pkt_size) != sess_sock)
-#endif
-                return;
-#ifdef __linux__
-	    if (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr)) != 0)
-#else
-	    if (memcmp(packet->ethhdr.ether_shost, dst_addr, sizeof(dst_addr)) != 0)
-#endif
-	        return; /* packet not from AC */
+        if (pkt_size < (int)sizeof(struct pppoe_packet) ||
+            ntohs(packet->length) > pkt_size - sizeof(struct pppoe_packet))
+            return; /* truncated */
 #ifdef MULTIPLE_PPPOE
         if (memcmp(packet->ethhdr.h_dest, src_addr, sizeof(src_addr)) != 0) {
 	    /* fprintf(stderr, "pppoe: received a session packet not for
@@ -1521,8 +1785,13 @@ void sess_handler(void) {
             return; 
 		}
 #endif        
-	    if (packet->session != session)
-	        return; /* discard other sessions */
+#ifdef __linux__
+	    s = sess_find(packet->session, (char *)packet->ethhdr.h_source);
+#else
+	    s = sess_find(packet->session, (char *)packet->ethhdr.ether_shost);
+#endif
+	    if (s == NULL || s->out < 0)
+	        return; /* other sessions, or the kernel's */
 #ifdef __linux__
 	    if (packet->ethhdr.h_proto != htons(ETH_P_PPPOE_SESS))
 	    {
@@ -1547,47 +1816,156 @@ void sess_handler(void) {
 	       make sure the AC hasn't sent us a duplicate */
 	    for (i = 0; i < DUP_COUNT; i++)
 	        if (memcmp(packet, dup_check[i], sizeof(dup_check[0])) == 0)
-		        return; /* we've received a dup packet */
+		        break; /* we've received a dup packet */
+	    if (i < DUP_COUNT)
+	        return;
 #define min(a,b) ((a) < (b) ? (a) : (b))
 	    memcpy(dup_check[ptr], packet, min(ntohs(packet->length),
 						    sizeof(dup_check[0])));
 	    ptr = ++ptr % DUP_COUNT;
 #endif /* BUGGY_AC */
 
-	    encode_ppp(1, (unsigned char *)(packet+1), ntohs(packet->length));
+	    encode_ppp(s, (unsigned char *)(packet+1), ntohs(packet->length));
+}
+
+/* returns how many frames were taken, 0 once sess_sock has run dry */
+int sess_handler(void) {
+    /* pull packets of sess_sock and feed to pppd */
+    struct pppoe_packet *packet = NULL;
+    int k, n;
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+#endif
+
+    /* take a batch of what is queued, then write all of it to pppd at once */
+    if ((n = pktio_rx_recv(&sess_rx, 0)) <= 0)
+        return 0;
+#ifndef MULTIPLE_PPPOE
+    if (opt_verbose)
+        time(&tm);
+#endif
+
+    for (k = 0; k < n; k++)
+    {
+        packet = (struct pppoe_packet *)pktio_rx_frame(&sess_rx, k);
+#ifndef MULTIPLE_PPPOE
+        if (opt_verbose)
+        {
+            fprintf(log_file, "Received packet at %s", ctime(&tm));
+            print_packet(packet);
+            fputc('\n', log_file);
+        }
+#endif
+        sess_frame(packet, sess_rx.len[k]);
     }
+    flush_dirty();
+    return n;
+}
+
+/*
+ * Synchronous PPP (-s, pppd's 'sync' option): with N_HDLC on the pty, or
+ * a packet socket or pipe in its place, every read is one frame and there
+ * is neither escaping nor FCS to undo.  Take the frames that are waiting,
+ * up to a batch, and send them together.  Returns -1 on a read error.
+ */
+int pppd_sync(struct sess_ctx *s)
+{
+    static unsigned char rxBuf[RXRING];
+    struct pppoe_packet *packet;
+    unsigned char *rd;
+    int len, room, n = 0, off = 0;
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+#endif
+
+    do {
+        /* straight into a ring slot, behind room for the header */
+        if (sess_tx.ring) {
+            rd = pktio_tx_slot(&sess_tx) + sizeof(*packet);
+            room = sess_tx.room - sizeof(*packet);
+        } else {
+            rd = rxBuf + off;
+            room = sizeof(rxBuf) - off;
+        }
+        if ((len = read(s->in, rd, room)) <= 0) {
+            if (n > 0)
+                break;
+            if (len < 0)
+                perror("pppoe: read (pppd_sync)");
+            return len;
+        }
+        if (!sess_tx.ring)
+            off += len;
+#ifndef MULTIPLE_PPPOE
+        if (opt_verbose == 1) {
+            time(&tm);
+            fprintf(log_file, "\n%sInput of %d bytes:\n", ctime(&tm), len);
+            print_hex(rd, len);
+            fputc('\n', log_file);
+        }
+#endif
+        if (len >= 2 && rd[0] == FRAME_ADDR && rd[1] == FRAME_CTL) {
+            rd += 2;
+            len -= 2;
+        }
+        if (len <= 0)
+            continue;
+        hdlc_tx_snoop(&s->tx, rd, len, 0);
+
+        if (sess_tx.ring) {
+            packet = (struct pppoe_packet *)rd - 1;
+            memcpy(packet, &s->txhdr[0], sizeof(*packet));
+            packet->length = htons(len);
+            if (pktio_tx_commit(&sess_tx, packet, sizeof(*packet) + len) < 0)
+                fprintf(error_file,
+                        "pppd_handler: unable to send PPPoE packet\n");
+        } else {
+            packet = &s->txhdr[sess_tx.n];
+            packet->length = htons(len);
+            if (pktio_tx_add(&sess_tx, packet, sizeof(*packet), rd, len) < 0)
+                fprintf(error_file,
+                        "pppd_handler: unable to send PPPoE packet\n");
+        }
+    } while (++n < PKTIO_BATCH && sizeof(rxBuf) - off >= SYNC_FRAME &&
+             ioctl(s->in, FIONREAD, &len) == 0 && len > 0);
+
+    if ((sess_tx.n > 0 || sess_tx.queued > 0) && pktio_tx_flush(&sess_tx) < 0)
+        fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+    return n;
 }
 
-void pppd_handler(void) {
+void pppd_handler(struct sess_ctx *s) {
   /* take packets from pppd and feed them to sess_sock */
   struct pppoe_packet *packet = NULL;
 #ifndef MULTIPLE_PPPOE
   time_t tm;
 #endif
-  static sPktBuf pktBuf[BUFRING]; /*  wklin modified, use static */
-  int nPkt = 0;
-  /* unsigned char buf[PACKETBUF]; */
-  int len, pkt_size;
-  int i, bufRemain = 0, bufPos;
-  unsigned char *currBufStart;
-  static int first_in = 1; /*  wklin added, 08/10/2007 */
-
-  if (first_in) {
-      first_in = 0;
-      /* Clear data buffer */
-      for (i=0; i<BUFRING; i++) {
-           memset(pktBuf[i].packetBuf, 0x0, sizeof(pktBuf[i].packetBuf));
+  int len, room;
+  unsigned char *rdStart, *frame;
+
+  if (opt_sync) {
+      if (pppd_sync(s) == 0 && s->notty) {
+          fprintf(error_file, "pppd_handler: pppd closed the connection\n");
+          sess_close(s);
       }
+      return;
   }
 
   {
-    /* Read in data buffer, Maximum size is 4095 bytes for evey one read() */
-    if ((len = read(0, &(pktBuf[nPkt].packetBuf[(20+bufRemain)]), (4095-bufRemain))) < 0) {
+    /* Read behind the frame left open by the previous read, so it is
+       never copied except when the ring starts over */
+    room = hdlc_rx_space(&s->rx, &rdStart, 4095);
+
+    if ((len = read(s->in, rdStart, room)) < 0) {
       perror("pppoe");
       fprintf(error_file, "pppd_handler: read packet error len < 0\n");
       /* exit(1); */
       return;
     }
+    if (len == 0 && s->notty) {
+      fprintf(error_file, "pppd_handler: pppd closed the connection\n");
+      sess_close(s);
+    }
     if (len == 0) {
       /*  wklin modified start, 07/27/2007 */
       /* fprintf(error_file, "pppd_handler: read packet len = 0 bytes\n"); */
@@ -1596,211 +1974,1260 @@ void pppd_handler(void) {
       /* continue; */
         return;
     }
-    /* Append the length of previous remained data */
-    len += bufRemain;
 #ifndef MULTIPLE_PPPOE
     if (opt_verbose == 1) {
         time(&tm);
         fprintf(log_file, "\n%sInput of %d bytes:\n", ctime(&tm), len);
-        /*print_hex(buf, len);*/
-        print_hex(pktBuf[nPkt].packetBuf, len);
+        print_hex(rdStart, len);
         fputc('\n', log_file);
     }
 #endif
-    bufPos = 0;
-    packet = &(pktBuf[nPkt].packetBuf[0]);
-    currBufStart = &(pktBuf[nPkt].packetBuf[20]);
-    do {
-        /* Segment and compose packet from buffer */
-        if ((pkt_size = create_sess(packet, src_addr, dst_addr, currBufStart, len,
-                                    session, &bufRemain)) == 0) {
-          /* Copy incomplete content to next buffer */
-          if (bufRemain > 0) {
-            if ((nPkt+1) < BUFRING) {
-                memcpy(&(pktBuf[nPkt+1].packetBuf[20]),
-                       &(pktBuf[nPkt].packetBuf[(4115-bufRemain)]),         /* 4115 = 4095 + 20 */
-                       bufRemain);
-            }
-            else {
-                memcpy(&(pktBuf[0].packetBuf[20]),
-                       &(pktBuf[(BUFRING-1)].packetBuf[(4115-bufRemain)]),  /* 4115 = 4095 + 20 */
-                       bufRemain);
-            }
-          }
-          break;
+    /* Split the input on flags, whatever protocol the frames carry, and
+       send all frames of this read with as few system calls as possible */
+    hdlc_rx_feed(&s->rx, rdStart, len);
+    while (hdlc_rx_frame(&s->rx, &frame, &len)) {
+        /* PPPoE carries no address/control field; under ACFC pppd
+           leaves it out itself, and a compressed protocol goes as is */
+        if (len >= 2 && frame[0] == FRAME_ADDR && frame[1] == FRAME_CTL) {
+            frame += 2;
+            len -= 2;
+        }
+        if (len <= 0)
+            continue;
+        /* an LCP restart from pppd drops the learned escape map */
+        hdlc_tx_snoop(&s->tx, frame, len, 0);
+
+        if (sess_tx.ring) {
+            /* already in its slot; the header goes in front of it */
+            packet = (struct pppoe_packet *)frame - 1;
+            memcpy(packet, &s->txhdr[0], sizeof(*packet));
+            packet->length = htons(len);
+            if (pktio_tx_commit(&sess_tx, packet, sizeof(*packet) + len) < 0)
+              fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+            hdlc_rx_target(&s->rx,
+                           pktio_tx_slot(&sess_tx) + sizeof(*packet));
+            continue;
         }
 
-        len -= bufRemain;
-
-        /* Send the completely composed packet */
-        if (send_packet(sess_sock, packet, pkt_size, if_name) < 0) {
+        packet = &s->txhdr[sess_tx.n];
+        packet->length = htons(len);
+        if (pktio_tx_add(&sess_tx, packet, sizeof(*packet), frame, len) < 0)
           fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
-          /* exit(1); */
-          return;
+    }
+    if ((sess_tx.n > 0 || sess_tx.queued > 0) &&
+        pktio_tx_flush(&sess_tx) < 0)
+      fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+  }
+}
+
+/*
+ * io_uring engine (-U).  A receive stays posted on sess_sock and a read on
+ * the pty, each taking buffers from its own pool as data arrives, so there
+ * is no system call per packet: completions are reaped from shared memory,
+ * and the writes to pppd and the sends they lead to go to the kernel
+ * together with a single io_uring_enter() per wakeup.  It serves a single
+ * session, ur_sess.
+ */
+#define ur_slot_buf(i) (ur_slots + (i) * SESSBUF)
+
+/* a send is done with its slot */
+void uring_send_done(struct uring_cqe *c)
+{
+    if (c->res < 0)
+        sess_tx.errors++;
+    else
+        sess_tx.frames++;
+    ur_free[ur_nfree++] = URING_INDEX(c->tag);
+}
+
+/* have pppd_rx decode the next frame into a free slot */
+int uring_next_slot(void)
+{
+    struct uring_cqe c;
+
+    while (ur_nfree == 0) {
+        if (uring_wait(&ur, UR_SESS_TX, &c) < 0) {
+            perror("pppoe: io_uring_enter (uring_next_slot)");
+            return -1;
         }
+        uring_send_done(&c);
+    }
+    ur_slot = ur_free[--ur_nfree];
+    hdlc_rx_target(&ur_sess->rx, ur_slot_buf(ur_slot) + sizeof(struct pppoe_packet));
+    return 0;
+}
 
-        /* Check if all the contents of buffer were processed */
-        if (bufRemain <= 0) {
-            break;
+/* a read from pppd: each frame is sent from the slot it was decoded into */
+void uring_pppd_input(unsigned char *buf, int len)
+{
+    struct sess_ctx *s = ur_sess;
+    struct pppoe_packet *packet;
+    unsigned char *frame;
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+
+    if (opt_verbose == 1) {
+        time(&tm);
+        fprintf(log_file, "\n%sInput of %d bytes:\n", ctime(&tm), len);
+        print_hex(buf, len);
+        fputc('\n', log_file);
+    }
+#endif
+    hdlc_rx_feed(&s->rx, buf, len);
+    while (hdlc_rx_frame(&s->rx, &frame, &len)) {
+        if (len >= 2 && frame[0] == FRAME_ADDR && frame[1] == FRAME_CTL) {
+            frame += 2;
+            len -= 2;
         }
-        else {
-            /* Renew the positions of packet header and data buffer */
-            bufPos += len;
-            currBufStart = &(pktBuf[nPkt].packetBuf[bufPos+20]);
-            packet = &(pktBuf[nPkt].packetBuf[bufPos]);
-            len = bufRemain;
+        if (len <= 0)
+            continue;
+        hdlc_tx_snoop(&s->tx, frame, len, 0);
+
+        packet = (struct pppoe_packet *)frame - 1;
+        memcpy(packet, &ur_hdr, sizeof(*packet));
+        packet->length = htons(len);
+        if (uring_send(&ur, sess_sock, packet, sizeof(*packet) + len,
+                       URING_TAG(UR_SESS_TX, ur_slot)) < 0) {
+            fprintf(error_file, "pppd_handler: unable to send PPPoE packet\n");
+            continue; /* the slot is still ours */
         }
-    } while (bufRemain > 0);
+        ur_queued++;
+        if (uring_next_slot() < 0)
+            cleanup_and_exit(1);
+    }
+}
 
-    /* Process next read buffer */
-    nPkt++;
-    if (nPkt >= BUFRING)
-        nPkt = 0;
+void uring_ready(struct ev_handler *h)
+{
+    struct uring_cqe cqe[PKTIO_BATCH], *c;
+    int i, n, rx = 0;
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+#endif
 
-  }
+    /* waiting for a write or a slot sets completions aside, which makes
+       no new wakeup: go on until there are none */
+    do {
+        while (!sess_over && (n = uring_reap(&ur, cqe, PKTIO_BATCH)) > 0)
+            for (i = 0; i < n; i++) {
+                c = &cqe[i];
+                switch (URING_KIND(c->tag)) {
+                case UR_SESS_RX:
+                    if (c->bid >= 0) {
+                        if (c->res > 0) {
+                            unsigned char *buf = uring_buf(&ur_sess_bufs, c->bid);
+#ifndef MULTIPLE_PPPOE
+                            if (opt_verbose) {
+                                time(&tm);
+                                fprintf(log_file, "Received packet at %s", ctime(&tm));
+                                print_packet((struct pppoe_packet *)buf);
+                                fputc('\n', log_file);
+                            }
+#endif
+                            sess_frame((struct pppoe_packet *)buf, c->res);
+                            sess_rx.frames++;
+                            rx++;
+                        }
+                        uring_buf_put(&ur_sess_bufs, c->bid);
+                    }
+                    if (c->res == -EINVAL && ur.recv_multishot)
+                        ur.recv_multishot = 0; /* older kernel: one at a time */
+                    else if (c->res < 0 && c->res != -ENOBUFS) {
+                        errno = -c->res;
+                        perror("pppoe: recv (uring)");
+                    }
+                    /* out of buffers, or not multishot: post it again */
+                    if (!c->more)
+                        uring_recv(&ur, sess_sock, &ur_sess_bufs, c->tag);
+                    break;
+                case UR_PPPD_RX:
+                    if (c->bid >= 0) {
+                        if (c->res > 0)
+                            uring_pppd_input(uring_buf(&ur_pppd_bufs, c->bid), c->res);
+                        uring_buf_put(&ur_pppd_bufs, c->bid);
+                    }
+                    if ((c->res == -EINVAL || c->res == -EBADFD) &&
+                        ur.read_multishot)
+                        ur.read_multishot = 0; /* not for this kind of fd */
+                    else if (c->res == 0 && ur_sess->notty) {
+                        fprintf(error_file, "pppd_handler: pppd closed the connection\n");
+                        sess_close(ur_sess);
+                        break;
+                    } else if (c->res <= 0 && c->res != -ENOBUFS) {
+                        /* pppd is gone; like a hangup, it is not waited for */
+                        if (c->res < 0) {
+                            errno = -c->res;
+                            perror("pppoe");
+                        }
+                        fprintf(error_file, "pppd_handler: read packet error len < 0\n");
+                        break;
+                    }
+                    if (!c->more)
+                        uring_read(&ur, ur_sess->in, &ur_pppd_bufs, c->tag);
+                    break;
+                case UR_PPPD_TX:
+                    uring_write_done(c);
+                    break;
+                case UR_SESS_TX:
+                    uring_send_done(c);
+                    break;
+                }
+            }
+        flush_dirty();
+    } while (!sess_over && ur.nstash > 0);
+
+    if (rx > 0)
+        sess_rx.batches++;
+    if (ur_queued > 0)
+        sess_tx.batches++;
+    ur_queued = 0;
+    if (uring_submit(&ur) < 0)
+        perror("pppoe: io_uring_enter (uring_ready)");
+}
+
+/*
+ * Everything -U needs for s but the requests themselves, which
+ * uring_start() posts.  Returns -1, having undone all of it, when the
+ * kernel cannot.
+ */
+int uring_setup(struct sess_ctx *s)
+{
+    struct iovec iov[2];
+    int i;
+
+    if (uring_init(&ur) < 0)
+        return -1;
+    /* encode_ppp() fills these in turn, and they are written as they are */
+    for (i = 0; i < 2; i++) {
+        iov[i].iov_base = s->ppp_buf[i];
+        iov[i].iov_len = PPPDBUF;
+    }
+    ur_slots = malloc(UR_SLOTS * SESSBUF);
+    if (ur_slots == NULL || uring_register(&ur, iov, 2) < 0 ||
+        uring_bufs_init(&ur, &ur_sess_bufs, UR_SESS_RX, UR_SESSBUFS, SESSBUF) < 0 ||
+        uring_bufs_init(&ur, &ur_pppd_bufs, UR_PPPD_RX, UR_PPPDBUFS, UR_PPPDBUF) < 0 ||
+        ev_add(&uring_ev, ur.fd, EV_IN, uring_ready, NULL) < 0) {
+        i = errno;
+        uring_bufs_exit(&ur_sess_bufs);
+        uring_bufs_exit(&ur_pppd_bufs);
+        uring_exit(&ur);
+        free(ur_slots);
+        errno = i;
+        return -1;
+    }
+    ur_sess = s;
+    for (ur_nfree = 0; ur_nfree < UR_SLOTS; ur_nfree++)
+        ur_free[ur_nfree] = UR_SLOTS - 1 - ur_nfree;
+    return 0;
+}
+
+/* once the session is up */
+void uring_start(void)
+{
+    struct sess_ctx *s = ur_sess;
+
+    /* frames from pppd are decoded into the slot they are sent from, behind
+       room for the header */
+    if (s->rx.mru > SESSBUF - (int)sizeof(struct pppoe_packet))
+        s->rx.mru = SESSBUF - sizeof(struct pppoe_packet);
+    create_sess(&ur_hdr, src_addr, s->ac, 0, s->id);
+    uring_next_slot();
+    s->ppp_out = s->ppp_buf[ur_cur];
+    s->ppp_out_len = 0;
+    uring_recv(&ur, sess_sock, &ur_sess_bufs, URING_TAG(UR_SESS_RX, 0));
+    uring_read(&ur, s->in, &ur_pppd_bufs, URING_TAG(UR_PPPD_RX, 0));
+    if (uring_submit(&ur) < 0)
+        perror("pppoe: io_uring_enter (uring_start)");
+}
+
+/*
+ * Event handlers for the main loop.  A descriptor only wakes us when it
+ * becomes ready, not while it stays so: each handler takes all there is.
+ */
+void sess_ready(struct ev_handler *h)
+{
+    while (!sess_over && sess_handler() > 0)
+        ;
+}
+
+/* what pppd sends while s has no session to carry it */
+void pppd_drop(struct sess_ctx *s)
+{
+    static unsigned char buf[4096];
+    int len, queued;
+
+    do {
+        if ((len = read(s->in, buf, sizeof(buf))) == 0 && s->notty) {
+            fprintf(error_file, "pppd_handler: pppd closed the connection\n");
+            sess_close(s);
+            return;
+        }
+    } while (len > 0 && ioctl(s->in, FIONREAD, &queued) == 0 && queued > 0);
+}
+
+void pppd_ready(struct ev_handler *h)
+{
+    struct sess_ctx *s = h->arg;
+    int queued;
+
+    if (s->state != DISC_SESSION) {
+        pppd_drop(s);
+        return;
+    }
+    /* the first read may also be the one to see a hangup */
+    do
+        pppd_handler(s);
+    while (s->state == DISC_SESSION &&
+           ioctl(s->in, FIONREAD, &queued) == 0 && queued > 0);
+}
+
+/* signals taken by sig_ready() instead of asynchronous handlers */
+static const int ev_sigs[] = {
+    SIGINT, SIGTERM
+#ifdef NEW_WANDETECT
+    , SIGUSR1
+#endif
+};
+
+void sig_ready(struct ev_handler *h)
+{
+    int sig;
+
+    while ((sig = ev_signal_read(h)) > 0) {
+#ifdef NEW_WANDETECT
+        if (sig == SIGUSR1) {
+            sigint2(sig);
+            continue;
+        }
+#endif
+        sigint(sig);
+    }
 }
+
+/*
+ * The session socket, opened with the first session and shared by all of
+ * them.  -U and -T only serve a single one.
+ */
+void sess_open(void)
+{
+    if ((sess_sock = open_interface(if_name,ETH_P_PPPOE_SESS,NULL)) < 0) {
+    	fprintf(log_file, "pppoe: unable to create raw socket\n");
 #ifdef MULTIPLE_PPPOE
-/*  Bob Guo added start 10/25/2007*/
-#define SERVER_RECORD_FILE	"/tmp/ppp/PPPoE_server_record"
-#define UPTIME_FILE			"/proc/uptime"
+        exit(1);
+#else
+    	cleanup_and_exit(1);
+#endif
+    }
+    /* -U takes the place of the receive path, ring or not */
+    if (opt_uring && opt_sync) {
+        fprintf(error_file, "pppoe: -U does not apply to -s\n");
+        opt_uring = 0;
+    }
+    if (opt_uring && nsess > 1) {
+        fprintf(error_file, "pppoe: -U serves a single session\n");
+        opt_uring = 0;
+    }
+    if (opt_uring && uring_setup(&sess_tab[0]) < 0) {
+        perror("pppoe: io_uring");
+        fprintf(error_file, "pppoe: no io_uring, reading and writing as usual\n");
+        opt_uring = 0;
+    }
+    if (!opt_uring)
+        sess_rx_setup();
+    pktio_tx_init(&sess_tx, sess_sock);
+    if (opt_txring && !opt_uring) {
+        if (nsess > 1)
+            fprintf(error_file, "pppoe: -T serves a single session, copying uplink frames\n");
+        else if (pktio_tx_ring(&sess_tx, if_name) < 0)
+            fprintf(error_file, "pppoe: no transmit ring, copying uplink frames\n");
+    }
+    unlink(PPP_PPPOE_STATS); /* counters of the previous session */
+    if (!opt_uring && ev_add(&sess_ev, sess_sock, EV_IN, sess_ready, NULL) < 0)
+        cleanup_and_exit(1);
+}
 
-static int checkServerRecord(unsigned char *pServerMac)
+/*
+ * The pppd of s, on a pty or, 'notty', on a pipe pair or socketpair.  Set
+ * up with its first session; a later one takes the channel over as is.
+ */
+void sess_chan(struct sess_ctx *s)
 {
-	FILE *fp=NULL;
-	char line[64];
-	char macAddr[32];
-	char *token;
-	int iTimeStamp = 0;
+    if (opt_sync && isatty(s->in)) {
+        /* have the pty keep frame boundaries */
+        int disc = N_HDLC;
+
+        if (ioctl(s->in, TIOCSETD, &disc) < 0) {
+            perror("pppoe: ioctl(TIOCSETD)");
+            fprintf(error_file, "pppoe: no N_HDLC line discipline, cannot run -s\n");
+            cleanup_and_exit(1);
+        }
+    }
+    /* pppd 'notty' on a pipe pair or socketpair: no tty layer in the way,
+       so give it room, and hand the encoded stream over by reference */
+    s->notty = !isatty(s->in);
+    if (pktio_pipe_size(s->in, opt_pipebuf) < 0 ||
+        pktio_pipe_size(s->out, opt_pipebuf) < 0)
+        perror("pppoe: cannot size the buffers to pppd");
+    pktio_pipe_init(&s->pipe, s->out, s->ppp_buf[0], s->ppp_buf[1], !opt_sync);
+    s->ppp_out = pktio_pipe_buf(&s->pipe);
+    s->ppp_out_len = 0;
+
+    if (opt_uring)
+        uring_start();
+    else if (ev_add(&s->pppd_ev, s->in, EV_IN, pppd_ready, s) < 0)
+        cleanup_and_exit(1);
+}
 
-	fp = fopen(SERVER_RECORD_FILE, "r");
-	if(fp == NULL)
-	{
-		goto _exit;
-	}
+/*
+ * PADS came for s: connect its kernel channel, note it in its state file,
+ * and let frames flow both ways.
+ */
+void sess_start(struct sess_ctx *s)
+{
+    int i;
 
-	sprintf(macAddr, "%02x:%02x:%02x:%02x:%02x:%02x", *pServerMac, *(pServerMac+1), *(pServerMac+2), 
-													*(pServerMac+3), *(pServerMac+4), *(pServerMac+5));
+    if (sess_sock <= 0)
+        sess_open();
 
-	while (fgets(line, sizeof(line), fp)) 
-	{
-		if( strncmp(line, macAddr, strlen(macAddr)) == 0)
-		{
-            /* the mac address exist in the list */
-			token = strtok(line, " ");
-			if(token == NULL)
-				goto _exit;
-			token = strtok(NULL, " ");
-			if(token)
-			{
-				iTimeStamp = atoi(token);
-			}
-			break;
-		}
-	}
+    /*  added start, Winster Chan, 06/26/2006 */
+    /* Connect pptp kernel module */
+#ifdef MULTIPLE_PPPOE
+    pptp_pppox_open(&s->poxfd, &s->pppfd);
+
+    if (s->poxfd == -1) {
+        fprintf(stderr, "pppoe: poxfd == -1\n");
+        cleanup_and_exit(1);
+    }
 
-_exit:
+    if (s->pppfd == -1) {
+        fprintf(stderr, "pppoe: pppfd == -1\n");
+        cleanup_and_exit(1);
+    }
+#else
+    if (s->poxfd < 0) /* released when a PADT ended the one before */
+        pptp_pppox_open(&s->poxfd, &s->pppfd);
+#endif
 
-	if(fp)
-		fclose(fp);
+    /*  wklin modified start, 07/31/2007 */
+    sess_pppox(s);
+    if ( 0 > pptp_pppox_connect(&s->poxfd, &s->pppfd)) {
+#ifdef MULTIPLE_PPPOE
+        fprintf(stderr, "error connect to pppox\n");
+#endif
+        cleanup_and_exit(1);
+    }
+    /*  wklin modified end, 07/31/2007 */
+    /*  added end, Winster Chan, 06/26/2006 */
 
-	return iTimeStamp;
+    sess_save(s, 0); /*  added Winster Chan 12/05/2005 */
+
+    hdlc_rx_init(&s->rx, HDLC_MRU, opt_fwd);
+    if (!opt_uring) /* which reads into buffers of its own */
+        hdlc_rx_ring(&s->rx, s->ring, sizeof(s->ring), 0);
+    for (i = 0; i < PKTIO_BATCH; i++)
+        create_sess(&s->txhdr[i], src_addr, s->ac, 0, s->id);
+    if (sess_tx.ring) {
+        /* frames are decoded straight into the ring, each behind room
+           for its header */
+        if (s->rx.mru > sess_tx.room - (int)sizeof(struct pppoe_packet))
+            s->rx.mru = sess_tx.room - sizeof(struct pppoe_packet);
+        hdlc_rx_target(&s->rx, pktio_tx_slot(&sess_tx) + sizeof(struct pppoe_packet));
+    }
+
+    sess_link(s);
+    s->state = DISC_SESSION;
+    s->since = ev_now();
+    set_filters();
+
+    /* none when the kernel channel carries it */
+    if (s->in >= 0 && s->ppp_out == NULL)
+        sess_chan(s);
 }
 
-static void updateServerRecord(unsigned char *pServerMac)
+/* one more session for sess_init() */
+void sess_add(int in, int out, int unit)
 {
-    FILE *fp=NULL, *fp_uptime=NULL;
-	char line[64];
-	char macAddr[32];
-	char uptime[32];
-    char *token;
-    int bFound;
-	
-	fp = fopen(SERVER_RECORD_FILE, "r+");
-	if(fp == NULL)
-	{
-		fp = fopen(SERVER_RECORD_FILE, "w+");
-		if(fp == NULL)
-			goto _exit;
-	}
+    sess_opts = realloc(sess_opts, (nsess + 1) * sizeof(*sess_opts));
+    assert(sess_opts != NULL);
+    sess_opts[nsess].in = in;
+    sess_opts[nsess].out = out;
+    sess_opts[nsess].unit = unit;
+    nsess++;
+}
 
-	sprintf(macAddr, "%02x:%02x:%02x:%02x:%02x:%02x", *pServerMac, *(pServerMac+1), *(pServerMac+2), 
-													*(pServerMac+3), *(pServerMac+4), *(pServerMac+5));
-													
-	fp_uptime = fopen(UPTIME_FILE, "r");
-	if(fp_uptime == NULL)
-		goto _exit;
+/*
+ * Discovery, a state machine per session driven by disc_sock and the
+ * session's timer: any number of sessions are looked for side by side,
+ * and those already up carry traffic meanwhile.  With more than one
+ * session, a Host-Uniq in PADI and PADR tells whose answer comes back.
+ *
+ * PADI and PADR are built once into the session's template, and sent
+ * again as they are while no answer comes, each time after twice as
+ * long as before (RFC 2516, 5.1 and 5.3), give or take a quarter so
+ * sessions started together do not keep sending together.
+ *
+ * The first PADO opens a window of -w ms for others to come in, and the
+ * best of them by disc_score() gets the PADR; with -x, the second best
+ * gets one too, and the AC whose PADS comes second is sent a PADT.
+ */
+#define disc_uniq(s) (nsess > 1 ? (char *)&(s)->uniq : NULL)
 
-	if(fgets(line, sizeof(line), fp_uptime))
-	{
-		token = strtok(line, " .\t\n");
-		if(token == NULL)
-			goto _exit;
-        
-        int i = atoi(token);
-        sprintf(uptime, "%010d", i);
-	}
+/* bytes of TAGs in packet, of len bytes in all */
+int disc_payload(struct pppoe_packet *packet, int len)
+{
+    len -= sizeof(*packet);
+    if (len > ntohs(packet->length))
+        len = ntohs(packet->length);
+    return len;
+}
 
-	bFound = 0;
+/* a PADR from s to ac, with the TAGs of its PADO, into packet: its
+   size, or 0 */
+int disc_padr_make(struct sess_ctx *s, struct pppoe_packet *packet,
+                   char *ac, const struct tag_buf *tags)
+{
+    int pkt_size;
 
-	while (fgets(line, sizeof(line), fp)) 
-	{
-		if( strncmp(line, macAddr, strlen(macAddr)) == 0)
-		{
-            /* the mac address exist in the list */
-			bFound = 1;
-			break;
-		}
-	}
-	
-	if(bFound)
-	{
-		int ioffset = 0 - (strlen(line));
-		fseek(fp, ioffset, SEEK_CUR);
-	}
-	else
-	{
-		fseek(fp, 0, SEEK_END);
-	}
-	fprintf(fp, "%s %s\n", macAddr, uptime);
+    /*  wklin modified, 03/27/2007, add service name */
+    if ((pkt_size = create_padr(packet, src_addr, ac, service_name,
+                                tags,
+                                disc_uniq(s), sizeof(s->uniq))) == 0) {
+	fprintf(stderr, "pppoe: unable to create PADR packet\n");
+	return 0;
+    }
+    return pkt_size + 14;
+}
 
-_exit:
-	if(fp)
-		fclose(fp);
-	if(fp_uptime)
-		fclose(fp_uptime);
+/* the template of s, once more, with the timeout after it */
+void disc_send(struct sess_ctx *s)
+{
+    struct disc_offer *o = &s->offer[1];
+    long ms;
+    int pkt_size;
 
+    if (send_packet(disc_sock, (struct pppoe_packet *)s->tmpl, s->tmpl_len) < 0) {
+	fprintf(stderr, "pppoe: unable to send %s packet\n",
+		s->state == DISC_PADI_SENT ? "PADI" : "PADR");
+	exit(1);
+    }
+    /* the rival goes without rather than stopping everything */
+    if (s->rival && s->state == DISC_PADR_SENT &&
+        ((pkt_size = disc_padr_make(s, disc_pkt, o->ac, &o->tags)) == 0 ||
+         send_packet(disc_sock, disc_pkt, pkt_size) < 0))
+        s->rival = 0;
+    s->tries++;
+    s->sent = ev_now();
+    ms = s->rto - s->rto / 4 + rand() % (s->rto / 2 + 1);
+    if ((s->rto *= 2) > opt_rto_max)
+        s->rto = opt_rto_max;
+    ev_tmo_set(&s->timer, ms);
 }
 
-/*  Bob Guo added end 10/25/2007 */
-#endif
-int main(int argc, char **argv)
+/* PADI for s, sent again until a PADO comes */
+void disc_padi(struct sess_ctx *s)
 {
-    struct pppoe_packet *packet = NULL;
 #ifdef MULTIPLE_PPPOE
-    /*  Bob Guo added start 10/25/2007*/    
-    struct pppoe_packet *packet2 = NULL;
-    struct pppoe_packet *packet_temp = NULL;
-    int pkt2_size;
-    int iOldestTimeStamp, iTimeStamp;
-    /*  Bob Guo added end 10/25/2007*/
+    memset(s->ac, 0, sizeof(s->ac));
 #endif
+    s->noffers = 0;
+    s->rival = 0;
+    s->quick = 0;
+    s->held = 0;
+    if (s->state != DISC_PADI_SENT) {
+        s->state = DISC_PADI_SENT;
+        set_filters(); /* before any answer can come */
+    }
+    /* start the PPPoE session */
+    /*  wklin modified, 03/27/2007, add service name */
+    if ((s->tmpl_len = create_padi((struct pppoe_packet *)s->tmpl, src_addr,
+                                   service_name, disc_uniq(s),
+                                   sizeof(s->uniq))) == 0) {
+	fprintf(stderr, "pppoe: unable to create PADI packet\n");
+	exit(1);
+    }
+    s->rto = opt_rto;
+    s->tries = 0;
+    disc_send(s);
+}
+
+/* PADR to the AC of s, sent again up to DISC_PADR_TRIES times in all */
+void disc_padr(struct sess_ctx *s)
+{
+    if ((s->tmpl_len = disc_padr_make(s, (struct pppoe_packet *)s->tmpl,
+                                      s->ac, &s->pado_tags)) == 0)
+	exit(1);
+    s->rto = opt_rto;
+    s->tries = 0;
+    disc_send(s);
+}
+
+/*
+ * A session of s from before we were restarted may still be up as far as
+ * its AC knows: it is ended alongside the new discovery rather than
+ * before it.  The PADT goes out DISC_STALE_TRIES times, until the AC
+ * sends one back, or a PADS to show it went past.  A PADR it refuses
+ * meanwhile is sent again after that.
+ */
+void stale_send(struct sess_ctx *s)
+{
     int pkt_size;
-    /*  added start Winster Chan 12/05/2005 */
+#ifndef MULTIPLE_PPPOE
+    time_t tm;
+#endif
+
+    /* send PADT to server to clear the previous connection */
+    if ((pkt_size = create_padt(disc_pkt, src_addr, s->stale_ac,
+                                s->stale_id, NULL)) == 0) {
+        fprintf(stderr, "pppoe: unable to create PADT packet\n");
+#ifdef MULTIPLE_PPPOE
+        exit(1);
+#else
+        cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
+#endif
+    }
+    if (send_packet(disc_sock, disc_pkt, pkt_size+14) < 0) {
+        fprintf(stderr, "pppoe: unable to send PADT packet\n");
+#ifdef MULTIPLE_PPPOE
+        exit(1);
+#else
+        cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
+#endif
+    }
+#ifndef MULTIPLE_PPPOE
+    time(&tm);
+    fprintf(stderr, "PPPOE: PADT sent %s\n",ctime(&tm)); /*  wklin added, 07/26/2007 */
+#endif
+    s->stale_tries++;
+    ev_tmo_set(&s->stale_tmo, DISC_STALE_RTO);
+}
+
+void stale_done(struct sess_ctx *s)
+{
+    s->stale_id = 0;
+    ev_tmo_set(&s->stale_tmo, 0);
+    if (s->held && s->state == DISC_PADR_SENT)
+        disc_padr(s);
+    s->held = 0;
+}
+
+void stale_expired(struct ev_tmo *t)
+{
+    struct sess_ctx *s = t->arg;
+
+    if (s->stale_tries < DISC_STALE_TRIES)
+        stale_send(s);
+    else
+        stale_done(s);
+}
+
+/* 1 if packet is the AC's PADT for a session from before */
+int stale_padt(struct pppoe_packet *packet)
+{
+    int i;
+
+    if (packet->code != CODE_PADT || packet->session == 0)
+        return 0;
+    for (i = 0; i < nsess; i++)
+        if (sess_tab[i].stale_id == packet->session &&
+#ifdef __linux__
+            memcmp(sess_tab[i].stale_ac, packet->ethhdr.h_source, ETH_ALEN) == 0) {
+#else
+            memcmp(sess_tab[i].stale_ac, packet->ethhdr.ether_shost, ETH_ALEN) == 0) {
+#endif
+            stale_done(&sess_tab[i]);
+            return 1;
+        }
+    return 0;
+}
+
+/* the session of s in its state file, if there is one, is from before */
+void sess_stale(struct sess_ctx *s)
+{
     FILE *fp;
     char buf[64];
+    unsigned int nMacAddr[ETH_ALEN];
+    int nSessId, i;
+
+    /*  added start Winster Chan 12/05/2005 */
+    if (!(fp = fopen(s->file, "r")))
+        return; /* perror(PPP_PPPOE_SESSION); */ /*  wklin removed, 08/13/2007 */
+
+    /* Init variables */
+    for (i=0; i<ETH_ALEN; i++)
+        nMacAddr[i] = 0;
+    nSessId = 0;
+
+    /* Get the PPPoE server MAC address and Session ID from file */
+    if(fgets(buf, sizeof(buf), fp)) {
+        sscanf(buf, "%02x:%02x:%02x:%02x:%02x:%02x %d",
+            &nMacAddr[0], &nMacAddr[1], &nMacAddr[2],
+            &nMacAddr[3], &nMacAddr[4], &nMacAddr[5],
+            &nSessId);
+
+        /* Transfer types of data */
+        for (i=0; i<ETH_ALEN; i++) {
+            s->stale_ac[i] = (char)nMacAddr[i];
+        }
+        s->stale_id = htons((unsigned short)nSessId);
+
+        /* Check if the previous MAC address and Session ID exist. */
+        for (i = 0; i < ETH_ALEN && s->stale_ac[i] == 0; i++)
+            ;
+        if (i == ETH_ALEN)
+            s->stale_id = 0;
+        if (s->stale_id != 0) {
+            s->stale_tries = 0;
+            stale_send(s);
+        }
+    }
+    fclose(fp);
     /*  added end Winster Chan 12/05/2005 */
+}
+
+/* the bytes of hex, or "-" for none, into buf: how many, or -1 if that
+   is more than max or not hex */
+int unhex(const char *hex, char *buf, int max)
+{
+    unsigned int c;
+    int n = 0;
+
+    if (strcmp(hex, "-") == 0)
+        return 0;
+    for (; *hex; hex += 2) {
+        if (n == max || hex[1] == 0 || sscanf(hex, "%2x", &c) != 1)
+            return -1;
+        buf[n++] = (char)c;
+    }
+    return n;
+}
+
+/*
+ * -q: a PADR straight to the AC of the last session of s, as
+ * sess_save_ac() left it, skipping PADI and PADO.  Should the AC refuse
+ * or not answer, s runs full discovery.  Returns 0 when there is nothing
+ * to go on, or the Service-Name asked for is not the same.
+ */
+int disc_resume(struct sess_ctx *s)
+{
+    FILE *fp;
+    /* the address, the Service-Name and the TAGs of the PADO */
+    char path[48], line[18 + 512 + 2 * TAGS_ROOM + 2], svc[512], name[256];
+    char *tags = NULL;
+    unsigned int m[ETH_ALEN];
+    int i, n, off = 0;
+
+    sprintf(path, "%s.ac", s->file);
+    if (!(fp = fopen(path, "r")))
+        return 0;
+    n = fgets(line, sizeof(line), fp) != NULL &&
+        sscanf(line, "%02x:%02x:%02x:%02x:%02x:%02x %511s %n",
+               &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], svc, &off) == 7 &&
+        off > 0;
+    fclose(fp);
+    if (n) {
+        tags = line + off;
+        tags[strcspn(tags, " \n")] = 0;
+    }
+    if (!n || (n = unhex(svc, name, sizeof(name))) < 0 ||
+        n != (service_name ? (int)strlen(service_name) : 0) ||
+        (n > 0 && memcmp(name, service_name, n) != 0) ||
+        (n = unhex(tags, (char *)s->pado_tags.buf, TAGS_ROOM)) < 0 ||
+        tag_buf_set(&s->pado_tags, s->pado_tags.buf, n, NULL) < 0)
+        return 0;
+    for (i = 0, n = 0; i < ETH_ALEN; i++)
+        n |= (s->ac[i] = (char)m[i]);
+    if (n == 0)
+        return 0;
+
+    s->noffers = 0;
+    s->rival = 0;
+    s->quick = 1;
+    s->state = DISC_PADR_SENT;
+    set_filters();
+    disc_padr(s);
+    return 1;
+}
+
+/* discovery for s came to nothing: start over after a while */
+void disc_fail(struct sess_ctx *s)
+{
+    s->state = DISC_TERMINATING;
+    ev_tmo_set(&s->timer, DISC_HOLDOFF);
+    set_filters();
+}
+
+/* the AC of s changes places with its rival */
+void disc_swap(struct sess_ctx *s)
+{
+    struct disc_offer o = s->offer[1];
+
+    memcpy(s->offer[1].ac, s->ac, ETH_ALEN);
+    s->offer[1].tags = s->pado_tags;
+    memcpy(s->ac, o.ac, ETH_ALEN);
+    s->pado_tags = o.tags;
+}
+
+/*
+ * The AC of s refused it or gave up on it: that is held against the AC,
+ * and s waits for the rival alone if it has one.  Returns 0 if not.
+ */
+int disc_lost(struct sess_ctx *s)
+{
+    if (s->quick) { /* its cookie went stale, maybe: look around */
+        disc_padi(s);
+        return 1;
+    }
+    ac_note(s->ac, 1);
+    if (!s->rival)
+        return 0;
+    disc_swap(s);
+    s->rival = 0;
+    /* its retransmits, on the timer already running */
+    if ((s->tmpl_len = disc_padr_make(s, (struct pppoe_packet *)s->tmpl,
+                                      s->ac, &s->pado_tags)) == 0)
+	exit(1);
+    return 1;
+}
+
+/* the AC of s gave up on it before its PADS */
+void disc_abort(struct sess_ctx *s)
+{
+    if (disc_lost(s))
+        return;
+#ifndef MULTIPLE_PPPOE
+    if (nsess == 1)
+        cleanup_and_exit(0); /* pppd starts us over */
+#endif
+    disc_fail(s);
+}
+
+/* remember the AC of a PADO, and its TAGs, of len bytes indexed by tags */
+void disc_offer(struct disc_offer *o, struct pppoe_packet *packet, int len,
+                const struct tags *tags)
+{
+#ifdef __linux__
+    memcpy(o->ac, packet->ethhdr.h_source, sizeof(o->ac));
+#else
+    memcpy(o->ac, packet->ethhdr.ether_shost, sizeof(o->ac));
+#endif
+    tag_buf_set(&o->tags, (unsigned char *)(packet + 1), len, tags);
+}
+
+/* the most an offer can be worth, less its latency */
+long disc_best(void)
+{
+    return (opt_ac_name ? DISC_NAME_BONUS : 0) +
+           (service_name ? DISC_NAME_BONUS : 0);
+}
+
+/*
+ * What the PADO in packet is worth to s: the sooner it came the better,
+ * one naming the AC or service asked for is worth more, and so is an AC
+ * that did not let us down before.  With MULTIPLE_PPPOE, the units share
+ * the ACs out by preferring the one least recently taken.  An AC we know
+ * nothing of is taken to have never failed.
+ */
+long disc_score(struct sess_ctx *s, struct pppoe_packet *packet,
+                const struct tags *tags)
+{
+    struct ac_rec *r;
+    unsigned char *p;
+    long score = s->sent - ev_now();
+#ifdef MULTIPLE_PPPOE
+    struct sysinfo info;
+    long age;
+#endif
+
+    p = (unsigned char *)(packet + 1);
+    if (opt_ac_name && tags_has(tags, p, TAG_AC_NAME, opt_ac_name))
+        score += DISC_NAME_BONUS;
+    if (service_name && tags_has(tags, p, TAG_SERVICE_NAME, service_name))
+        score += DISC_NAME_BONUS;
+#ifdef __linux__
+    r = ac_find((char *)packet->ethhdr.h_source, 0);
+#else
+    r = ac_find((char *)packet->ethhdr.ether_shost, 0);
+#endif
+    if (r == NULL)
+        return score;
+    if (r->pads + r->lost > 0)
+        score -= DISC_LOST_COST * r->lost / (r->pads + r->lost);
+#ifdef MULTIPLE_PPPOE
+    /*  Bob Guo added start 10/25/2007 */
+    sysinfo(&info);
+    if (r->used && (age = info.uptime - r->used) >= 0 &&
+        age < DISC_USED_AGE)
+        score -= DISC_USED_COST * (DISC_USED_AGE - age) / DISC_USED_AGE;
+    /*  Bob Guo added end 10/25/2007 */
+#endif
+    return score;
+}
+
+/* keep the PADO in packet if it is one of the two best so far */
+void disc_keep(struct sess_ctx *s, struct pppoe_packet *packet, int len,
+               const struct tags *tags, long score)
+{
+    struct disc_offer *o;
+    int i;
+
+    for (i = 0; i < s->noffers; i++)
+#ifdef __linux__
+        if (memcmp(s->offer[i].ac, packet->ethhdr.h_source, ETH_ALEN) == 0)
+#else
+        if (memcmp(s->offer[i].ac, packet->ethhdr.ether_shost, ETH_ALEN) == 0)
+#endif
+            return; /* it said so again */
+    if (s->noffers == 2 && score <= s->offer[1].score)
+        return;
+    if (s->noffers < 2)
+        s->noffers++;
+    o = &s->offer[s->noffers - 1];
+    if (s->noffers == 2 && score > s->offer[0].score) {
+        s->offer[1] = s->offer[0];
+        o = &s->offer[0];
+    }
+    disc_offer(o, packet, len, tags);
+    o->score = score;
+}
+
+/* the window is over for s: ask the AC of its best offer for a session */
+void disc_chosen(struct sess_ctx *s)
+{
+    /*  added start pling 12/20/2006 */
+    /* Touch a file on /tmp to indicate PADO is received */
+    if (1)
+    {
+        FILE *fp;
+        struct sysinfo info;
+#ifdef MULTIPLE_PPPOE
+        /* fprintf(stderr, "PPPOE%d: PADO received\n", ppp_ifunit); */
+#else
+        time_t tm;
+
+        /*  wklin modified start, 07/26/2007 */
+        /* system("echo \"DEBUG: PADO received\" > /dev/console"); */
+        time(&tm);
+        fprintf(stderr, "PPPOE: PADO received %s\n", ctime(&tm));
+        /*  wklin modified end, 07/26/2007 */
+#endif
+        if ((fp = fopen("/tmp/PADO", "w")) != NULL) {
+            sysinfo(&info);  /* save current time in file */
+            fprintf(fp, "%ld", info.uptime);
+            fclose(fp);
+        }
+    }
+    /*  added end ling 12/20/2006 */
+
+    memcpy(s->ac, s->offer[0].ac, ETH_ALEN);
+    s->pado_tags = s->offer[0].tags;
+    s->rival = opt_race && s->noffers == 2;
+    s->state = DISC_PADR_SENT;
+    disc_padr(s);
+}
+
+/* a PADO for s, with len bytes of TAGs indexed by tags */
+void disc_pado(struct sess_ctx *s, struct pppoe_packet *packet, int len,
+               const struct tags *tags)
+{
+    if (s->noffers == 0) {
+        ac_load();
+        /* which ends the PADIs too */
+        if (opt_pado_wait > 0)
+            ev_tmo_set(&s->timer, opt_pado_wait);
+    }
+    disc_keep(s, packet, len, tags, disc_score(s, packet, tags));
+    /* no need to wait for what cannot beat the best so far, but a race
+       needs two */
+    if (opt_pado_wait <= 0 ||
+        (!opt_race && s->offer[0].score >= disc_best() - (ev_now() - s->sent)))
+        disc_chosen(s);
+}
+
+/*
+ * How long s took to get its PADS, from our start or from the end of the
+ * session before, next to the counters of save_stats().
+ */
+void disc_stats(struct sess_ctx *s)
+{
+    FILE *fp;
+
+    if (!(fp = fopen(PPP_PPPOE_STATS, "a")))
+        return;
+    if (nsess > 1)
+        fprintf(fp, "discovery: %ld ms to PADS for session %d\n",
+                ev_now() - s->begun, (int)(s - sess_tab));
+    else
+        fprintf(fp, "discovery: %ld ms to PADS\n", ev_now() - s->begun);
+    fclose(fp);
+}
+
+/*
+ * The PPP payload a PADS, TAGs indexed by tags, leaves its session: what
+ * -m asked for if the AC says it back (RFC 4638), or what it says if that
+ * is less, and PPPOE_PAYLOAD if it says nothing.
+ */
+int pads_payload(struct pppoe_packet *packet, const struct tags *tags)
+{
+    const struct tag_view *v;
+    unsigned short n;
+
+    if (opt_payload == 0)
+        return PPPOE_PAYLOAD;
+    if ((v = tags_find(tags, TAG_PPP_MAX_PAYLOAD)) == NULL || v->len != sizeof(n)) {
+        fprintf(stderr, "pppoe: no PPP-Max-Payload in PADS, payload %d\n",
+                PPPOE_PAYLOAD);
+        return PPPOE_PAYLOAD;
+    }
+    memcpy(&n, (char *)(packet + 1) + v->off, sizeof(n));
+    n = ntohs(n);
+    if (n > opt_payload)
+        return opt_payload;
+    return n < PPPOE_PAYLOAD ? PPPOE_PAYLOAD : n;
+}
+
+void disc_pads(struct sess_ctx *s, struct pppoe_packet *packet,
+               const struct tags *tags)
+{
+    time_t tm;
+
+    /*  James added start, 11/12/2008 @new_internet_detection */
+#ifdef NEW_WANDETECT
+    if (bWanDetect)
+    {
+        FILE *fp;
+        struct sysinfo info;
+
+        time(&tm);
+        fprintf(stderr, "PPPOE: PADS received %s\n", ctime(&tm));
+        if ((fp = fopen("/tmp/PADS", "w")) != NULL) {
+            sysinfo(&info);  /* save current time in file */
+            fprintf(fp, "%ld", info.uptime);
+            fclose(fp);
+        }
+    }
+#endif
+    /*  James added end, 11/12/2008 @new_internet_detection */
+
+    /*  wklin added start, 07/31/2007 */
+    if (packet->session == 0) { /* PADS generic error */
+        if (s->stale_id && memcmp(s->ac, s->stale_ac, ETH_ALEN) == 0) {
+            /* the session from before may be in the way yet */
+            s->held = 1;
+            ev_tmo_set(&s->timer, 0);
+            return;
+        }
+        if (!disc_lost(s))
+            disc_fail(s); /* wait for 3 seconds and exit, retry */
+        return;
+    }
+    s->id = packet->session;
+    s->payload = pads_payload(packet, tags);
+
+    /*  add start, Max Ding, 04/23/2009 not use pppd to reduce memory usage */
+#ifdef NEW_WANDETECT
+    if (bWanDetect) 
+    {
+        /* Create PADT to end it */
+        sigint2(SIGUSR1);
+        /*cleanup_and_exit(0);*/
+    }
+#endif
+    /*  add end, Max Ding, 04/23/2009 */
+
+    time(&tm);
+#ifdef MULTIPLE_PPPOE
+    fprintf(stderr, "PPPOE%d: PADS received (%d) %s\n", 
+            s->unit, ntohs(s->id), ctime(&tm));
+#else
+    fprintf(stderr, "PPPOE: session id = %d, %s\n", htons(s->id), ctime(&tm));
+#endif
+    /*  wklin added end, 07/31/2007 */
+    ac_note(s->ac, 0);
+    if (s->stale_id && memcmp(s->ac, s->stale_ac, ETH_ALEN) == 0)
+        stale_done(s); /* it took the PADT before the PADR */
+
+    sess_start(s);
+    disc_stats(s);
+    /* no more retransmits, only the rival left to wait for */
+    ev_tmo_set(&s->timer, s->rival ? DISC_RIVAL_WAIT : 0);
+}
+
+/*
+ * An answer to the PADR s sent the rival: a PADS before that of the AC
+ * it chose makes it the winner, one after is ended at once.
+ */
+void disc_rival(struct sess_ctx *s, struct pppoe_packet *packet,
+                const struct tags *tags)
+{
+    struct disc_offer *o = &s->offer[1];
+    int pkt_size;
+
+    if (packet->code == CODE_PADS && packet->session != 0) {
+        if (s->state == DISC_PADR_SENT) {
+            disc_swap(s);
+            disc_pads(s, packet, tags);
+            return;
+        }
+        if ((pkt_size = create_padt(disc_pkt, src_addr, o->ac, packet->session,
+                                    &o->tags)) == 0 ||
+            send_packet(disc_sock, disc_pkt, pkt_size + 14) < 0)
+            fprintf(stderr, "pppoe: unable to send PADT packet\n");
+    } else if (packet->code == CODE_PADS)
+        ac_note(o->ac, 1); /* refused */
+    else if (packet->code != CODE_PADT)
+        return;
+    s->rival = 0;
+    set_filters();
+}
+
+/*
+ * The session an answer is for: the one its Host-Uniq names or, from an
+ * AC that leaves it out, the first waiting for such an answer.
+ */
+struct sess_ctx *disc_match(struct pppoe_packet *packet, const struct tags *tags,
+                            char *src)
+{
+    struct sess_ctx *s;
+    const struct tag_view *v;
+    unsigned short uniq;
+    int i;
+
+    if (nsess == 1)
+        return &sess_tab[0];
+    if ((v = tags_find(tags, TAG_HOST_UNIQ)) != NULL && v->len == sizeof(uniq)) {
+        memcpy(&uniq, (char *)(packet + 1) + v->off, sizeof(uniq));
+        i = ntohs(uniq) - 1;
+        return i >= 0 && i < nsess ? &sess_tab[i] : NULL;
+    }
+    for (i = 0; i < nsess; i++) {
+        s = &sess_tab[i];
+        if (packet->code == CODE_PADO ? s->state == DISC_PADI_SENT :
+            (s->state == DISC_PADR_SENT && memcmp(s->ac, src, ETH_ALEN) == 0) ||
+            (s->rival && memcmp(s->offer[1].ac, src, ETH_ALEN) == 0))
+            return s;
+    }
+    return NULL;
+}
+
+/* a packet from disc_sock, addressed to us */
+void disc_input(struct pppoe_packet *packet, int len)
+{
+    struct sess_ctx *s;
+    struct tags tags;
+    char *src;
+
+#ifdef __linux__
+    src = (char *)packet->ethhdr.h_source;
+#else
+    src = (char *)packet->ethhdr.ether_shost;
+#endif
+    if (len < (int)sizeof(*packet) || sess_padt(packet) || stale_padt(packet))
+        return;
+    /* the one pass over the TAGs; one running past the end spoils them all */
+    len = disc_payload(packet, len);
+    if (tags_parse(&tags, (unsigned char *)(packet + 1), len) < 0)
+        return;
+    if ((s = disc_match(packet, &tags, src)) == NULL)
+        return;
+    if (s->state == DISC_PADI_SENT) {
+        if (packet->code == CODE_PADO)
+            disc_pado(s, packet, len, &tags);
+#ifndef MULTIPLE_PPPOE
+        else
+            fprintf(log_file, "pppoe: unexpected packet %x\n", packet->code);
+#endif
+        return;
+    }
+    if (s->rival && memcmp(src, s->offer[1].ac, ETH_ALEN) == 0) {
+        disc_rival(s, packet, &tags);
+        return;
+    }
+    if (s->state != DISC_PADR_SENT || memcmp(src, s->ac, ETH_ALEN) != 0)
+        return;
+
+    /* a PADO answers one of our PADIs, and retransmits are up to us */
+    if (packet->code == CODE_PADS)
+        disc_pads(s, packet, &tags);
+    else if (packet->code == CODE_PADT) /* early termination */
+        disc_abort(s);
+}
+
+void disc_expired(struct ev_tmo *t)
+{
+    struct sess_ctx *s = t->arg;
+
+    switch (s->state) {
+    case DISC_PADI_SENT:
+        if (s->noffers) { /* no better offer came */
+            disc_chosen(s);
+            break;
+        }
+        disc_send(s);
+        break;
+    case DISC_PADR_SENT:
+        if (s->tries < (s->quick ? DISC_QUICK_TRIES : DISC_PADR_TRIES)) {
+            disc_send(s);
+            break;
+        }
+        s->rival = 0; /* no PADS from either */
+        disc_abort(s);
+        break;
+    case DISC_SESSION: /* the rival never answered */
+        s->rival = 0;
+        set_filters();
+        break;
+    case DISC_TERMINATING:
+#ifndef MULTIPLE_PPPOE
+        if (nsess == 1)
+            cleanup_and_exit(0);
+#endif
+        s->begun = ev_now();
+        disc_padi(s);
+        break;
+    }
+}
+
+/* disc_sock: answers to discovery, and PADTs */
+void disc_ready(struct ev_handler *h)
+{
+    static struct pppoe_packet *packet = NULL;
+    int pkt_size;
+
+    if (packet == NULL) {
+        packet = malloc(PACKETBUF);
+        assert(packet != NULL);
+    }
+    while (!sess_over &&
+           read_packet_nowait(disc_sock, packet, &pkt_size) == disc_sock) {
+#ifdef MULTIPLE_PPPOE
+        if (memcmp(packet->ethhdr.h_dest, src_addr, sizeof(src_addr))!=0){
+            /* fprintf(stderr, "pppoe: received a packet not for
+             * me.\n");*/
+            continue;
+        }
+#endif
+        disc_input(packet, pkt_size);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct pppoe_packet *packet = NULL;
     int fd; /* wklin added, 07/26/2007 */
 
-    int opt;
-    int ret_sock; /*  wklin added, 12/27/2007 */
+    int opt, i;
+    long begun = ev_now(); /* for disc_stats() */
+#ifdef MULTIPLE_PPPOE
+    int units = 0;
+#else
+    int in, out;
+#endif
 
     /*  wklin added start, 08/10/2007 */
-    fd_set allfdset;
 #ifndef MULTIPLE_PPPOE
     struct timeval alltm;
 #endif
     /*  wklin added end, 08/10/2007 */
-    time_t tm;
 
 #ifdef NEW_WANDETECT
     bWanDetect = 0;/*  added by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
@@ -1808,6 +3235,8 @@ int main(int argc, char **argv)
 
     /* initialize error_file here to avoid glibc2.1 issues */
      error_file = stderr;
+    /* FCS tables and scanners, before any thread could race for them */
+    hdlc_init();
 
     /*  wklin added start, 07/26/2007 */
     fd = open("/dev/console", O_WRONLY);
@@ -1815,14 +3244,17 @@ int main(int argc, char **argv)
         dup2(fd, 2);
     /*  wklin added end, 07/26/2007 */
 
+    /* the session pppd started us for, on stdin/stdout */
+    sess_add(0, 1, 0);
+
     /* parse options */
     /*  wklin modified, 03/27/2007, add service name option S */
 #ifdef MULTIPLE_PPPOE
     /* while ((opt = getopt(argc, argv, "I:L:VE:F:S:P:")) != -1) */
-    while ((opt = getopt(argc, argv, "I:L:VE:F:S:R:P:")) != -1)/*  modified by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
+    while ((opt = getopt(argc, argv, "I:L:VE:F:S:R:P:B:MTsb:Ur:w:A:xqm:")) != -1)/*  modified by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
 #else
     /* while ((opt = getopt(argc, argv, "I:L:VE:F:S:")) != -1) */
-    while ((opt = getopt(argc, argv, "I:L:VE:F:S:R:")) != -1)/*  modified by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
+    while ((opt = getopt(argc, argv, "I:L:VE:F:S:R:B:MTsb:Uc:r:w:A:xqm:")) != -1)/*  modified by Max Ding, 04/23/2009 not use pppd to reduce memory usage */
 #endif
 	switch(opt)
 	{
@@ -1856,19 +3288,92 @@ int main(int argc, char **argv)
             /* wklin added end, 01/15/2007 */
 #endif
 	    break;
-
-	case 'L': /* log file */
-	    opt_verbose = 1;
-	    if (log_file != NULL)
-		fclose(log_file);
-	    if ((log_file=fopen(optarg, "w")) == NULL)
+
+	case 'L': /* log file */
+	    opt_verbose = 1;
+	    if (log_file != NULL)
+		fclose(log_file);
+	    if ((log_file=fopen(optarg, "w")) == NULL)
+	    {
+		fprintf(stderr, "fopen\n");
+		exit(1);
+	    }
+	    if (setvbuf(log_file, NULL, _IONBF, 0) != 0)
+	    {
+		fprintf(stderr, "setvbuf\n");
+		exit(1);
+	    }
+	    break;
+	case 'M': /* read session frames from a mapped ring */
+	    opt_ring = 1;
+	    break;
+	case 'T': /* build uplink frames in a mapped ring */
+	    opt_txring = 1;
+	    break;
+	case 's': /* pppd runs with 'sync': unframed PPP on the pty */
+	    opt_sync = 1;
+	    break;
+	case 'U': /* sess_sock and the pty through io_uring */
+	    opt_uring = 1;
+	    break;
+#ifndef MULTIPLE_PPPOE
+	case 'c': /* one more session, its pppd on these descriptors */
+	    if ((i = sscanf(optarg, "%d,%d", &in, &out)) < 1 || in < 0 ||
+	        (i == 2 && out < 0))
+	    {
+		fprintf(stderr, "Invalid channel %s\n", optarg);
+		exit(1);
+	    }
+	    sess_add(in, i == 2 ? out : in, nsess);
+	    break;
+#endif
+	case 'b': /* kilobytes of buffer when pppd is on a pipe or socket */
+	    opt_pipebuf = atoi(optarg) * 1024;
+	    if (opt_pipebuf <= 0)
+	    {
+		fprintf(stderr, "Invalid buffer size %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'r': /* discovery retransmits: first wait, and the longest */
+	    if ((i = sscanf(optarg, "%ld,%ld", &opt_rto, &opt_rto_max)) < 1 ||
+	        opt_rto <= 0 || (i == 2 && opt_rto_max < opt_rto))
 	    {
-		fprintf(stderr, "fopen\n");
+		fprintf(stderr, "Invalid retransmit time %s\n", optarg);
 		exit(1);
 	    }
-	    if (setvbuf(log_file, NULL, _IONBF, 0) != 0)
+	    if (i == 1 && opt_rto_max < opt_rto)
+		opt_rto_max = opt_rto;
+	    break;
+	case 'w': /* ms for more PADOs to come after the first */
+	    if (sscanf(optarg, "%ld", &opt_pado_wait) != 1 || opt_pado_wait < 0)
 	    {
-		fprintf(stderr, "setvbuf\n");
+		fprintf(stderr, "Invalid PADO window %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'A': /* AC-Name preferred */
+	    opt_ac_name = optarg;
+	    break;
+	case 'x': /* PADR to the two best ACs */
+	    opt_race = 1;
+	    break;
+	case 'q': /* PADR to the AC of the last session first */
+	    opt_quick = 1;
+	    break;
+	case 'm': /* PPP-Max-Payload to ask for */
+	    opt_payload = atoi(optarg);
+	    if (opt_payload < PPPOE_PAYLOAD || opt_payload > PPPOE_PAYLOAD_MAX)
+	    {
+		fprintf(stderr, "Invalid PPP payload %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'B': /* session frames taken per system call */
+	    opt_batch = atoi(optarg);
+	    if (opt_batch < 1 || opt_batch > PKTIO_BATCH)
+	    {
+		fprintf(stderr, "Invalid batch size %s\n", optarg);
 		exit(1);
 	    }
 	    break;
@@ -1906,7 +3411,14 @@ int main(int argc, char **argv)
 #ifdef MULTIPLE_PPPOE
         /*  wklin added start, 08/16/2007, service name */
     case 'P': /* ppp ifunit */
-        ppp_ifunit = 1;
+        /* the first is for the session on stdin/stdout, any other one
+           adds a session the kernel channel carries alone */
+        if (sscanf(optarg, "%d", &i) != 1 || i < 0)
+            i = 1;
+        if (units++ == 0)
+            sess_opts[0].unit = i;
+        else
+            sess_add(-1, -1, i);
         break;
         /*  wklin added end, 08/16/2007 */
 #endif
@@ -1922,17 +3434,26 @@ int main(int argc, char **argv)
 	    exit(1);
 	}
 
+    sess_init();
+
     /* allocate packet once */
     packet = malloc(PACKETBUF);
     assert(packet != NULL);
+    disc_pkt = packet;
 
-    /* create the raw socket we need */
-
-    signal(SIGINT, sigint);
-    signal(SIGTERM, sigint);
+    /* signals wait for the event loop, so they never cut into a packet */
+    if (ev_init() < 0)
+        exit(1);
+    if (ev_signal(&sig_ev, ev_sigs, sizeof(ev_sigs) / sizeof(ev_sigs[0]),
+                  sig_ready, NULL) < 0) {
+        signal(SIGINT, sigint);
+        signal(SIGTERM, sigint);
 #ifdef NEW_WANDETECT
-    signal(SIGUSR1, sigint2);/* added James 11/11/2008 @new_internet_detection*/
+        signal(SIGUSR1, sigint2);/* added James 11/11/2008 @new_internet_detection*/
 #endif
+    }
+
+    /* create the raw socket we need */
 
 #ifndef MULTIPLE_PPPOE
 #ifdef NEW_WANDETECT
@@ -1940,7 +3461,8 @@ int main(int argc, char **argv)
 #endif
     {
         /*  added start, Winster Chan, 06/26/2006 */
-        pptp_pppox_open(&poxfd, &pppfd);
+        for (i = 0; i < nsess; i++)
+            pptp_pppox_open(&sess_tab[i].poxfd, &sess_tab[i].pppfd);
         /*  added end, Winster Chan, 06/26/2006 */
     }
 #endif
@@ -1954,494 +3476,33 @@ int main(int argc, char **argv)
 		return 1;
 #endif
     }
-#ifdef MULTIPLE_PPPOE
-    /* initiate connection */
-    if (ppp_ifunit == 0)
-        fp = fopen(PPP_PPPOE_SESSION, "r"); 
-    else /* ifunit == 1 */
-	fp = fopen(PPP_PPPOE2_SESSION, "r");
-
-    if (fp) {
-#else
-    /* initiate connection */
-
-    /*  added start Winster Chan 12/05/2005 */
-    if (!(fp = fopen(PPP_PPPOE_SESSION, "r"))) {
-        ; /* perror(PPP_PPPOE_SESSION); */ /*  wklin removed, 08/13/2007 */
-    }
-    else {
-#endif
-        unsigned int nMacAddr[ETH_ALEN];
-        int nSessId, i;
-        char cMacAddr[ETH_ALEN];
-        unsigned short usSessId;
-
-        /* Init variables */
-        for (i=0; i<ETH_ALEN; i++) {
-            nMacAddr[i] = 0;
-            cMacAddr[i] = 0x0;
-        }
-        nSessId = 0;
-
-        /* Get the PPPoE server MAC address and Session ID from file */
-        if(fgets(buf, sizeof(buf), fp)) {
-            sscanf(buf, "%02x:%02x:%02x:%02x:%02x:%02x %d",
-                &nMacAddr[0], &nMacAddr[1], &nMacAddr[2],
-                &nMacAddr[3], &nMacAddr[4], &nMacAddr[5],
-                &nSessId);
-
-            /* Transfer types of data */
-            for (i=0; i<ETH_ALEN; i++) {
-                cMacAddr[i] = (char)nMacAddr[i];
-            }
-            usSessId = (unsigned short)nSessId;
-
-            /* Check if the previous MAC address and Session ID exist. */
-            if (!((cMacAddr[0]==0x0) && (cMacAddr[1]==0x0) && (cMacAddr[2]==0x0) &&
-                 (cMacAddr[3]==0x0) && (cMacAddr[4]==0x0) && (cMacAddr[5]==0x0)) &&
-                (htons(usSessId) != 0x0)) {
-                    
-                /* send PADT to server to clear the previous connection */
-                if ((pkt_size = create_padt(packet, src_addr, cMacAddr,
-                                    (unsigned short)htons(usSessId))) == 0) {
-          	        fprintf(stderr, "pppoe: unable to create PADT packet\n");
-                    fclose(fp);
-                    /*exit(1);*/
-#ifdef MULTIPLE_PPPOE
-                    exit(1);
-#else
-                    cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
-#endif
-                }
-                if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
-                    fprintf(stderr, "pppoe: unable to send PADT packet\n");
-                    fclose(fp);
-#ifdef MULTIPLE_PPPOE
-                    exit(1);
-#else
-                    /*exit(1);*/
-                    cleanup_and_exit(1); /*  modified by EricHuang, 05/24/2007 */
-#endif
-                } else {
-#ifdef MULTIPLE_PPPOE
-                    ; /* fprintf(stderr, "PPPOE: PADT sent\n"); */
-#else
-                    time(&tm);
-                    fprintf(stderr, "PPPOE: PADT sent %s\n",ctime(&tm)); /*  wklin added, 07/26/2007 */
-#endif
-                }
-
-                /*  modified start, Winster Chan, 06/26/2006 */
-                /*pptp_pppox_release(&poxfd, &pppfd);*/ /*  removed by EricHuang, 05/24/2007 */
-                /*  modified end, Winster Chan, 06/26/2006 */
-
-                /* Waiting 3 seconds for server finishing the termination */
-                sleep(3);
-            }
-        }
-        fclose(fp);
-    }
-    /*  added end Winster Chan 12/05/2005 */
-#ifdef MULTIPLE_PPPOE
-    memset(dst_addr, 0, sizeof(dst_addr));
-
-resend_padi:
-#endif
-    /* start the PPPoE session */
-    /*  wklin modified, 03/27/2007, add service name */
-    if ((pkt_size = create_padi(packet, src_addr, service_name)) == 0) {
-	fprintf(stderr, "pppoe: unable to create PADI packet\n");
-	exit(1);
-    }
-    /* send the PADI packet */
-    if (send_packet(disc_sock, packet, pkt_size, if_name) < 0) {
-	fprintf(stderr, "pppoe: unable to send PADI packet\n");
-	exit(1);
-    }
-
-    time(&tm); /*  wklin added, 12/27/2007 */
-    /* wait for PADO */
-    while ((ret_sock = read_packet(disc_sock, packet, &pkt_size)) != disc_sock ||
-	   (packet->code != CODE_PADO )) { /*  wklin modified, 12/27/2007 */
-#ifndef MULTIPLE_PPPOE
-	fprintf(log_file, "pppoe: unexpected packet %x\n",
-		packet->code);
-#endif
-	/*  wklin added start, 12/27/2007 */
-	if (ret_sock == disc_sock &&
-		(packet->code == CODE_PADI || packet->code == CODE_PADR)) {
-	    if (time(NULL) - tm < 3)
-		continue;
-
-	}
-	/*  wklin added end, 12/27/2007 */
-	/* wklin added start, 01/10/2007 */
-    	/* fprintf(stderr, "pppoe: resend PADI\n"); */
-    	/* start the PPPoE session */
-        /*  wklin modified, 03/27/2007, add service name */
-    	if ((pkt_size = create_padi(packet, src_addr, service_name)) == 0) {
-		fprintf(stderr, "pppoe: unable to create PADI packet\n");
-		exit(1);
-    	}
-    	/* send the PADI packet */
-    	if (send_packet(disc_sock, packet, pkt_size, if_name) < 0) {
-		fprintf(stderr, "pppoe: unable to send PADI packet\n");
-		exit(1);
-    	}
-	/* wklin added end, 01/10/2007 */
-	time(&tm); /*  wklin added, 12/27/2007 */
-#ifndef MULTIPLE_PPPOE
-	continue;
-#endif
-    }
-#ifdef MULTIPLE_PPPOE
-    /*  Bob Guo added start 10/25/2007 */
-    
-    iOldestTimeStamp = checkServerRecord(packet->ethhdr.h_source);
-    if(iOldestTimeStamp)
-    {
-        packet2 = malloc(PACKETBUF);
-        if(packet2)
-        {
-            while( read_packet(disc_sock, packet2, &pkt2_size) == disc_sock )
-            {
-                if(packet2->code == CODE_PADO)
-                {
-                    iTimeStamp = checkServerRecord(packet2->ethhdr.h_source);
-                    if(iTimeStamp < iOldestTimeStamp)
-                    {
-                        packet_temp = packet;
-                        packet = packet2;
-                        packet2 = packet_temp;
-                        pkt_size = pkt2_size;
-                    }
-                }
-            }
-            free(packet2);
-        }
-    }
-    /*  Bob Guo added end 10/25/2007 */
-#endif
-    /*  added start pling 12/20/2006 */
-    /* Touch a file on /tmp to indicate PADO is received */
-    if (1)
-    {
-        FILE *fp;
-        struct sysinfo info;
-#ifdef MULTIPLE_PPPOE
-        /* fprintf(stderr, "PPPOE%d: PADO received\n", ppp_ifunit); */
-#else
-        /*  wklin modified start, 07/26/2007 */
-        /* system("echo \"DEBUG: PADO received\" > /dev/console"); */
-        time(&tm);
-        fprintf(stderr, "PPPOE: PADO received %s\n", ctime(&tm));
-        /*  wklin modified end, 07/26/2007 */
-#endif
-        if ((fp = fopen("/tmp/PADO", "w")) != NULL) {
-            sysinfo(&info);  /* save current time in file */
-            fprintf(fp, "%ld", info.uptime);
-            fclose(fp);
-        }
-    }
-    /*  added end ling 12/20/2006 */
-
-
-#ifdef __linux__
-    memcpy(dst_addr, packet->ethhdr.h_source, sizeof(dst_addr));
-#else
-    memcpy(dst_addr, packet->ethhdr.ether_shost, sizeof(dst_addr));
-#endif
-    /*  added start Winster Chan 11/25/2005 */
-    /* Stored tags of PADO */
-    memset(pado_tags, 0x0, sizeof(pado_tags));
-    if ((htons(packet->length) < 0) || (htons(packet->length) > sizeof(pado_tags))) {
-        pado_tag_size = sizeof(pado_tags);
-    }
-    else {
-        pado_tag_size = (int)(htons(packet->length));
-    }
-    memcpy((char *)pado_tags, (char *)(packet + 1), pado_tag_size);
-    /*  added end Winster Chan 11/25/2005 */
-
-    /* send PADR */
-    /*  wklin modified, 03/27/2007, add service name */
-    if ((pkt_size = create_padr(packet, src_addr, dst_addr, service_name)) == 0) {
-	fprintf(stderr, "pppoe: unable to create PADR packet\n");
-	exit(1);
-    }
-    if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
-	fprintf(stderr, "pppoe: unable to send PADR packet\n");
-	exit(1);
-    }
-
-    /*  wklin modified start, 07/31/2008 */
-    /* 0. Process only packets from our target pppoe server.
-     * 1. track the time when sending PADR.
-     * 2. If received PADO, resend PADR (needed?).
-     * 3. If retried for 5 times, send PADT.
-     * 4. If wait for more than 10 seconds after sending the previous PADR, 
-     *    send PADT.
-     */
-    time(&tm);
-    /* wait for PADS */
-#ifdef __linux__
-    while ((ret_sock=read_packet(disc_sock, packet, &pkt_size)) != disc_sock ||
-            (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr)) != 0) || 
-            (packet->code != CODE_PADS && packet->code != CODE_PADT))
-#else
-    while (read_packet(disc_sock, packet, &pkt_size) != disc_sock ||
-	   (memcmp(packet->ethhdr.ether_shost,
-		   dst_addr, sizeof(dst_addr)) != 0))
-#endif
-    {
-        static int retried=0; /* wklin added, 01/26/2007 */
-
-        if (ret_sock != disc_sock) {
-            if (time(NULL)-tm > 10) {
-                retried = 0;
-                packet->code = CODE_PADT;  /* fake packet */
-                break;
-            }
-            else
-                continue;
-        }
-        /* Resend PADR only if it's from our target pppoe server and 
-         * the code is PADO, otherwise ignore the received packet.
-         */
-        if (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr)) == 0) {
-            if (packet->code != CODE_PADO) { /* PADI? PADR? */
-                retried = 0;
-                packet->code = CODE_PADT; /* fake packet */
-                break;
-            }
-
-            /* Received PADO */
-            if (retried++ == 5) {
-                retried = 0;
-                packet->code = CODE_PADT; 
-                break;
-            }
-
-            /*  add start James 04/10/2009 */
-            /*if we recieve two PADO(from the same MAC) in 2 seconds, we only send one PADR.*/
-            if (time(NULL) - tm < 2)
-                continue;
-            /*  add end James 04/10/2009 */
-
-            /* send PADR */
-            /*  wklin modified, 03/27/2007, add service name */
-            if ((pkt_size = create_padr(packet, src_addr, dst_addr, service_name)) == 0) {
-	        fprintf(stderr, "pppoe: unable to create PADR packet\n");
-                exit(1);
-            }
-            if (send_packet(disc_sock, packet, pkt_size+14, if_name) < 0) {
-	        fprintf(stderr, "pppoe: unable to send PADR packet\n");
-                exit(1);
-            }
-            time(&tm); /* track the time when sending PADR */
-        }
-        /* else.. packets not from target server */
-#ifndef MULTIPLE_PPPOE
-        /* wklin modified end, 01/26/2007 */        
-        continue;
-#endif
-    } /* end while waiting PADS */
-    /*  wklin modified end, 07/31/2008 */
-
-    /*  James added start, 11/12/2008 @new_internet_detection */
-#ifdef NEW_WANDETECT
-    if (bWanDetect && packet->code == CODE_PADS)
-    {
-        FILE *fp;
-        struct sysinfo info;
-
-        time(&tm);
-        fprintf(stderr, "PPPOE: PADS received %s\n", ctime(&tm));
-        if ((fp = fopen("/tmp/PADS", "w")) != NULL) {
-            sysinfo(&info);  /* save current time in file */
-            fprintf(fp, "%ld", info.uptime);
-            fclose(fp);
-        }
-    }
-#endif
-    /*  James added end, 11/12/2008 @new_internet_detection */
-
-    if (packet->code == CODE_PADT) /* early termination */
-    {
-#ifdef MULTIPLE_PPPOE
-        sleep(3);
-        goto resend_padi;
-#else
-	    cleanup_and_exit(0);
-#endif
-    }
-
-    session = packet->session;
-
-    /*  wklin added start, 07/31/2007 */
-    if (session == 0) { /* PADS generic error */
-        sleep(3); /* wait for 3 seconds and exit, retry */
-#ifdef MULTIPLE_PPPOE
-		goto resend_padi;
-#else
-	    cleanup_and_exit(0);
-#endif
-    }
-
-    /*  add start, Max Ding, 04/23/2009 not use pppd to reduce memory usage */
-#ifdef NEW_WANDETECT
-    if (bWanDetect) 
-    {
-        /* Create PADT to end it */
-        sigint2(SIGUSR1);
-        /*cleanup_and_exit(0);*/
-    }
-#endif
-    /*  add end, Max Ding, 04/23/2009 */
-
-    time(&tm);
-#ifdef MULTIPLE_PPPOE
-    fprintf(stderr, "PPPOE%d: PADS received (%d) %s\n", 
-            ppp_ifunit, ntohs(session), ctime(&tm));
-    /*  Bob Guo added start 10/25/2007*/            
-    updateServerRecord(packet->ethhdr.h_source);
-    /*  Bob Guo added end 10/25/2007*/
-#else
-    fprintf(stderr, "PPPOE: session id = %d, %s\n", htons(session), ctime(&tm));
-#endif
-
-    /*  wklin added end, 07/31/2007 */
-
-    if ((sess_sock = open_interface(if_name,ETH_P_PPPOE_SESS,NULL)) < 0) {
-    	fprintf(log_file, "pppoe: unable to create raw socket\n");
-#ifdef MULTIPLE_PPPOE
+    payload_fit(disc_sock);
+    set_filters();
+    if (ev_add(&disc_ev, disc_sock, EV_IN, disc_ready, NULL) < 0)
         exit(1);
-#else
-    	cleanup_and_exit(1);
-#endif
-    }
-
-    /*  added start, Winster Chan, 06/26/2006 */
-    memcpy(dstMac, dst_addr, ETH_ALEN);
-    sessId = packet->session;
-
-    /* Connect pptp kernel module */
-
-#ifdef MULTIPLE_PPPOE
-    pptp_pppox_open(&poxfd, &pppfd);
-
-    if (poxfd == -1) {
-        fprintf(stderr, "pppoe: poxfd == -1\n");
-        cleanup_and_exit(1);
-        /*
-	    close(poxfd);
-	    exit(1);*/
-    }
-
-    if (pppfd == -1) {
-        fprintf(stderr, "pppoe: pppfd == -1\n");
-        cleanup_and_exit(1);
-        /*
-	    close(pppfd);
-	    exit(1);*/
-    }
-
-    if ( 0 > pptp_pppox_connect(&poxfd, &pppfd)) {
-        fprintf(stderr, "error connect to pppox\n");
-        cleanup_and_exit(1);
-        
-	
-	/*
-	exit(1);*/
-    }
-
-    if (ppp_ifunit == 0)
-        fp = fopen(PPP_PPPOE_SESSION, "w+");
-    else
-        fp = fopen(PPP_PPPOE2_SESSION, "w+");
-
-    if (fp) {
-        /* Save the PPPoE server MAC address and Session ID */
-        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
-            (unsigned char)(dst_addr[0]), (unsigned char)(dst_addr[1]),
-            (unsigned char)(dst_addr[2]), (unsigned char)(dst_addr[3]),
-            (unsigned char)(dst_addr[4]), (unsigned char)(dst_addr[5]),
-            (int)htons(session));
-        fclose(fp);
+    for (i = 0; i < nsess; i++) {
+        ev_tmo(&sess_tab[i].timer, disc_expired, &sess_tab[i]);
+        ev_tmo(&sess_tab[i].stale_tmo, stale_expired, &sess_tab[i]);
     }
-#else
+    /* initiate connection, while whatever was left of us before is
+       ended */
+    for (i = 0; i < nsess; i++)
+        sess_stale(&sess_tab[i]);
 
-    /*  wklin modified start, 07/31/2007 */
-    if ( 0 > pptp_pppox_connect(&poxfd, &pppfd))
-        cleanup_and_exit(1);
-    /*  wklin modified end, 07/31/2007 */
-    /*  added end, Winster Chan, 06/26/2006 */
-
-    /*  added start Winster Chan 12/05/2005 */
-    if (!(fp = fopen(PPP_PPPOE_SESSION, "w"))) {
-        perror(PPP_PPPOE_SESSION);
-    }
-    else {
-        /* Save the PPPoE server MAC address and Session ID */
-        fprintf(fp, "%02x:%02x:%02x:%02x:%02x:%02x %d\n",
-            (unsigned char)(dst_addr[0]), (unsigned char)(dst_addr[1]),
-            (unsigned char)(dst_addr[2]), (unsigned char)(dst_addr[3]),
-            (unsigned char)(dst_addr[4]), (unsigned char)(dst_addr[5]),
-            (int)htons(session));
-        fclose(fp);
-    }
-    /*  added end Winster Chan 12/05/2005 */
-#endif
     clean_child = 0;
     signal(SIGCHLD, sigchild);
 
-    while (1) {
-	    FD_ZERO(&allfdset);
-	    FD_SET(sess_sock, &allfdset);
-	    FD_SET(disc_sock, &allfdset);
-	    FD_SET(0, &allfdset);
-	    if (select((sess_sock>disc_sock?sess_sock:disc_sock) + 1, &allfdset, 
-                    (fd_set *) NULL, (fd_set *) NULL, NULL) <= 0)
-            continue; /* timeout or error */
-
-        if (FD_ISSET(disc_sock, &allfdset)) {
-#ifdef MULTIPLE_PPPOE
-            if (read_packet_nowait(disc_sock, packet, &pkt_size) == disc_sock) {
-		        if (memcmp(packet->ethhdr.h_dest, src_addr, sizeof(src_addr))!=0){
-		            /* fprintf(stderr, "pppoe: received a packet not for
-		            * me.\n");*/
-		            continue;
-		        }
-                if (packet->code == CODE_PADT && packet->session == session) {
-                    time(&tm);
-                    fprintf(stderr, "PPPOE%d: PADT received (%d) %s\n", ppp_ifunit, ntohs(session), ctime(&tm));
-                    break; /* go terminate */
-		        }
-            }   
-#else
-            if ((read_packet2(disc_sock, packet, &pkt_size) == disc_sock) &&
-	       (memcmp(packet->ethhdr.h_source, dst_addr, sizeof(dst_addr))==0)){
-                if (packet->code == CODE_PADT) {
-                    time(&tm);
-                    fprintf(stderr, "PPPOE: PADT received (%d/%d), %s\n", 
-                        ntohs(packet->session), ntohs(session),ctime(&tm));
-                } 
-                if (packet->code == CODE_PADT && packet->session == session)
-                    break; /* cleanup and exit */
-            }   
-#endif
-        }
-
-        if (FD_ISSET(sess_sock, &allfdset)) {
-            sess_handler();
-        }
+    /* all sessions at once; the loop takes it from there */
+    srand(getpid() ^ time(NULL)); /* retransmit jitter */
+    for (i = 0; i < nsess; i++) {
+        sess_tab[i].begun = begun;
+        if (!opt_quick || !disc_resume(&sess_tab[i]))
+            disc_padi(&sess_tab[i]);
+    }
 
-        if (FD_ISSET(0, &allfdset)) {
-            pppd_handler();
-        }
-    }   
+    while (!sess_over)
+        if (ev_run(-1) < 0)
+            break;
     cleanup_and_exit(0); /*  wklin added, 08/10/2007 */
     return 0;
 }
-
-
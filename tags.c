@@ -0,0 +1,141 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * TAGs of discovery packets (RFC 2516 5), read in place and built in place
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <string.h>
+
+#include "tags.h"
+
+/* TAG_TYPE and TAG_LENGTH, both in network order */
+#define TAG_HDR         4
+#define TAG_END_OF_LIST 0x0000
+
+/*
+ * Index the len bytes of TAGs at p.  Returns -1 if a TAG runs past the
+ * end, which makes the packet one to drop; an End-Of-List TAG ends them
+ * early.
+ */
+int tags_parse(struct tags *t, const unsigned char *p, int len)
+{
+    int off = 0, type, n;
+
+    t->n = 0;
+    while (len - off >= TAG_HDR) {
+        type = p[off] << 8 | p[off + 1];
+        n = p[off + 2] << 8 | p[off + 3];
+        if (type == TAG_END_OF_LIST)
+            return 0;
+        off += TAG_HDR;
+        if (len - off < n)
+            return -1;
+        if (t->n < TAGS_MAX) {
+            t->tag[t->n].type = type;
+            t->tag[t->n].len = n;
+            t->tag[t->n].off = off;
+            t->n++;
+        }
+        off += n;
+    }
+    return off == len ? 0 : -1;
+}
+
+/* the first TAG of type, or NULL */
+const struct tag_view *tags_find(const struct tags *t, unsigned short type)
+{
+    int i;
+
+    for (i = 0; i < t->n; i++)
+        if (t->tag[i].type == type)
+            return &t->tag[i];
+    return NULL;
+}
+
+/* 1 if one of the TAGs of type at p says val */
+int tags_has(const struct tags *t, const unsigned char *p,
+             unsigned short type, const char *val)
+{
+    int i, n = strlen(val);
+
+    for (i = 0; i < t->n; i++)
+        if (t->tag[i].type == type && t->tag[i].len == n &&
+            memcmp(p + t->tag[i].off, val, n) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Keep the len bytes of TAGs at p, indexed by t, or indexed now if t is
+ * NULL (p may be tb->buf then).  Returns -1 if they do not fit, or do not
+ * parse, and tb is left empty.
+ */
+int tag_buf_set(struct tag_buf *tb, const unsigned char *p, int len,
+                const struct tags *t)
+{
+    if (len < 0 || len > (int)sizeof(tb->buf))
+        goto none;
+    if (p != tb->buf)
+        memcpy(tb->buf, p, len);
+    if (t != NULL)
+        memcpy(&tb->idx, t, sizeof(tb->idx.n) + t->n * sizeof(t->tag[0]));
+    else if (tags_parse(&tb->idx, tb->buf, len) < 0)
+        goto none;
+    tb->len = len;
+    return 0;
+none:
+    tb->len = 0;
+    tb->idx.n = 0;
+    return -1;
+}
+
+void tag_out_init(struct tag_out *o, void *buf, int room)
+{
+    o->start = o->p = buf;
+    o->end = o->start + room;
+}
+
+void tag_add(struct tag_out *o, unsigned short type, const void *val, int len)
+{
+    if (o->p == NULL)
+        return;
+    if (len < 0 || len > 0xffff || o->end - o->p < TAG_HDR + len) {
+        o->p = NULL;
+        return;
+    }
+    o->p[0] = type >> 8;
+    o->p[1] = type & 0xff;
+    o->p[2] = len >> 8;
+    o->p[3] = len & 0xff;
+    if (len > 0)
+        memcpy(o->p + TAG_HDR, val, len);
+    o->p += TAG_HDR + len;
+}
+
+/* the TAG of type kept in tb, as it is, if there is one */
+void tag_copy(struct tag_out *o, const struct tag_buf *tb, unsigned short type)
+{
+    const struct tag_view *v;
+
+    if (tb != NULL && (v = tags_find(&tb->idx, type)) != NULL)
+        tag_add(o, type, tb->buf + v->off, v->len);
+}
+
+/* bytes of TAGs written, or -1 if they did not all fit */
+int tag_out_len(const struct tag_out *o)
+{
+    return o->p != NULL ? (int)(o->p - o->start) : -1;
+}
@@ -0,0 +1,76 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * TAGs of discovery packets (RFC 2516 5), read in place and built in place
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PPPOE_TAGS_H_
+#define _PPPOE_TAGS_H_
+
+/* TAGs of a discovery packet at most: an Ethernet payload less the
+   PPPoE header */
+#define TAGS_ROOM       1494
+/* TAGs indexed per packet; any after these are left out */
+#define TAGS_MAX        64
+
+/* a TAG where it is: its value is len bytes, off bytes into the TAGs */
+struct tag_view {
+    unsigned short  type;
+    unsigned short  len;
+    unsigned short  off;
+};
+
+/*
+ * Index of the TAGs of one packet, made in a single pass by tags_parse().
+ * Values are read where they are and never copied out.  Offsets rather
+ * than pointers keep the index good for a copy of the TAGs, so every
+ * lookup is handed the TAGs it is about.
+ */
+struct tags {
+    int             n;
+    struct tag_view tag[TAGS_MAX];
+};
+
+int tags_parse(struct tags *t, const unsigned char *p, int len);
+const struct tag_view *tags_find(const struct tags *t, unsigned short type);
+int tags_has(const struct tags *t, const unsigned char *p,
+             unsigned short type, const char *val);
+
+/* the TAGs of a packet kept for later, a PADO's for its PADR and PADT */
+struct tag_buf {
+    int             len;
+    struct tags     idx;
+    unsigned char   buf[TAGS_ROOM];
+};
+
+int tag_buf_set(struct tag_buf *tb, const unsigned char *p, int len,
+                const struct tags *t);
+
+/*
+ * TAGs written straight into the packet going out.  Running out of room
+ * is remembered, and tag_out_len() reports it once at the end, so the
+ * TAGs are added without checking each one.
+ */
+struct tag_out {
+    unsigned char   *start, *p, *end; /* p is NULL once out of room */
+};
+
+void tag_out_init(struct tag_out *o, void *buf, int room);
+void tag_add(struct tag_out *o, unsigned short type, const void *val, int len);
+void tag_copy(struct tag_out *o, const struct tag_buf *tb, unsigned short type);
+int  tag_out_len(const struct tag_out *o);
+
+#endif /* _PPPOE_TAGS_H_ */
@@ -0,0 +1,221 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * Data threads and the lock-free rings between them
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* sigaction(), CPU affinity and friends are not ANSI */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#include "thread.h"
+
+/* interrupts whatever system call a thread is blocked in */
+#define WORKER_KICK SIGUSR2
+
+static pthread_t control;
+
+static void kicked(int sig)
+{
+}
+
+/*
+ * Once, from the control thread, before any worker starts.  Workers wake
+ * it up when they return, so it should not block WORKER_KICK either.
+ */
+int worker_init(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = kicked;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;            /* no SA_RESTART: that is the point */
+    if (sigaction(WORKER_KICK, &sa, NULL) < 0) {
+	perror("pppoe: sigaction (worker_init)");
+	return -1;
+    }
+    control = pthread_self();
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    sigset_t set;
+
+    /* process signals are the control thread's business */
+    sigemptyset(&set);
+    sigaddset(&set, WORKER_KICK);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    w->fn(w);
+
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    pthread_kill(control, WORKER_KICK);
+    return NULL;
+}
+
+int worker_start(struct worker *w, void (*fn)(struct worker *w), int cpu)
+{
+    sigset_t all, old;
+    cpu_set_t cpus;
+    int err;
+
+    memset(w, 0, sizeof(*w));
+    w->fn = fn;
+    w->cpu = cpu;
+    /* born with every signal blocked, so none lands in it by accident */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&w->id, NULL, worker_main, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+	errno = err;
+	perror("pppoe: pthread_create (worker_start)");
+	return -1;
+    }
+    w->started = 1;
+
+    if (cpu >= 0) {
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if ((err = pthread_setaffinity_np(w->id, sizeof(cpus), &cpus)) != 0) {
+	    errno = err;
+	    perror("pppoe: pthread_setaffinity_np (worker_start)");
+	}
+    }
+    return 0;
+}
+
+/*
+ * Ask w to return and wait up to ms for it.  It is kicked again every
+ * millisecond, since a kick that comes just before it blocks is lost.
+ * Returns -1 if it is still running, which exit() takes care of.
+ */
+int worker_stop(struct worker *w, int ms)
+{
+    struct timespec ts;
+
+    if (!w->started)
+	return 0;
+    __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000;
+    while (!worker_done(w)) {
+	if (ms-- <= 0)
+	    return -1;
+	pthread_kill(w->id, WORKER_KICK);
+	nanosleep(&ts, NULL);
+    }
+    pthread_join(w->id, NULL);
+    w->started = 0;
+    return 0;
+}
+
+/*
+ * Take the n signals in sigs away from asynchronous delivery to the
+ * calling thread, and have them read from the descriptor returned, or -1.
+ * Workers are born with every signal blocked, so they all end up there.
+ */
+int worker_sigfd(const int *sigs, int n)
+{
+    sigset_t set;
+    int i, fd;
+
+    sigemptyset(&set);
+    for (i = 0; i < n; i++)
+	sigaddset(&set, sigs[i]);
+    /* blocked first, or one could slip through in between */
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if ((fd = signalfd(-1, &set, SFD_NONBLOCK)) < 0) {
+	perror("pppoe: signalfd (worker_sigfd)");
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    }
+    return fd;
+}
+
+/* next signal pending on fd from worker_sigfd(), 0 once there is none */
+int worker_sigread(int fd)
+{
+    struct signalfd_siginfo si;
+
+    if (read(fd, &si, sizeof(si)) != sizeof(si))
+	return 0;
+    return (int)si.ssi_signo;
+}
+
+/* ms on a clock that only goes forward, to tell how long something took */
+long worker_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int spsc_init(struct spsc *q, int n, int size)
+{
+    memset(q, 0, sizeof(*q));
+    if ((q->buf = malloc((size_t)n * size)) == NULL)
+	return -1;
+    q->mask = n - 1;
+    q->size = size;
+    return 0;
+}
+
+/* producer: room for the next entry, NULL when the ring is full */
+void *spsc_slot(struct spsc *q)
+{
+    unsigned int tail = q->tail;
+
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) > q->mask) {
+	q->dropped++;
+	return NULL;
+    }
+    return q->buf + (tail & q->mask) * q->size;
+}
+
+/* producer: the entry from spsc_slot() is ready */
+void spsc_push(struct spsc *q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* consumer: the oldest entry, NULL when there is none */
+void *spsc_peek(struct spsc *q)
+{
+    unsigned int head = q->head;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+	return NULL;
+    return q->buf + (head & q->mask) * q->size;
+}
+
+/* consumer: done with the entry from spsc_peek() */
+void spsc_pop(struct spsc *q)
+{
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,74 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * Data threads and the lock-free rings between them
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PPPOE_THREAD_H_
+#define _PPPOE_THREAD_H_
+
+#include <pthread.h>
+
+/* keeps what two threads write out of each other's cache lines */
+#define SPSC_LINE   64
+
+/*
+ * A thread moving packets in one direction, started and stopped by the
+ * control thread.  fn loops until worker_stopping() says otherwise; a
+ * system call it is blocked in is interrupted (EINTR) to make it look.
+ */
+struct worker {
+    pthread_t       id;
+    void            (*fn)(struct worker *w);
+    int             cpu;        /* pinned to this one, -1 for any */
+    int             started;
+    int             stop;       /* asked to return */
+    int             done;       /* has returned */
+};
+
+#define worker_stopping(w)  __atomic_load_n(&(w)->stop, __ATOMIC_ACQUIRE)
+#define worker_done(w)      __atomic_load_n(&(w)->done, __ATOMIC_ACQUIRE)
+
+int  worker_init(void);
+int  worker_start(struct worker *w, void (*fn)(struct worker *w), int cpu);
+int  worker_stop(struct worker *w, int ms);
+int  worker_sigfd(const int *sigs, int n);
+int  worker_sigread(int fd);
+long worker_now(void);
+
+/*
+ * Ring of n entries of size bytes, n a power of two, between exactly one
+ * producer and one consumer thread.  Neither side ever waits: a full ring
+ * refuses the entry and an empty one has nothing to give.
+ */
+struct spsc {
+    unsigned int    tail;       /* written by the producer only */
+    char            pad1[SPSC_LINE - sizeof(unsigned int)];
+    unsigned int    head;       /* written by the consumer only */
+    char            pad2[SPSC_LINE - sizeof(unsigned int)];
+    unsigned int    mask;
+    int             size;
+    unsigned char   *buf;
+    unsigned long   dropped;    /* refused for want of room, producer's */
+};
+
+int   spsc_init(struct spsc *q, int n, int size);
+void *spsc_slot(struct spsc *q);
+void  spsc_push(struct spsc *q);
+void *spsc_peek(struct spsc *q);
+void  spsc_pop(struct spsc *q);
+
+#endif /* _PPPOE_THREAD_H_ */
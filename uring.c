@@ -0,0 +1,468 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * io_uring engine for the session socket and the pty
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* syscall() is not ANSI; there is no C library wrapper for io_uring, so
+   the system calls are made directly rather than through liburing */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_URING
+#endif
+#endif
+
+#ifdef HAVE_URING
+/* newer than some kernel headers; opcodes never change once assigned */
+#define URING_OP_READ_MULTISHOT 49
+
+#define SQE(u, i)   (&((struct io_uring_sqe *)(u)->sqes)[i])
+#define CQE(u, i)   (&((struct io_uring_cqe *)(u)->cqes)[i])
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_enter(int fd, unsigned int submit, unsigned int wait,
+		     unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+			NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* which of the operations used here the running kernel knows */
+static void probe(struct uring *u)
+{
+    /* struct io_uring_probe followed by its ops[] */
+    static unsigned long buf[(sizeof(struct io_uring_probe) +
+			      256 * sizeof(struct io_uring_probe_op)) /
+			     sizeof(unsigned long) + 1];
+    struct io_uring_probe *pr = (struct io_uring_probe *)buf;
+
+    memset(buf, 0, sizeof(buf));
+    if (sys_register(u->fd, IORING_REGISTER_PROBE, pr, 256) < 0)
+	return;
+    u->read_multishot = pr->ops_len > URING_OP_READ_MULTISHOT &&
+	(pr->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED);
+    /* multishot receives came two releases before multishot reads; the
+       first completion tells on kernels without them */
+    u->recv_multishot = 1;
+}
+#endif
+
+/*
+ * Set up a ring.  Returns -1, with errno set and nothing printed, when the
+ * kernel has no io_uring or refuses it, so the caller can carry on without.
+ */
+int uring_init(struct uring *u)
+{
+#ifdef HAVE_URING
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+	return -1;
+    /* completions must not be dropped when the queue runs full */
+    if (!(p.features & IORING_FEAT_NODROP)) {
+	close(u->fd);
+	errno = ENOSYS;
+	return -1;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (u->cq_ring_size > u->sq_ring_size)
+	    u->sq_ring_size = u->cq_ring_size;
+	u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	u->cq_ring = u->sq_ring;
+    else {
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	if (u->cq_ring == MAP_FAILED) {
+	    munmap(u->sq_ring, u->sq_ring_size);
+	    goto fail;
+	}
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+	if (u->cq_ring != u->sq_ring)
+	    munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	goto fail;
+    }
+
+    u->sq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+    u->sq_mask = *(unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_next = *u->sq_tail;
+    u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (char *)u->cq_ring + p.cq_off.cqes;
+    probe(u);
+    return 0;
+
+fail:
+    close(u->fd);
+    u->fd = -1;
+    return -1;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void uring_exit(struct uring *u)
+{
+#ifdef HAVE_URING
+    if (u->fd < 0)
+	return;
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring)
+	munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    u->fd = -1;
+#endif
+}
+
+/*
+ * A pool of n buffers of size bytes, n a power of two, for receives that
+ * name 'group'.  All of them are handed to the kernel right away.
+ */
+int uring_bufs_init(struct uring *u, struct uring_bufs *b, int group,
+		    int n, int size)
+{
+#ifdef HAVE_URING
+    struct io_uring_buf_reg reg;
+    size_t len = n * sizeof(struct io_uring_buf);
+    int i;
+
+    memset(b, 0, sizeof(*b));
+    b->n = n;
+    b->size = size;
+    b->group = group;
+    /* the ring must be page aligned, which mmap() takes care of */
+    b->ring = mmap(NULL, len + (size_t)n * size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED) {
+	b->ring = NULL;
+	return -1;
+    }
+    b->mem = (unsigned char *)b->ring + len;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->ring;
+    reg.ring_entries = n;
+    reg.bgid = group;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+	uring_bufs_exit(b);
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+	uring_buf_put(b, i);
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* the ring is unregistered with the uring itself, by uring_exit() */
+void uring_bufs_exit(struct uring_bufs *b)
+{
+#ifdef HAVE_URING
+    if (b->ring != NULL)
+	munmap(b->ring, b->n * (sizeof(struct io_uring_buf) + b->size));
+    b->ring = NULL;
+#endif
+}
+
+/* give a buffer back to the kernel */
+void uring_buf_put(struct uring_bufs *b, int bid)
+{
+#ifdef HAVE_URING
+    struct io_uring_buf_ring *br = b->ring;
+    struct io_uring_buf *buf = &br->bufs[b->tail & (b->n - 1)];
+
+    buf->addr = (unsigned long)uring_buf(b, bid);
+    buf->len = b->size;
+    buf->bid = bid;
+    store_release(&br->tail, ++b->tail);
+#endif
+}
+
+/* pin buffers for uring_write_fixed(), which names them by index */
+int uring_register(struct uring *u, struct iovec *iov, int n)
+{
+#ifdef HAVE_URING
+    return sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, n);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifdef HAVE_URING
+/* next free entry, submitting what is prepared if the queue is full */
+static struct io_uring_sqe *get_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int i;
+
+    if (u->sq_next - load_acquire(u->sq_head) >= u->sq_entries &&
+	(uring_submit(u) < 0 ||
+	 u->sq_next - load_acquire(u->sq_head) >= u->sq_entries))
+	return NULL;
+    i = u->sq_next & u->sq_mask;
+    sqe = SQE(u, i);
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[i] = i;
+    u->sq_next++;
+    return sqe;
+}
+
+static int prep(struct uring *u, int op, int fd, void *buf, int len,
+		unsigned long tag, struct io_uring_sqe **out)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe(u)) == NULL) {
+	errno = EBUSY;
+	return -1;
+    }
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = tag;
+    *out = sqe;
+    return 0;
+}
+#endif
+
+/* datagrams from fd, each into a buffer of b, for as long as possible */
+int uring_recv(struct uring *u, int fd, struct uring_bufs *b,
+	       unsigned long tag)
+{
+#ifdef HAVE_URING
+    struct io_uring_sqe *sqe;
+
+    if (prep(u, IORING_OP_RECV, fd, NULL, 0, tag, &sqe) < 0)
+	return -1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = b->group;
+    if (u->recv_multishot)
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* whatever fd has, into buffers of b; multishot where the kernel can */
+int uring_read(struct uring *u, int fd, struct uring_bufs *b,
+	       unsigned long tag)
+{
+#ifdef HAVE_URING
+    struct io_uring_sqe *sqe;
+
+    if (prep(u, u->read_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ,
+	     fd, NULL, 0, tag, &sqe) < 0)
+	return -1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = b->group;
+    /* not seekable: read at the current position */
+    sqe->off = (unsigned long)-1;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* buf must stay put until the completion */
+int uring_send(struct uring *u, int fd, void *buf, int len,
+	       unsigned long tag)
+{
+#ifdef HAVE_URING
+    struct io_uring_sqe *sqe;
+
+    return prep(u, IORING_OP_SEND, fd, buf, len, tag, &sqe);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* buf lies within registered buffer 'index' */
+int uring_write_fixed(struct uring *u, int fd, void *buf, int len,
+		      int index, unsigned long tag)
+{
+#ifdef HAVE_URING
+    struct io_uring_sqe *sqe;
+
+    if (prep(u, IORING_OP_WRITE_FIXED, fd, buf, len, tag, &sqe) < 0)
+	return -1;
+    sqe->buf_index = index;
+    sqe->off = (unsigned long)-1;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * Hand everything prepared to the kernel in one call.  The count is what
+ * the kernel has not taken yet rather than what was prepared since the
+ * last call, so entries left over from a short submit, or one that failed
+ * with EBUSY or EAGAIN, go again instead of waiting for new ones.
+ */
+int uring_submit(struct uring *u)
+{
+#ifdef HAVE_URING
+    unsigned int n;
+    int c;
+
+    store_release(u->sq_tail, u->sq_next);
+    n = *u->sq_tail - load_acquire(u->sq_head);
+    if (n == 0)
+	return 0;
+    u->enters++;
+    while ((c = sys_enter(u->fd, n, 0, 0)) < 0 && errno == EINTR)
+	;
+    if (c > 0)
+	u->submitted += c;
+    return c;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifdef HAVE_URING
+/* up to max completions straight from the completion queue */
+static int reap_cq(struct uring *u, struct uring_cqe *cqe, int max)
+{
+    struct io_uring_cqe *c;
+    unsigned int head, tail;
+    int n;
+
+    head = *u->cq_head;
+    tail = load_acquire(u->cq_tail);
+    for (n = 0; n < max && head != tail; head++, n++) {
+	c = CQE(u, head & u->cq_mask);
+	cqe[n].tag = (unsigned long)c->user_data;
+	cqe[n].res = c->res;
+	cqe[n].bid = (c->flags & IORING_CQE_F_BUFFER) ?
+	    (int)(c->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+	cqe[n].more = (c->flags & IORING_CQE_F_MORE) != 0;
+    }
+    store_release(u->cq_head, head);
+    return n;
+}
+#endif
+
+/*
+ * Up to max completions, without waiting, in the order they were posted:
+ * those uring_wait() set aside come first.
+ */
+int uring_reap(struct uring *u, struct uring_cqe *cqe, int max)
+{
+#ifdef HAVE_URING
+    int n = u->nstash < max ? u->nstash : max;
+
+    if (n > 0) {
+	memcpy(cqe, u->stash, n * sizeof(*cqe));
+	u->nstash -= n;
+	memmove(u->stash, u->stash + n, u->nstash * sizeof(*cqe));
+    }
+    return n + reap_cq(u, cqe + n, max - n);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Block until a completion of 'kind' arrives.  Others that turn up in the
+ * meantime are set aside for the next uring_reap().
+ */
+int uring_wait(struct uring *u, int kind, struct uring_cqe *cqe)
+{
+#ifdef HAVE_URING
+    int i;
+
+    for (i = 0; i < u->nstash; i++)
+	if (URING_KIND(u->stash[i].tag) == kind) {
+	    *cqe = u->stash[i];
+	    u->nstash--;
+	    memmove(&u->stash[i], &u->stash[i + 1],
+		    (u->nstash - i) * sizeof(*cqe));
+	    return 0;
+	}
+    if (uring_submit(u) < 0)
+	return -1;
+    while (1) {
+	while (u->nstash < URING_STASH && reap_cq(u, cqe, 1) == 1) {
+	    if (URING_KIND(cqe->tag) == kind)
+		return 0;
+	    u->stash[u->nstash++] = *cqe;
+	}
+	if (u->nstash == URING_STASH) {
+	    errno = ENOBUFS;
+	    return -1;
+	}
+	u->enters++;
+	if (sys_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+	    errno != EINTR)
+	    return -1;
+    }
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
@@ -0,0 +1,111 @@
+/*
+ * pppoe, a PPP-over-Ethernet redirector
+ * io_uring engine for the session socket and the pty
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PPPOE_URING_H_
+#define _PPPOE_URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* submission queue entries; the completion queue gets twice as many */
+#define URING_ENTRIES   256
+/* completions uring_wait() can set aside; every operation in flight
+   holds a buffer, so the pools below bound what can pile up */
+#define URING_STASH     512
+
+/* what the caller wants back with a completion */
+#define URING_TAG(kind, i)  (((unsigned long)(kind) << 16) | (i))
+#define URING_KIND(tag)     ((int)((tag) >> 16))
+#define URING_INDEX(tag)    ((int)((tag) & 0xffff))
+
+struct uring_cqe {
+    unsigned long   tag;
+    int             res;        /* bytes, or -errno */
+    int             bid;        /* buffer picked from a pool, -1 for none */
+    int             more;       /* a multishot request stays posted */
+};
+
+/*
+ * A pool of equal buffers handed to the kernel through a buffer ring:
+ * receives pick one when data arrives, and the caller gives it back with
+ * uring_buf_put() once done with it.
+ */
+struct uring_bufs {
+    void            *ring;      /* struct io_uring_buf_ring */
+    int             n;          /* a power of two */
+    int             size;       /* bytes per buffer */
+    int             group;
+    unsigned short  tail;
+    unsigned char   *mem;
+};
+
+#define uring_buf(b, bid)   ((b)->mem + (bid) * (b)->size)
+
+struct uring {
+    int             fd;
+    /* submission queue, shared with the kernel */
+    unsigned int    *sq_head;
+    unsigned int    *sq_tail;
+    unsigned int    *sq_array;
+    unsigned int    sq_mask;
+    unsigned int    sq_entries;
+    unsigned int    sq_next;    /* tail once prepared entries are out */
+    void            *sqes;
+    /* completion queue, shared with the kernel */
+    unsigned int    *cq_head;
+    unsigned int    *cq_tail;
+    unsigned int    cq_mask;
+    void            *cqes;
+    /* the mappings behind them */
+    void            *sq_ring;
+    void            *cq_ring;
+    size_t          sq_ring_size;
+    size_t          cq_ring_size;
+    size_t          sqes_size;
+    /* what the kernel can do */
+    int             read_multishot;
+    int             recv_multishot;
+    /* completions uring_wait() took out of turn */
+    struct uring_cqe stash[URING_STASH];
+    int             nstash;
+    /* statistics */
+    unsigned long   enters;     /* system calls */
+    unsigned long   submitted;  /* requests handed over with them */
+};
+
+int  uring_init(struct uring *u);
+void uring_exit(struct uring *u);
+int  uring_bufs_init(struct uring *u, struct uring_bufs *b, int group,
+		     int n, int size);
+void uring_bufs_exit(struct uring_bufs *b);
+void uring_buf_put(struct uring_bufs *b, int bid);
+int  uring_register(struct uring *u, struct iovec *iov, int n);
+int  uring_recv(struct uring *u, int fd, struct uring_bufs *b,
+		unsigned long tag);
+int  uring_read(struct uring *u, int fd, struct uring_bufs *b,
+		unsigned long tag);
+int  uring_send(struct uring *u, int fd, void *buf, int len,
+		unsigned long tag);
+int  uring_write_fixed(struct uring *u, int fd, void *buf, int len,
+		       int index, unsigned long tag);
+int  uring_submit(struct uring *u);
+int  uring_reap(struct uring *u, struct uring_cqe *cqe, int max);
+int  uring_wait(struct uring *u, int kind, struct uring_cqe *cqe);
+
+#endif /* _PPPOE_URING_H_ */